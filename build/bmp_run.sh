@@ -21,12 +21,49 @@ function init {
 		exit 1
 	fi
 
+	make variants
+	if [ $? -ne 0 ]; then
+		echo -e "${RED}Build variants failed!${RESET}"
+		exit 1
+	fi
+
+	# libbmp.so must export the Bmp_ functions of libbmp.h and nothing else.
+	make lib && ! nm -D --defined-only libbmp.so | awk '{ print $3 }' | grep -qv '^Bmp_'
+	if [ $? -ne 0 ]; then
+		echo -e "${RED}libbmp.so exports more than the Bmp_ functions!${RESET}"
+		exit 1
+	fi
+
 	mkdir -p output
 	mkdir -p output/basic_commands
 	mkdir -p output/insert_image
 	mkdir -p output/draw_commands
 	mkdir -p output/fill_color
 	mkdir -p output/mix_commands
+	mkdir -p output/canvas_commands
+	mkdir -p output/alloc_commands
+	mkdir -p output/save_commands
+	mkdir -p output/large_image
+}
+
+function le32 {
+	for shift in 0 8 16 24; do
+		printf "\\\\x%02x" $((($1 >> shift) & 255))
+	done
+}
+
+# Writes a sparse black BMP image: the headers, then a hole up to the file size.
+function sparse_bmp {
+	file="$1"
+	width="$2"
+	height="$3"
+	line=$(((width * 3 + 3) / 4 * 4))
+	size=$((54 + line * height))
+
+	printf "BM$(le32 $size)\\x00\\x00\\x00\\x00$(le32 54)" > "$file"
+	printf "$(le32 40)$(le32 $width)$(le32 $height)\\x01\\x00\\x18\\x00" >> "$file"
+	printf "$(le32 0)$(le32 $((line * height)))$(le32 0)$(le32 0)$(le32 0)$(le32 0)" >> "$file"
+	truncate -s $size "$file"
 }
 
 function print_result {
@@ -128,7 +165,7 @@ function check_task {
     echo " "
 
 	start_test_id=0
-	end_test_id=3
+	end_test_id=5
 
 	printf "${CYAN}%s............................Draw Commands..........................\n"
 
@@ -245,6 +282,245 @@ function check_task {
 		rm -f "$output_file"
 	done
 
+    echo " "
+
+	start_test_id=0
+	end_test_id=1
+
+	printf "${CYAN}%s............................Canvas Commands........................\n"
+
+	for test_id in $(seq $start_test_id $end_test_id); do
+		test_file="./input/canvas_commands/input${test_id}.txt"
+		ref_file="./ref/canvas_commands/output${test_id}.bmp"
+		output_file="./output/canvas_commands/output${test_id}.bmp"
+	
+		./$EXEC < "$test_file"
+
+		diff "$output_file" "$ref_file" &> /dev/null
+		ret=$?
+
+		if [ $ret == 0 ]; then
+			print_result "$test_id" "passed"
+		else 
+			print_result "$test_id" "failed"
+		fi
+
+		if [ $ret == 0 ]; then
+			valgrind --tool=memcheck --leak-check=full --error-exitcode=1 "./$EXEC < $input_file" &>/dev/null
+
+			if [ $? == 1 ]; then
+				print_result "valgrind" "failed"
+				valgrind_err=1
+			else 
+				print_result "valgrind" "passed"
+			fi
+		else 
+			print_result "valgrind" "failed"
+			valgrind_err=1
+		fi
+
+		rm -f "$output_file" ./output/canvas_commands/*.bmp
+	done
+
+    echo " "
+
+	start_test_id=0
+	end_test_id=1
+
+	printf "${CYAN}%s............................Allocations............................\n"
+
+	# Test 1 repeats the draws and fills of test 0 four times on bands: once the
+	# scratch memory fits them, the repeats make no more heap allocations (test 2).
+	for test_id in $(seq $start_test_id $end_test_id); do
+		test_file="./input/alloc_commands/input${test_id}.txt"
+		ref_file="./ref/alloc_commands/output${test_id}.bmp"
+		output_file="./output/alloc_commands/output${test_id}.bmp"
+
+		allocs[$test_id]=$(./$EXEC --threads 4 --stats < "$test_file" 2>&1 | grep "^ALLOCS:" | cut -d ' ' -f 2)
+
+		diff "$output_file" "$ref_file" &> /dev/null
+		ret=$?
+
+		if [ $ret == 0 ]; then
+			print_result "$test_id" "passed"
+		else 
+			print_result "$test_id" "failed"
+		fi
+
+		rm -f "$output_file"
+	done
+
+	if [ -n "${allocs[0]}" ] && [ "${allocs[0]}" == "${allocs[1]}" ]; then
+		print_result "2" "passed"
+	else 
+		print_result "2" "failed"
+	fi
+
+    echo " "
+
+	printf "${CYAN}%s............................Save In Place..........................\n"
+
+	# Test 0 saves an image over the file it was edited from, twice, with a
+	# canvas of the same file parked meanwhile; test 1 saves that canvas after.
+	# Test 2 saves on a full device: the failed write must be reported.
+	test_file="./input/save_commands/input0.txt"
+	./$EXEC < "$test_file" 2> /dev/null
+	status=$?
+
+	for test_id in 0 1; do
+		ref_file="./ref/save_commands/output${test_id}.bmp"
+		output_file="./output/save_commands/output${test_id}.bmp"
+
+		diff "$output_file" "$ref_file" &> /dev/null
+		ret=$?
+
+		if [ $ret == 0 ] && [ $status == 0 ]; then
+			print_result "$test_id" "passed"
+		else 
+			print_result "$test_id" "failed"
+		fi
+
+		rm -f "$output_file"
+	done
+
+	if printf "edit images/blank.bmp\nsave /dev/full\nquit\n" | ./$EXEC 2>&1 | grep -q "saves failed"; then
+		print_result "2" "passed"
+	else 
+		print_result "2" "failed"
+	fi
+
+    echo " "
+
+	printf "${CYAN}%s............................Batch Mode.............................\n"
+
+	# Test 0 runs the draw and mix scripts together, on a pool of workers.
+	batch_tests="draw_commands mix_commands"
+	batch_files=$(for task in $batch_tests; do ls ./input/$task/input*.txt; done)
+
+	./$EXEC --jobs 4 --batch $batch_files > /dev/null
+
+	ret=0
+	for test_file in $batch_files; do
+		task=$(basename $(dirname "$test_file"))
+		test_id=$(basename "$test_file" .txt)
+		test_id=${test_id#input}
+		diff "./output/$task/output${test_id}.bmp" "./ref/$task/output${test_id}.bmp" &> /dev/null || ret=1
+		rm -f "./output/$task/output${test_id}.bmp"
+	done
+
+	if [ $ret == 0 ]; then
+		print_result "0" "passed"
+	else 
+		print_result "0" "failed"
+	fi
+
+    echo " "
+
+	printf "${CYAN}%s............................Serve Mode.............................\n"
+
+	# Test 0 sends the draw scripts to a server at once, test 1 splits a script
+	# over two requests of a session and gets the image back, checks that only
+	# the owner may use the socket, then stops the server.
+	socket="./output/serve.sock"
+	./$EXEC --jobs 4 --serve $socket 2> /dev/null &
+	server=$!
+	for wait_id in $(seq 50); do
+		[ -S $socket ] && break
+		sleep 0.1
+	done
+
+	clients=""
+	for test_file in ./input/draw_commands/input*.txt; do
+		./$EXEC --connect $socket RUN < "$test_file" 2> /dev/null &
+		clients="$clients $!"
+	done
+	wait $clients
+
+	ret=0
+	for test_file in ./input/draw_commands/input*.txt; do
+		test_id=$(basename "$test_file" .txt)
+		test_id=${test_id#input}
+		diff "./output/draw_commands/output${test_id}.bmp" "./ref/draw_commands/output${test_id}.bmp" &> /dev/null || ret=1
+		rm -f "./output/draw_commands/output${test_id}.bmp"
+	done
+
+	if [ $ret == 0 ]; then
+		print_result "0" "passed"
+	else 
+		print_result "0" "failed"
+	fi
+
+	test_file="./input/draw_commands/input1.txt"
+	ref_file="./ref/draw_commands/output1.bmp"
+	ret=0
+	(head -n 1 "$test_file"; echo "quit") | ./$EXEC --connect $socket RUN test 2> /dev/null || ret=1
+	tail -n +2 "$test_file" | ./$EXEC --connect $socket IMAGE test > ./output/serve.bmp 2> /dev/null || ret=1
+	diff ./output/serve.bmp "$ref_file" &> /dev/null || ret=1
+	diff ./output/draw_commands/output1.bmp "$ref_file" &> /dev/null || ret=1
+	[ "$(stat -c %a $socket)" == "600" ] || ret=1
+	./$EXEC --connect $socket SHUTDOWN 2> /dev/null || ret=1
+	wait $server || ret=1
+	[ -e $socket ] && ret=1
+
+	if [ $ret == 0 ]; then
+		print_result "1" "passed"
+	else 
+		print_result "1" "failed"
+	fi
+
+	rm -f ./output/serve.bmp ./output/draw_commands/output1.bmp
+
+    echo " "
+
+	start_test_id=0
+	end_test_id=1
+
+	printf "${CYAN}%s............................Large Image............................\n"
+
+	# Test 0 draws in place on a 20000x20000 mapping, test 1 on a padded
+	# 20001x20000 image held in a file of the canvas directory.
+	sparse_bmp ./output/large_image/sparse0.bmp 20000 20000
+	sparse_bmp ./output/large_image/sparse1.bmp 20001 20000
+
+	for test_id in $(seq $start_test_id $end_test_id); do
+		test_file="./input/large_image/input${test_id}.txt"
+		ref_file="./ref/large_image/output${test_id}.bmp"
+		output_file="./output/large_image/output${test_id}.bmp"
+		options=""
+		if [ $test_id == 1 ]; then
+			options="--canvas-dir ./output/large_image"
+		fi
+	
+		./$EXEC $options < "$test_file"
+
+		diff "$output_file" "$ref_file" &> /dev/null
+		ret=$?
+
+		if [ $ret == 0 ]; then
+			print_result "$test_id" "passed"
+		else 
+			print_result "$test_id" "failed"
+		fi
+
+		if [ $ret == 0 ]; then
+			valgrind --tool=memcheck --leak-check=full --error-exitcode=1 "./$EXEC < $input_file" &>/dev/null
+
+			if [ $? == 1 ]; then
+				print_result "valgrind" "failed"
+				valgrind_err=1
+			else 
+				print_result "valgrind" "passed"
+			fi
+		else 
+			print_result "valgrind" "failed"
+			valgrind_err=1
+		fi
+
+		rm -f "$output_file" ./output/large_image/large${test_id}.bmp
+	done
+
+	rm -f ./output/large_image/sparse*.bmp
+
     echo -e " "
 }
 
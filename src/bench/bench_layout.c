@@ -0,0 +1,117 @@
+#include <time.h>
+
+#include "../include/bmp_image.h"
+#include "../include/lib/cmd_draw.h"
+#include "../include/lib/cmd_fill.h"
+#include "../include/lib/cmd_span.h"
+
+#define LAYOUT_WIDTH  16384 // WIDTH OF THE CANVAS (PIXELS)
+#define LAYOUT_HEIGHT 2048  // HEIGHT OF THE CANVAS (PIXELS)
+#define LAYOUT_LINES  2000  // VERTICAL LINES DRAWN
+#define LAYOUT_BRUSH  63    // SIZE OF THE LARGE BRUSH
+#define LAYOUT_STROKES 200  // LINES DRAWN WITH THE LARGE BRUSH
+
+/**
+ * @brief Reads the monotonic clock.
+ * 
+ * @return The current time in seconds.
+ */
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Builds a white canvas in the layout of this build.
+ * 
+ * @param bmp The BMP structure to fill in.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE if out of memory.
+ */
+static u_int8_t Create_Canvas(BMP *bmp) {
+    SPAN_INIT();
+    memset(bmp, 0, sizeof(*bmp));
+    bmp->info.width = LAYOUT_WIDTH;
+    bmp->info.height = LAYOUT_HEIGHT;
+    bmp->info.bit_pix = SIZE_RGB;
+    bmp->brush_size = 1;
+    bmp->threads = 1;
+
+    bmp->img = (u_int8_t*)malloc(IMG_BYTES(LAYOUT_WIDTH, LAYOUT_HEIGHT));
+    bmp->brush_color = (u_int8_t*)malloc(SIZE_BRUSH);
+    if (!bmp->img || !bmp->brush_color)
+        return EXIT_FAILURE;
+
+    memset(bmp->img, 0xFF, IMG_BYTES(LAYOUT_WIDTH, LAYOUT_HEIGHT));
+    return SET_COLOR(bmp, 200, 30, 30);
+}
+
+/**
+ * @brief Vertical lines over the whole height, one pixel wide.
+ */
+static void Vertical_Lines(BMP *bmp) {
+    SET_LINE(bmp, 1);
+    for (int i = 0; i < LAYOUT_LINES; i++) {
+        int col = (int)((i * 7919L) % LAYOUT_WIDTH);
+        LINE(bmp, col, 0, col, LAYOUT_HEIGHT - 1);
+    }
+}
+
+/**
+ * @brief Steep lines drawn with a large brush.
+ */
+static void Large_Brush(BMP *bmp) {
+    SET_LINE(bmp, LAYOUT_BRUSH);
+    for (int i = 0; i < LAYOUT_STROKES; i++) {
+        int col = (int)((i * 7919L) % LAYOUT_WIDTH);
+        LINE(bmp, col, 0, col + LAYOUT_HEIGHT / 8, LAYOUT_HEIGHT - 1);
+    }
+}
+
+/**
+ * @brief Fills the whole blank canvas, twice.
+ */
+static void Fill_Canvas(BMP *bmp) {
+    SET_COLOR(bmp, 30, 200, 30);
+    FILL(bmp, LAYOUT_WIDTH / 2, LAYOUT_HEIGHT / 2);
+    SET_COLOR(bmp, 200, 30, 30);
+    FILL(bmp, LAYOUT_WIDTH / 2, LAYOUT_HEIGHT / 2);
+}
+
+/**
+ * @brief Fills the areas between the vertical lines, across the large brush strokes.
+ */
+static void Fill_Stripes(BMP *bmp) {
+    SET_COLOR(bmp, 30, 30, 200);
+    for (int i = 0; i < LAYOUT_STROKES; i++) {
+        int col = (int)((i * 7919L + LAYOUT_WIDTH / 2) % LAYOUT_WIDTH);
+        FILL(bmp, col, LAYOUT_HEIGHT / 2);
+    }
+}
+
+int main(void) {
+    const char *names[] = { "fill", "vertical lines", "large brush", "fill stripes" };
+    void (*workloads[])(BMP*) = { Fill_Canvas, Vertical_Lines, Large_Brush, Fill_Stripes };
+    BMP bmp;
+
+    if (Create_Canvas(&bmp)) {
+        fprintf(stderr, "ERROR: canvas allocation failed...\n");
+        FREE_BMP(&bmp);
+        FREE_BRUSH(&bmp);
+        return EXIT_FAILURE;
+    }
+
+    printf("%s %s layout, %dx%d canvas\n", IMG_BGRX ? "BGRX" : "BGR",
+           IMG_TILED ? "tiled" : "row-major",
+           LAYOUT_WIDTH, LAYOUT_HEIGHT);
+    for (int i = 0; i < 4; i++) {
+        double start = Now();
+        workloads[i](&bmp);
+        printf("%16s  %8.1f ms\n", names[i], (Now() - start) * 1e3);
+    }
+
+    FREE_BMP(&bmp);
+    FREE_BRUSH(&bmp);
+    FREE_STACK(&bmp);
+    return EXIT_SUCCESS;
+}
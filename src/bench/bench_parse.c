@@ -0,0 +1,135 @@
+#include <time.h>
+
+#include "../include/bmp_image.h"
+#include "../include/api/lexer.h"
+
+#define PARSE_LINES   2000000 // DEFAULT COMMANDS OF THE SCRIPT
+#define PARSE_WORD    101   // LONGEST WORD READ BY SCANF
+#define SIZE_MB       (1024.0 * 1024.0)
+
+/**
+ * @brief Reads the monotonic clock.
+ * 
+ * @return The current time in seconds.
+ */
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Writes a generated script: mostly "draw line", with a few "set" commands.
+ * 
+ * @param file  The script file.
+ * @param lines The number of commands.
+ */
+static void Write_Script(FILE *file, long lines) {
+    unsigned int seed = 42;
+
+    for (long i = 0; i < lines; i++) {
+        seed = seed * 1103515245u + 12345u;
+        if (seed % 64 == 0)
+            fprintf(file, "set draw_color %u %u %u\n", seed >> 24, (seed >> 16) & 255, (seed >> 8) & 255);
+        else
+            fprintf(file, "draw line %u %u %u %u\n",
+                    seed % 2048, (seed >> 5) % 2048, (seed >> 10) % 2048, (seed >> 15) % 2048);
+    }
+    fprintf(file, "quit\n");
+}
+
+/**
+ * @brief Parses the script with scanf, the way the interpreter used to.
+ * 
+ * @param file The script file.
+ * @return The sum of the numbers read.
+ */
+static long long Parse_Scanf(FILE *file) {
+    char word[PARSE_WORD];
+    long long sum = 0;
+    int v[4];
+    u_int8_t c[3];
+
+    while (fscanf(file, "%100s", word) == 1 && strcmp(word, "quit")) {
+        if (!strcmp(word, "draw")) {
+            if (fscanf(file, "%100s", word) != 1) break;
+            if (fscanf(file, "%d%d%d%d", &v[0], &v[1], &v[2], &v[3]) != 4) break;
+            sum += v[0] + v[1] + v[2] + v[3];
+        } else if (!strcmp(word, "set")) {
+            if (fscanf(file, "%100s", word) != 1) break;
+            if (fscanf(file, "%hhu%hhu%hhu", &c[0], &c[1], &c[2]) != 3) break;
+            sum += c[0] + c[1] + c[2];
+        }
+    }
+
+    return sum;
+}
+
+/**
+ * @brief Parses the script with the lexer of the interpreter.
+ * 
+ * @param fd The script file descriptor.
+ * @return The sum of the numbers read.
+ */
+static long long Parse_Lexer(int fd) {
+    LEXER lex;
+    const char *word = NULL;
+    size_t length = 0;
+    long long sum = 0;
+    int v[4];
+    u_int8_t c[3];
+
+    if (LEX_OPEN(&lex, fd))
+        return -1;
+
+    while (!LEX_WORD(&lex, &word, &length) && !LEX_MATCH(word, length, "quit")) {
+        if (LEX_MATCH(word, length, "draw")) {
+            if (LEX_WORD(&lex, &word, &length)) break;
+            if (LEX_INT(&lex, &v[0]) || LEX_INT(&lex, &v[1]) ||
+                LEX_INT(&lex, &v[2]) || LEX_INT(&lex, &v[3])) break;
+            sum += v[0] + v[1] + v[2] + v[3];
+        } else if (LEX_MATCH(word, length, "set")) {
+            if (LEX_WORD(&lex, &word, &length)) break;
+            if (LEX_BYTE(&lex, &c[0]) || LEX_BYTE(&lex, &c[1]) || LEX_BYTE(&lex, &c[2])) break;
+            sum += c[0] + c[1] + c[2];
+        }
+    }
+
+    LEX_CLOSE(&lex);
+    return sum;
+}
+
+int main(int argc, char **argv) {
+    long lines = argc > 1 ? strtol(argv[1], NULL, 10) : PARSE_LINES;
+    if (lines <= 0) {
+        fprintf(stderr, "usage: %s [commands]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *file = tmpfile();
+    if (!file) return EXIT_FAILURE;
+    Write_Script(file, lines);
+    fflush(file);
+    double megabytes = ftell(file) / SIZE_MB;
+
+    rewind(file);
+    double start = Now();
+    long long scanf_sum = Parse_Scanf(file);
+    double scanf_time = Now() - start;
+
+    lseek(fileno(file), 0, SEEK_SET);
+    start = Now();
+    long long lexer_sum = Parse_Lexer(fileno(file));
+    double lexer_time = Now() - start;
+
+    fclose(file);
+    if (scanf_sum != lexer_sum) {
+        fprintf(stderr, "ERROR: lexer and scanf disagree...\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%ld commands, %.1f MB\n", lines, megabytes);
+    printf("%8s  %10.1f Mcmd/s  %8.1f MB/s\n", "scanf", lines / scanf_time / 1e6, megabytes / scanf_time);
+    printf("%8s  %10.1f Mcmd/s  %8.1f MB/s\n", "lexer", lines / lexer_time / 1e6, megabytes / lexer_time);
+    return EXIT_SUCCESS;
+}
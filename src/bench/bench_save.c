@@ -0,0 +1,166 @@
+#include <time.h>
+
+#include "../include/bmp_image.h"
+#include "../include/lib/cmd_insert.h"
+#include "../include/lib/cmd_span.h"
+
+#define SAVE_REPEAT   3     // RUNS PER WRITER, THE BEST ONE IS REPORTED
+#define SIZE_MB       (1024.0 * 1024.0)
+
+/**
+ * @brief Reads the monotonic clock.
+ * 
+ * @return The current time in seconds.
+ */
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Reference writer: one fwrite for the pixels and one for the padding of every row.
+ * This is the writer SAVE used before batching rows into vectored writes.
+ * 
+ * @param file The name of the file to save the image to.
+ * @param bmp  The BMP structure containing the image data.
+ * @return EXIT_SUCCESS if the image is successfully saved, EXIT_FAILURE otherwise.
+ */
+static u_int8_t Legacy_Save(char *file, BMP *bmp) {
+    FILE *fout = fopen(file, "wb");
+    if (!fout) return EXIT_FAILURE;
+
+    bmp_fileheader header = { 'B', 'M', 0, 0, 0, SIZE_BMP };
+    header.bf_size = SIZE_BMP + bmp->info.width * bmp->info.height * SIZE_COLOR;
+
+    u_int8_t status = EXIT_SUCCESS;
+    if (fwrite(&header, sizeof(header), 1, fout) != 1 ||
+        fwrite(&bmp->info, sizeof(bmp->info), 1, fout) != 1)
+        status = EXIT_FAILURE;
+
+    size_t padding = CALCULATE_PADDING(bmp->info.width);
+    size_t width = WIDTH((size_t)bmp->info.width);
+    int byte = 0; // PADDING BYTE!
+
+    for (int l = 0; l < bmp->info.height && !status; l++) {
+        if (fwrite(bmp->img + l * width, 1, width, fout) != width ||
+            fwrite(&byte, 1, padding, fout) != padding)
+            status = EXIT_FAILURE;
+    }
+
+    if (fclose(fout)) status = EXIT_FAILURE;
+    return status;
+}
+
+/**
+ * @brief Builds a synthetic image by tiling a source image scale x scale times.
+ * 
+ * @param dst   The BMP structure receiving the tiled image.
+ * @param src   The source image.
+ * @param scale The number of tiles on each axis.
+ * @return EXIT_SUCCESS if the image is built, EXIT_FAILURE otherwise.
+ */
+static u_int8_t Scale_BMP(BMP *dst, BMP *src, int scale) {
+    size_t src_width = WIDTH((size_t)src->info.width);
+    size_t width = src_width * scale;
+    size_t height = (size_t)src->info.height * scale;
+
+    dst->info = src->info;
+    dst->info.width = src->info.width * scale;
+    dst->info.height = src->info.height * scale;
+
+    size_t image = (width + CALCULATE_PADDING(dst->info.width)) * height;
+    dst->info.bi_size_image = image > UINT32_MAX ? 0 : (u_int32_t)image;
+
+    dst->img = (u_int8_t*)malloc(width * height);
+    if (!dst->img) return EXIT_FAILURE;
+
+    for (size_t l = 0; l < height; l++) {
+        const u_int8_t *row = src->img + (l % src->info.height) * src_width;
+        for (int t = 0; t < scale; t++)
+            memcpy(dst->img + l * width + t * src_width, row, src_width);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Saves the BMP image and waits for the background writer to be done.
+ * 
+ * @param file The name of the file to save the image to.
+ * @param bmp  The BMP structure containing the image data.
+ * @return EXIT_SUCCESS if the image is successfully saved, EXIT_FAILURE otherwise.
+ */
+static u_int8_t Whole_Save(char *file, BMP *bmp) {
+    if (SAVE(file, bmp))
+        return EXIT_FAILURE;
+    return SAVE_WAIT(bmp);
+}
+
+/**
+ * @brief Times the best of SAVE_REPEAT runs of a writer.
+ * 
+ * @param writer The writer to time.
+ * @param file   The name of the file to save the image to.
+ * @param bmp    The BMP structure containing the image data.
+ * @return The best time in seconds, or a negative value if the writer failed.
+ */
+static double Time_Save(u_int8_t (*writer)(char*, BMP*), char *file, BMP *bmp) {
+    double best = -1;
+
+    for (int i = 0; i < SAVE_REPEAT; i++) {
+        double start = Now();
+        if (writer(file, bmp))
+            return -1;
+        double elapsed = Now() - start;
+        if (best < 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    return best;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <image.bmp> [scale] [output.bmp]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char output[] = "bench_save.bmp";
+    int scale = argc > 2 ? atoi(argv[2]) : 1;
+    char *file = argc > 3 ? argv[3] : output;
+
+    BMP src, bmp;
+    SPAN_INIT();
+    memset(&src, 0, sizeof(src));
+    memset(&bmp, 0, sizeof(bmp));
+
+    if (scale < 1 || EDIT(argv[1], &src) || Scale_BMP(&bmp, &src, scale)) {
+        fprintf(stderr, "ERROR: loading %s...\n", argv[1]);
+        FREE_BMP(&src);
+        return EXIT_FAILURE;
+    }
+    FREE_BMP(&src);
+
+    double size = (WIDTH((double)bmp.info.width) + CALCULATE_PADDING(bmp.info.width))
+                * bmp.info.height / SIZE_MB;
+    double legacy = Time_Save(Legacy_Save, file, &bmp);
+    double save = Time_Save(Whole_Save, file, &bmp);
+
+    // Time the interpreter waits for SAVE, the file is written in the background.
+    double start = Now();
+    u_int8_t status = SAVE(file, &bmp);
+    double blocked = Now() - start;
+    if (SAVE_WAIT(&bmp) || status)
+        save = -1;
+    FREE_BMP(&bmp);
+
+    if (legacy < 0 || save < 0) {
+        fprintf(stderr, "ERROR: saving %s...\n", file);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-28s %6dx%-6d %9.1f MB   legacy %8.1f MB/s   save %8.1f MB/s   blocks %7.3f ms\n",
+           argv[1], bmp.info.width, bmp.info.height, size, size / legacy, size / save, blocked * 1e3);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,73 @@
+#include <time.h>
+
+#include "../include/bmp_image.h"
+#include "../include/lib/cmd_span.h"
+
+#define SPAN_MAX      16384 // LONGEST SPAN MEASURED (PIXELS)
+#define SPAN_BYTES    (1 << 28) // BYTES WRITTEN PER MEASURE
+#define SIZE_GB       (1024.0 * 1024.0 * 1024.0)
+
+/**
+ * @brief Reads the monotonic clock.
+ * 
+ * @return The current time in seconds.
+ */
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Times a span kernel writing spans of one length over a row.
+ * Spans are written one after the other over the buffer, so short spans are
+ * measured unaligned, as they are on the image.
+ * 
+ * @param kernel The span kernel.
+ * @param row    The buffer written.
+ * @param count  The length of the spans, in pixels.
+ * @return The throughput in GB/s.
+ */
+static double Time_Span(SPAN_FN kernel, u_int8_t *row, size_t count) {
+    const u_int8_t color[SIZE_COLOR] = { 0x12, 0x34, 0x56 };
+    size_t per_row = SPAN_MAX / count;
+    size_t repeat = SPAN_BYTES / (per_row * count * SIZE_COLOR) + 1;
+
+    double start = Now();
+    for (size_t r = 0; r < repeat; r++)
+        for (size_t i = 0; i < per_row; i++)
+            kernel(row + i * count * SIZE_COLOR, color, count);
+    double elapsed = Now() - start;
+
+    // Make sure the kernel wrote the pattern.
+    u_int8_t *last = row + (per_row * count - 1) * SIZE_COLOR;
+    if (memcmp(last, color, SIZE_COLOR))
+        return -1;
+
+    return repeat * per_row * count * SIZE_COLOR / SIZE_GB / elapsed;
+}
+
+int main(void) {
+    const char *names[] = { "scalar", "sse2", "avx2" };
+    SPAN_FN kernels[3];
+
+    u_int8_t *row = (u_int8_t*)malloc(SPAN_MAX * SIZE_COLOR);
+    if (!row) return EXIT_FAILURE;
+
+    printf("%8s", "pixels");
+    for (int k = 0; k < 3; k++) {
+        kernels[k] = SPAN_KERNEL(names[k]);
+        if (kernels[k]) printf("  %8s GB/s", names[k]);
+    }
+    printf("\n");
+
+    for (size_t count = 1; count <= SPAN_MAX; count *= 2) {
+        printf("%8zu", count);
+        for (int k = 0; k < 3; k++)
+            if (kernels[k]) printf("  %13.2f", Time_Span(kernels[k], row, count));
+        printf("\n");
+    }
+
+    free(row);
+    return EXIT_SUCCESS;
+}
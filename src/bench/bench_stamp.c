@@ -0,0 +1,82 @@
+#include <time.h>
+
+#include "../include/bmp_image.h"
+#include "../include/lib/cmd_draw.h"
+#include "../include/lib/cmd_fill.h"
+#include "../include/lib/cmd_span.h"
+
+#define STAMP_SIDE    1024    // WIDTH AND HEIGHT OF THE CANVAS (PIXELS)
+#define STAMP_DOTS    2000000 // DOTS STAMPED PER MEASURE
+#define STAMP_LARGEST 13      // LARGEST BRUSH MEASURED
+
+/**
+ * @brief Reads the monotonic clock.
+ * 
+ * @return The current time in seconds.
+ */
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Builds a white canvas in the layout of this build.
+ * 
+ * @param bmp The BMP structure to fill in.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE if out of memory.
+ */
+static u_int8_t Create_Canvas(BMP *bmp) {
+    SPAN_INIT();
+    memset(bmp, 0, sizeof(*bmp));
+    bmp->info.width = STAMP_SIDE;
+    bmp->info.height = STAMP_SIDE;
+    bmp->info.bit_pix = SIZE_RGB;
+    bmp->brush_size = 1;
+    bmp->threads = 1;
+
+    bmp->img = (u_int8_t*)malloc(IMG_BYTES(STAMP_SIDE, STAMP_SIDE));
+    bmp->brush_color = (u_int8_t*)malloc(SIZE_BRUSH);
+    if (!bmp->img || !bmp->brush_color)
+        return EXIT_FAILURE;
+
+    memset(bmp->img, 0xFF, IMG_BYTES(STAMP_SIDE, STAMP_SIDE));
+    return SET_COLOR(bmp, 200, 30, 30);
+}
+
+/**
+ * @brief Times dots stamped inside the canvas with one brush.
+ * 
+ * @param bmp     The canvas.
+ * @param size    The brush size.
+ * @param generic true to stamp with the generic path, false with the kernel.
+ * @return The nanoseconds per dot.
+ */
+static double Time_Stamp(BMP *bmp, u_int8_t size, bool generic) {
+    SET_LINE(bmp, size);
+    if (generic) bmp->stamp = NULL;
+
+    int span = STAMP_SIDE - STAMP_LARGEST;
+    double start = Now();
+    for (long i = 0; i < STAMP_DOTS; i++)
+        DOT(bmp, STAMP_LARGEST / 2 + (int)((i * 7919L) % span),
+                 STAMP_LARGEST / 2 + (int)((i * 104729L) % span));
+    return (Now() - start) * 1e9 / STAMP_DOTS;
+}
+
+int main(void) {
+    BMP bmp;
+    if (Create_Canvas(&bmp) == EXIT_FAILURE) return EXIT_FAILURE;
+
+    printf("%8s  %12s  %12s\n", "brush", "kernel ns", "generic ns");
+    for (u_int8_t size = 1; size <= STAMP_LARGEST; size += 2) {
+        double kernel = Time_Stamp(&bmp, size, false);
+        double generic = Time_Stamp(&bmp, size, true);
+        if (!STAMP_KERNEL(size)) printf("%8u  %12s  %12.1f\n", size, "-", generic);
+        else printf("%8u  %12.1f  %12.1f\n", size, kernel, generic);
+    }
+
+    free(bmp.img);
+    free(bmp.brush_color);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,380 @@
+#include <time.h>
+
+#include "../include/bmp_image.h"
+#include "../include/libbmp.h"
+#include "../include/lib/cmd_draw.h"
+
+#define SUITE_MP      16    // DEFAULT LARGEST CANVAS (MEGAPIXELS)
+#define SUITE_MP_MAX  256   // LARGEST CANVAS SUPPORTED (MEGAPIXELS)
+#define SUITE_SAMPLES 101   // MOST SAMPLES OF A MEASURE
+#define SUITE_MIN     5     // FEWEST SAMPLES OF A MEASURE
+#define SUITE_BUDGET  2.0   // SECONDS OF A MEASURE ONCE IT HAS ITS FEWEST SAMPLES
+#define SUITE_DOTS    1000  // DOTS PER SAMPLE
+#define SUITE_LINES   16    // LINES PER SAMPLE
+#define SUITE_INSERT  512   // SIDE OF THE INSERTED IMAGE (PIXELS)
+#define SUITE_COMB    4     // COLUMNS BETWEEN THE TEETH OF THE FILL COMB
+#define SUITE_PARSE   500000 // COMMANDS OF THE PARSED SCRIPT
+
+static const int BRUSHES[] = { 1, 3, 9, 25, 49, 99 };
+
+// The canvas being measured and the files of the suite.
+typedef struct Suite {
+    BMP_CONTEXT          *ctx;
+    int                  side;        // Width and height of the canvas.
+    int                  brush;       // Brush of the measure, 0 if it has none.
+    u_int8_t             *file;       // The canvas as a BMP file in memory.
+    size_t               file_size;
+    unsigned int         seed;
+    bool                 first;       // No result printed yet.
+    char                 canvas[PATH_MAX]; // The canvas as a BMP file.
+    char                 insert[PATH_MAX]; // The inserted image.
+    char                 output[PATH_MAX]; // The file written by SAVE.
+    char                 script[PATH_MAX]; // The parsed script.
+} SUITE;
+
+/**
+ * @brief Reads the monotonic clock.
+ * 
+ * @return The current time in seconds.
+ */
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Draws the next pseudo-random number below a bound.
+ */
+static int Next(SUITE *suite, int bound) {
+    suite->seed = suite->seed * 1103515245u + 12345u;
+    return (int)((suite->seed >> 8) % (unsigned int)bound);
+}
+
+static int Compare(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Builds a white BMP file of a square image in memory.
+ * 
+ * @param side The width and height of the image.
+ * @param size Set to the size of the file.
+ * @return The bytes of the file, or NULL if out of memory.
+ */
+static u_int8_t* Create_File(int side, size_t *size) {
+    size_t line = (size_t)side * SIZE_COLOR + CALCULATE_PADDING(side);
+    *size = SIZE_BMP + line * (size_t)side;
+
+    u_int8_t *data = (u_int8_t*)malloc(*size);
+    if (!data) return NULL;
+
+    bmp_fileheader header = { 'B', 'M', (u_int32_t)min(*size, SIZE_FILE_MAX), 0, 0, SIZE_BMP };
+    bmp_infoheader info = { sizeof(bmp_infoheader), side, side, 1, SIZE_RGB, 0,
+                            (u_int32_t)min(line * (size_t)side, SIZE_FILE_MAX), 0, 0, 0, 0 };
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), &info, sizeof(info));
+    memset(data + SIZE_BMP, 0xFF, *size - SIZE_BMP);
+    return data;
+}
+
+/**
+ * @brief Writes a buffer to a new file.
+ * 
+ * @return EXIT_SUCCESS if the file is written, EXIT_FAILURE otherwise.
+ */
+static u_int8_t Write_File(const char *file, const void *data, size_t size) {
+    FILE *fout = fopen(file, "wb");
+    if (!fout) return EXIT_FAILURE;
+
+    bool written = fwrite(data, 1, size, fout) == size;
+    return fclose(fout) || !written ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * @brief Writes the parsed script: colors, brush sizes and short lines.
+ * 
+ * @return EXIT_SUCCESS if the script is written, EXIT_FAILURE otherwise.
+ */
+static u_int8_t Write_Script(SUITE *suite) {
+    FILE *fout = fopen(suite->script, "w");
+    if (!fout) return EXIT_FAILURE;
+
+    for (int i = 0; i < SUITE_PARSE; i++) {
+        int y = Next(suite, 1000), x = Next(suite, 1000);
+        switch (i % 4) {
+            case 0:
+                fprintf(fout, "set draw_color %d %d %d\n", Next(suite, 256), Next(suite, 256), Next(suite, 256));
+                break;
+            case 1:
+                fprintf(fout, "set line_width %d\n", 1 + 2 * Next(suite, 2));
+                break;
+            default:
+                fprintf(fout, "draw line %d %d %d %d\n", y, x, y + Next(suite, 8), x + Next(suite, 8));
+                break;
+        }
+    }
+    fprintf(fout, "quit\n");
+    return fclose(fout) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * @brief Times an operation and prints its median, p99 and throughput as a JSON object.
+ * The operation runs until it has the most samples, or its fewest ones and the
+ * time budget is spent. The p99 is the nearest-rank one.
+ * 
+ * @param suite The suite.
+ * @param name  The name of the measure.
+ * @param work  The work done by one run of the operation.
+ * @param unit  The unit of the throughput.
+ * @param op    The operation.
+ */
+static void Measure(SUITE *suite, const char *name, double work, const char *unit, void (*op)(SUITE*)) {
+    double samples[SUITE_SAMPLES];
+    int count = 0;
+
+    double start = Now();
+    while (count < SUITE_SAMPLES && (count < SUITE_MIN || Now() - start < SUITE_BUDGET)) {
+        double begin = Now();
+        op(suite);
+        samples[count++] = Now() - begin;
+    }
+    qsort(samples, (size_t)count, sizeof(double), Compare);
+
+    double median = samples[count / 2];
+    double p99 = samples[(99 * count + 99) / 100 - 1];
+    char brush[16] = "null";
+    if (suite->brush)
+        snprintf(brush, sizeof(brush), "%d", suite->brush);
+
+    printf("%s\n    { \"name\": \"%s\", \"width\": %d, \"height\": %d, \"megapixels\": %.1f, "
+           "\"brush\": %s, \"samples\": %d, \"median_ms\": %.4f, \"p99_ms\": %.4f, "
+           "\"throughput\": %.1f, \"unit\": \"%s\" }",
+           suite->first ? "" : ",", name, suite->side, suite->side,
+           (double)suite->side * suite->side / (1 << 20), brush, count,
+           median * 1e3, p99 * 1e3, median > 0 ? work / median : 0.0, unit);
+    fflush(stdout);
+    suite->first = false;
+}
+
+// Sum of the pixels read back by Op_Edit_File, kept so the reads are not optimized out.
+static volatile u_int64_t SUITE_SINK;
+
+/**
+ * @brief EDIT of the canvas file, mapped in place, then every pixel read back.
+ * The mapping is lazy: without the reads, only mmap would be timed and not
+ * the page faults that bring the pixels in.
+ */
+static void Op_Edit_File(SUITE *suite) {
+    Bmp_Load_File(suite->ctx, suite->canvas);
+
+    const BMP *bmp = suite->ctx;
+    size_t bytes = IMG_BYTES(bmp->info.width, bmp->info.height);
+    u_int64_t sum = 0, word;
+    for (size_t i = 0; i + sizeof(word) <= bytes; i += sizeof(word)) {
+        memcpy(&word, bmp->img + i, sizeof(word));
+        sum += word;
+    }
+    SUITE_SINK = sum;
+}
+
+/**
+ * @brief EDIT of the canvas held in memory, copied row by row.
+ */
+static void Op_Edit_Memory(SUITE *suite) {
+    Bmp_Load_Memory(suite->ctx, suite->file, suite->file_size);
+}
+
+/**
+ * @brief SAVE of the whole canvas, waiting for the background write.
+ */
+static void Op_Save(SUITE *suite) {
+    Bmp_Save_File(suite->ctx, suite->output);
+    Bmp_Wait(suite->ctx);
+}
+
+/**
+ * @brief INSERT of a cached image, wholly inside the canvas.
+ */
+static void Op_Insert(SUITE *suite) {
+    int y = Next(suite, suite->side - SUITE_INSERT + 1);
+    int x = Next(suite, suite->side - SUITE_INSERT + 1);
+    Bmp_Insert(suite->ctx, suite->insert, y, x);
+}
+
+/**
+ * @brief Dots at random places.
+ */
+static void Op_Dot(SUITE *suite) {
+    for (int i = 0; i < SUITE_DOTS; i++)
+        DOT(suite->ctx, Next(suite, suite->side), Next(suite, suite->side));
+}
+
+/**
+ * @brief Steep lines over the whole height: one step per row, the worst case
+ * of the row-major layout.
+ */
+static void Op_Line(SUITE *suite) {
+    for (int i = 0; i < SUITE_LINES; i++) {
+        int y = Next(suite, suite->side);
+        Bmp_Line(suite->ctx, y, 0, (y + suite->side / 8) % suite->side, suite->side - 1);
+    }
+}
+
+/**
+ * @brief The border of a rectangle over the whole canvas.
+ */
+static void Op_Rectangle(SUITE *suite) {
+    int inset = suite->brush / 2;
+    Bmp_Rectangle(suite->ctx, inset, inset, suite->side - 2 * inset - 1, suite->side - 2 * inset - 1);
+}
+
+/**
+ * @brief The border of a triangle over the whole canvas.
+ */
+static void Op_Triangle(SUITE *suite) {
+    int last = suite->side - 1;
+    Bmp_Triangle(suite->ctx, 0, 0, last, last / 2, last / 3, last);
+}
+
+/**
+ * @brief FILL of the white region from the top left corner, in a new color each time.
+ */
+static void Op_Fill(SUITE *suite) {
+    Bmp_Set_Color(suite->ctx, (u_int8_t)Next(suite, 255), 0, 0);
+    Bmp_Fill(suite->ctx, 0, 0);
+}
+
+/**
+ * @brief Runs the generated script on the canvas.
+ */
+static void Op_Parse(SUITE *suite) {
+    int fd = open(suite->script, O_RDONLY);
+    if (fd < 0) return;
+
+    BMP_RUN run;
+    Bmp_Run(suite->ctx, fd, false, &run);
+    close(fd);
+}
+
+/**
+ * @brief Loads a white canvas of the suite.
+ * 
+ * @return EXIT_SUCCESS if the canvas is loaded, EXIT_FAILURE otherwise.
+ */
+static u_int8_t Load_Canvas(SUITE *suite) {
+    Bmp_Set_Color(suite->ctx, 200, 30, 30);
+    Bmp_Set_Line(suite->ctx, 1);
+    suite->brush = 0;
+    return Bmp_Load_Memory(suite->ctx, suite->file, suite->file_size);
+}
+
+/**
+ * @brief Measures every operation on a square canvas.
+ * 
+ * @param suite The suite.
+ * @param side  The width and height of the canvas.
+ * @return EXIT_SUCCESS if the canvas could be built, EXIT_FAILURE otherwise.
+ */
+static u_int8_t Measure_Canvas(SUITE *suite, int side) {
+    suite->side = side;
+    suite->file = Create_File(side, &suite->file_size);
+    if (!suite->file || Write_File(suite->canvas, suite->file, suite->file_size) || Load_Canvas(suite)) {
+        free(suite->file);
+        return EXIT_FAILURE;
+    }
+
+    double pixels = (double)side * side;
+    fprintf(stderr, "SUITE: %dx%d canvas\n", side, side);
+
+    Measure(suite, "edit_file", pixels, "pixels/s", Op_Edit_File);
+    Measure(suite, "edit_memory", pixels, "pixels/s", Op_Edit_Memory);
+    Measure(suite, "save", (double)suite->file_size, "bytes/s", Op_Save);
+    Load_Canvas(suite);
+    Measure(suite, "insert", (double)SUITE_INSERT * SUITE_INSERT, "pixels/s", Op_Insert);
+
+    for (size_t i = 0; i < sizeof(BRUSHES) / sizeof(BRUSHES[0]); i++) {
+        Bmp_Set_Line(suite->ctx, (u_int8_t)BRUSHES[i]);
+        suite->brush = BRUSHES[i];
+        Measure(suite, "dot", SUITE_DOTS, "dots/s", Op_Dot);
+        Measure(suite, "line", (double)SUITE_LINES * side, "pixels/s", Op_Line);
+        Measure(suite, "rectangle", 4.0 * side, "pixels/s", Op_Rectangle);
+        Measure(suite, "triangle", 1, "shapes/s", Op_Triangle);
+    }
+
+    // The whole canvas is one region.
+    Load_Canvas(suite);
+    Measure(suite, "fill", pixels, "pixels/s", Op_Fill);
+
+    // A comb hanging from the top row: narrow columns, one span per row each.
+    Load_Canvas(suite);
+    Bmp_Set_Color(suite->ctx, 0, 0, 0);
+    int teeth = 0;
+    for (int y = SUITE_COMB / 2; y < side; y += SUITE_COMB, teeth++)
+        Bmp_Line(suite->ctx, y, 1, y, side - 1);
+    Measure(suite, "fill_comb", pixels - (double)teeth * (side - 1), "pixels/s", Op_Fill);
+
+    free(suite->file);
+    suite->file = NULL;
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+    int most = argc > 1 ? atoi(argv[1]) : SUITE_MP;
+    const char *dir = argc > 2 ? argv[2] : ".";
+    SUITE suite;
+
+    if (most < 1 || most > SUITE_MP_MAX) {
+        fprintf(stderr, "usage: %s [MEGAPIXELS (1 to %d)] [DIRECTORY]\n", argv[0], SUITE_MP_MAX);
+        return EXIT_FAILURE;
+    }
+
+    memset(&suite, 0, sizeof(suite));
+    suite.seed = 42;
+    suite.first = true;
+    snprintf(suite.canvas, sizeof(suite.canvas), "%s/suite_canvas.bmp", dir);
+    snprintf(suite.insert, sizeof(suite.insert), "%s/suite_insert.bmp", dir);
+    snprintf(suite.output, sizeof(suite.output), "%s/suite_output.bmp", dir);
+    snprintf(suite.script, sizeof(suite.script), "%s/suite_script.txt", dir);
+
+    size_t size = 0;
+    u_int8_t *insert = Create_File(SUITE_INSERT, &size);
+    suite.ctx = Bmp_Create();
+    if (!insert || !suite.ctx || Write_File(suite.insert, insert, size) || Write_Script(&suite)) {
+        fprintf(stderr, "ERROR: cannot write the files of the suite in %s...\n", dir);
+        free(insert);
+        Bmp_Destroy(suite.ctx);
+        return EXIT_FAILURE;
+    }
+    free(insert);
+
+    printf("{\n  \"layout\": \"%s\",\n  \"format\": \"%s\",\n  \"results\": [",
+           IMG_TILED ? "tiled" : "row-major", IMG_BGRX ? "bgrx" : "bgr");
+
+    // Canvases of 1, 4, 16, 64 and 256 megapixels.
+    u_int8_t status = EXIT_SUCCESS;
+    for (int mp = 1, side = 1024; mp <= most && !status; mp *= 4, side *= 2) {
+        status = Measure_Canvas(&suite, side);
+        if (status)
+            fprintf(stderr, "ERROR: %dx%d canvas allocation failed...\n", side, side);
+    }
+
+    // The interpreter on a 1 megapixel canvas, mostly parsing.
+    suite.file = Create_File(1024, &suite.file_size);
+    if (!status && suite.file && !Load_Canvas(&suite)) {
+        suite.side = 1024;
+        Measure(&suite, "parse", SUITE_PARSE + 1, "commands/s", Op_Parse);
+    }
+    free(suite.file);
+
+    printf("\n  ]\n}\n");
+
+    Bmp_Destroy(suite.ctx);
+    Bmp_Shutdown();
+    unlink(suite.canvas);
+    unlink(suite.insert);
+    unlink(suite.output);
+    unlink(suite.script);
+    return status;
+}
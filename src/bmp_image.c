@@ -1,72 +1,882 @@
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
 #include "./include/bmp_image.h"
-#include "./include/api/instr.h"
+#include "./include/libbmp.h"
+
+// Options of the command line, applied to the BMP of every script.
+typedef struct Options {
+    int                  threads;     // --threads N
+    const char           *canvas_dir; // --canvas-dir D
+    const char           *trace;      // --trace F, Chrome trace of the stdin script.
+    bool                 optimize;    // --optimize
+    bool                 stats;       // --stats
+    bool                 batch;       // --batch, the scripts follow the options.
+    int                  workers;     // --jobs N, workers of a batch run.
+    char                 **scripts;   // Script files of a batch run.
+    int                  count;
+    const char           *serve;      // --serve S, socket of the server.
+    const char           *connect;    // --connect S, socket of the server to send a request to.
+    char                 **request;   // Words of the request of --connect.
+    int                  words;
+} OPTIONS;
 
 /**
- * @brief Initialize a BMP object.
+ * @brief Parses the count of an option, from 1 to most.
  * 
- * @return A pointer to the newly created BMP object, or NULL on failure.
+ * @param arg   The argument of the option.
+ * @param most  The largest count.
+ * @param count Set to the count.
+ * @return EXIT_SUCCESS if the count is valid, EXIT_FAILURE otherwise.
  */
-static BMP* Create_BMP(void) {
-    BMP *bmp = (BMP*)malloc(sizeof(BMP));
+static u_int8_t Parse_Count(const char *arg, int most, int *count) {
+    char *end = NULL;
+    long value = strtol(arg, &end, 10);
+    if (*end || value < 1 || value > most)
+        return EXIT_FAILURE;
 
-    // Initialize other BMP object members as needed.
-    if (bmp) {
-        bmp->brush_color = (u_int8_t*)malloc(SIZE_BRUSH);
+    *count = (int)value;
+    return EXIT_SUCCESS;
+}
 
-        if (!bmp->brush_color) {
-            free(bmp);
-            bmp = NULL;
+/**
+ * @brief Applies the command line options.
+ * Supported options:
+ *   --threads N    Number of worker threads used by FILL and batched draws (default 1).
+ *   --optimize     Parses the whole script and optimizes it before running it.
+ *   --stats        Reports the commands removed by the optimization and the allocations.
+ *   --canvas-dir D Keeps the pixels of edited images in a file of the directory D.
+ *   --trace F      Times every command, then prints a summary and writes a Chrome trace to F.
+ *   --jobs N       Number of workers of a batch run (default: the online CPUs).
+ *   --batch        Runs the script files following the options instead of stdin.
+ *   --serve S      Serves the scripts sent to the Unix socket S.
+ *   --connect S    Sends the request following the options and stdin to the server at S.
+ * 
+ * @param options The options, set to their defaults by the caller.
+ * @param argc    The number of command line arguments.
+ * @param argv    The command line arguments.
+ * @return EXIT_SUCCESS if every option is valid, EXIT_FAILURE otherwise.
+ */
+static u_int8_t Parse_Options(OPTIONS *options, int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            if (Parse_Count(argv[++i], FILL_THREADS, &options->threads))
+                return EXIT_FAILURE;
+        } else if (!strcmp(argv[i], "--jobs") && i + 1 < argc) {
+            if (Parse_Count(argv[++i], BATCH_WORKERS, &options->workers))
+                return EXIT_FAILURE;
+        } else if (!strcmp(argv[i], "--canvas-dir") && i + 1 < argc) {
+            options->canvas_dir = argv[++i];
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            options->trace = argv[++i];
+        } else if (!strcmp(argv[i], "--optimize")) {
+            options->optimize = true;
+        } else if (!strcmp(argv[i], "--stats")) {
+            options->stats = true;
+        } else if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+            options->batch = true;
+            options->scripts = argv + i + 1;
+            options->count = argc - i - 1;
+            return EXIT_SUCCESS;
+        } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+            options->serve = argv[++i];
+        } else if (!strcmp(argv[i], "--connect") && i + 2 < argc && argc - i - 2 <= 2) {
+            options->connect = argv[i + 1];
+            options->request = argv + i + 2;
+            options->words = argc - i - 2;
+            return EXIT_SUCCESS;
         } else {
-            bmp->brush_size = 1;
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Creates the context of a script, with the command line options.
+ * 
+ * @param options The options.
+ * @return The context, or NULL on failure.
+ */
+static BMP_CONTEXT* Open_Context(const OPTIONS *options) {
+    BMP_CONTEXT *ctx = Bmp_Create();
+    if (ctx) {
+        Bmp_Set_Threads(ctx, options->threads);
+        Bmp_Set_Canvas_Dir(ctx, options->canvas_dir);
+    }
+    return ctx;
+}
+
+/**
+ * @brief Reads the monotonic clock.
+ * 
+ * @return The current time in seconds.
+ */
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// One script of a batch run.
+typedef struct BatchJob {
+    const char           *script;
+    u_int8_t             status;
+    size_t               errors;      // Commands and saves that failed.
+    double               seconds;
+} BATCH_JOB;
+
+// Jobs of one worker: it takes them from the back, idle workers steal from the front.
+typedef struct BatchQueue {
+    pthread_mutex_t      lock;
+    size_t               *jobs;
+    size_t               head;
+    size_t               tail;
+} BATCH_QUEUE;
+
+typedef struct Batch {
+    const OPTIONS        *options;
+    BATCH_JOB            *jobs;
+    BATCH_QUEUE          queues[BATCH_WORKERS];
+    int                  workers;
+    pthread_mutex_t      print;       // Keeps the status lines whole.
+} BATCH;
+
+typedef struct BatchWorker {
+    BATCH                *batch;
+    int                  index;
+} BATCH_WORKER;
+
+/**
+ * @brief Takes the next job of a worker: its own last one, or else the first
+ * job of the next worker that still has some.
+ * 
+ * @param batch The batch run.
+ * @param index The worker.
+ * @param job   Set to the index of the job.
+ * @return EXIT_SUCCESS if a job was taken, EXIT_FAILURE if every queue is empty.
+ */
+static u_int8_t Take_Job(BATCH *batch, int index, size_t *job) {
+    for (int k = 0; k < batch->workers; k++) {
+        BATCH_QUEUE *queue = batch->queues + (index + k) % batch->workers;
+        bool found = false;
+
+        pthread_mutex_lock(&queue->lock);
+        if (queue->head < queue->tail) {
+            *job = !k ? queue->jobs[--queue->tail] : queue->jobs[queue->head++];
+            found = true;
         }
+        pthread_mutex_unlock(&queue->lock);
+
+        if (found)
+            return EXIT_SUCCESS;
     }
 
-    return bmp;
+    return EXIT_FAILURE;
 }
 
 /**
- * @brief Cleanup a BMP object.
+ * @brief Runs one script of a batch on its own BMP object, lexer and program.
+ * Only the process-wide insert cache, pixel pool and span kernels are shared.
  * 
- * @param bmp A pointer to the BMP object to be cleaned up.
+ * @param options The options.
+ * @param job     The job, receiving its status and timing.
  */
-static void Destroy_BMP(BMP *bmp) {
-    if (bmp) {
-        FREE_BRUSH(bmp);
-        FREE_BMP(bmp);
+static void Run_Job(const OPTIONS *options, BATCH_JOB *job) {
+    double start = Now();
+    BMP_RUN run;
+
+    job->status = EXIT_FAILURE;
+    BMP_CONTEXT *ctx = Open_Context(options);
+    int fd = ctx ? open(job->script, O_RDONLY) : -1;
+
+    if (fd >= 0) {
+        job->status = Bmp_Run(ctx, fd, options->optimize, &run);
+        job->errors = run.errors + run.save_failed;
+        close(fd);
     }
+    Bmp_Destroy(ctx);
+
+    if (job->errors)
+        job->status = EXIT_FAILURE;
+    job->seconds = Now() - start;
 }
 
-int main(void) {
+/**
+ * @brief Runs the jobs of a worker, then steals from the others (thread routine).
+ */
+static void *Batch_Worker(void *arg) {
+    BATCH_WORKER *worker = (BATCH_WORKER*)arg;
+    BATCH *batch = worker->batch;
+    size_t index = 0;
+
+    while (!Take_Job(batch, worker->index, &index)) {
+        BATCH_JOB *job = batch->jobs + index;
+        Run_Job(batch->options, job);
+
+        pthread_mutex_lock(&batch->print);
+        printf("BATCH %s: %s, %zu errors, %.1f ms\n", job->script,
+               job->status ? "failed" : "done", job->errors, job->seconds * 1e3);
+        fflush(stdout);
+        pthread_mutex_unlock(&batch->print);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Runs the script files of the options on a pool of workers.
+ * Jobs are dealt round-robin to the workers, which run their own from the back
+ * and steal from the front of the others once they are done. Every job has its
+ * own BMP object, canvases, lexer and program; decoded insert images are shared
+ * through the process-wide cache. A status line is printed as each job ends.
+ * 
+ * @param options The options.
+ * @return EXIT_SUCCESS if every script ran without errors, EXIT_FAILURE otherwise.
+ */
+static u_int8_t Run_Batch(const OPTIONS *options) {
+    BATCH batch;
+    BATCH_WORKER workers[BATCH_WORKERS];
+    pthread_t threads[BATCH_WORKERS];
+    bool started[BATCH_WORKERS];
+    size_t count = (size_t)options->count;
+
+    batch.options = options;
+    batch.workers = (int)min((size_t)options->workers, count);
+    batch.jobs = (BATCH_JOB*)calloc(count, sizeof(BATCH_JOB));
+    size_t *slots = (size_t*)malloc(count * sizeof(size_t));
+    if (!batch.jobs || !slots) {
+        free(batch.jobs);
+        free(slots);
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&batch.print, NULL);
+
+    // Worker i holds the jobs i, i + workers, ... in its slice of the slots.
+    size_t used = 0;
+    for (int i = 0; i < batch.workers; i++) {
+        BATCH_QUEUE *queue = batch.queues + i;
+        pthread_mutex_init(&queue->lock, NULL);
+        queue->jobs = slots + used;
+        queue->head = queue->tail = 0;
+        for (size_t j = (size_t)i; j < count; j += (size_t)batch.workers)
+            queue->jobs[queue->tail++] = j;
+        used += queue->tail;
+    }
+    for (size_t j = 0; j < count; j++)
+        batch.jobs[j].script = options->scripts[j];
+
+    double start = Now();
+    for (int i = 0; i < batch.workers; i++) {
+        workers[i].batch = &batch;
+        workers[i].index = i;
+    }
+    for (int i = 1; i < batch.workers; i++)
+        started[i] = !pthread_create(&threads[i], NULL, Batch_Worker, workers + i);
+    Batch_Worker(workers);
+
+    size_t failed = 0;
+    for (int i = 1; i < batch.workers; i++)
+        if (started[i]) pthread_join(threads[i], NULL);
+    for (size_t j = 0; j < count; j++)
+        if (batch.jobs[j].status) failed++;
+
+    printf("BATCH: %zu scripts, %zu failed, %d workers, %.1f ms\n",
+           count, failed, batch.workers, (Now() - start) * 1e3);
+
+    for (int i = 0; i < batch.workers; i++)
+        pthread_mutex_destroy(&batch.queues[i].lock);
+    pthread_mutex_destroy(&batch.print);
+    free(batch.jobs);
+    free(slots);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// A context kept by the server between the requests naming it.
+typedef struct Session {
+    char                 name[SERVE_LINE];
+    BMP_CONTEXT          *ctx;
+    pthread_mutex_t      lock;        // Held by the request running on the session.
+    int                  refs;        // Requests holding the session, plus one while listed.
+} SESSION;
+
+typedef struct Server {
+    const OPTIONS        *options;
+    int                  queue[SERVE_QUEUE]; // Accepted connections waiting for a worker.
+    size_t               head;
+    size_t               count;
+    bool                 stopping;
+    pthread_mutex_t      lock;        // Guards the queue, the sessions and the counters.
+    pthread_cond_t       ready;       // A connection was queued, or the server stops.
+    pthread_cond_t       space;       // A connection was taken from the queue.
+    SESSION              *sessions[SERVE_SESSIONS];
+    size_t               requests;
+    size_t               failed;
+} SERVER;
+
+// Write end of the pipe waking the accept loop up to stop the server.
+static int Serve_Wakeup = -1;
+
+/**
+ * @brief Asks the accept loop to stop the server (signal handler).
+ */
+static void Serve_Stop(int signo) {
+    int saved = errno;
+    ssize_t written = write(Serve_Wakeup, &signo, 1);
+    (void)written;
+    errno = saved;
+}
+
+/**
+ * @brief Sends a whole buffer on a socket.
+ * 
+ * @param fd   The socket.
+ * @param data The bytes to send.
+ * @param size The number of bytes.
+ * @return EXIT_SUCCESS if every byte is sent, EXIT_FAILURE otherwise.
+ */
+static u_int8_t Send_All(int fd, const void *data, size_t size) {
+    const u_int8_t *bytes = (const u_int8_t*)data;
+
+    while (size) {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return EXIT_FAILURE;
+        bytes += sent;
+        size -= (size_t)sent;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Reads a line from a socket, byte by byte so nothing after it is consumed.
+ * 
+ * @param fd   The socket.
+ * @param line The buffer of the line, without its '\n'.
+ * @param size The size of the buffer.
+ * @return EXIT_SUCCESS if a whole line is read, EXIT_FAILURE otherwise.
+ */
+static u_int8_t Read_Line(int fd, char *line, size_t size) {
+    for (size_t length = 0; length + 1 < size; ) {
+        ssize_t bytes = recv(fd, line + length, 1, 0);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            return EXIT_FAILURE;
+
+        if (line[length] == '\n') {
+            line[length] = '\0';
+            return EXIT_SUCCESS;
+        }
+        length++;
+    }
+
+    return EXIT_FAILURE;
+}
+
+/**
+ * @brief Finds a session by its name, created if needed, and holds it.
+ * 
+ * @param server The server.
+ * @param name   The name of the session.
+ * @return The session, to be handed back with Drop_Session, or NULL if none is left.
+ */
+static SESSION* Take_Session(SERVER *server, const char *name) {
+    SESSION *session = NULL;
+    int free_slot = -1;
+
+    pthread_mutex_lock(&server->lock);
+    for (int i = 0; i < SERVE_SESSIONS && !session; i++) {
+        if (!server->sessions[i]) {
+            if (free_slot < 0) free_slot = i;
+        } else if (!strcmp(server->sessions[i]->name, name)) {
+            session = server->sessions[i];
+        }
+    }
+
+    if (!session && free_slot >= 0) {
+        session = (SESSION*)calloc(1, sizeof(SESSION));
+        if (session) session->ctx = Open_Context(server->options);
+        if (session && session->ctx) {
+            strcpy(session->name, name);
+            pthread_mutex_init(&session->lock, NULL);
+            session->refs = 1;
+            server->sessions[free_slot] = session;
+        } else {
+            free(session);
+            session = NULL;
+        }
+    }
+
+    if (session)
+        session->refs++;
+    pthread_mutex_unlock(&server->lock);
+    return session;
+}
+
+/**
+ * @brief Hands a session back, it is freed once closed and no request holds it.
+ * 
+ * @param server  The server.
+ * @param session The session.
+ */
+static void Drop_Session(SERVER *server, SESSION *session) {
+    pthread_mutex_lock(&server->lock);
+    bool last = !--session->refs;
+    pthread_mutex_unlock(&server->lock);
+
+    if (last) {
+        Bmp_Destroy(session->ctx);
+        pthread_mutex_destroy(&session->lock);
+        free(session);
+    }
+}
+
+/**
+ * @brief Forgets a session, freed once the requests running on it are done.
+ * 
+ * @param server The server.
+ * @param name   The name of the session.
+ * @return EXIT_SUCCESS if the session was open, EXIT_FAILURE otherwise.
+ */
+static u_int8_t Close_Session(SERVER *server, const char *name) {
+    SESSION *session = NULL;
+
+    pthread_mutex_lock(&server->lock);
+    for (int i = 0; i < SERVE_SESSIONS && !session; i++) {
+        if (server->sessions[i] && !strcmp(server->sessions[i]->name, name)) {
+            session = server->sessions[i];
+            server->sessions[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    if (!session)
+        return EXIT_FAILURE;
+
+    Drop_Session(server, session);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Runs the script sent after a request line, on a session or on a new context.
+ * The reply is "OK <commands> <errors> <bytes>\n", followed by the encoded active
+ * image for an IMAGE request, or "ERROR <reason>\n".
+ * 
+ * @param server The server.
+ * @param fd     The connection.
+ * @param name   The name of the session, NULL for a context of its own.
+ * @param image  Whether the active image is sent back.
+ * @return EXIT_SUCCESS if the script ran, EXIT_FAILURE otherwise.
+ */
+static u_int8_t Serve_Run(SERVER *server, int fd, const char *name, bool image) {
+    char reply[SERVE_LINE];
+    SESSION *session = NULL;
+    BMP_CONTEXT *ctx = NULL;
+
+    if (name) {
+        session = Take_Session(server, name);
+        if (session) {
+            pthread_mutex_lock(&session->lock);
+            ctx = session->ctx;
+        }
+    } else {
+        ctx = Open_Context(server->options);
+    }
+
+    if (!ctx) {
+        snprintf(reply, sizeof(reply), "ERROR %s\n", name ? "too many sessions" : "out of memory");
+        Send_All(fd, reply, strlen(reply));
+        return EXIT_FAILURE;
+    }
+
+    BMP_RUN run;
+    void *data = NULL;
+    size_t size = 0;
+    u_int8_t status = Bmp_Run(ctx, fd, server->options->optimize, &run);
+
+    if (!status && image && Bmp_Save_Memory(ctx, &data, &size)) {
+        run.error = "encoding the image";
+        status = EXIT_FAILURE;
+    }
+
+    if (session) {
+        pthread_mutex_unlock(&session->lock);
+        Drop_Session(server, session);
+    } else {
+        Bmp_Destroy(ctx);
+    }
+
+    if (status)
+        snprintf(reply, sizeof(reply), "ERROR %s\n", run.error);
+    else
+        snprintf(reply, sizeof(reply), "OK %zu %zu %zu\n",
+                 run.commands, run.errors + run.save_failed, size);
+
+    if (!Send_All(fd, reply, strlen(reply)) && size)
+        Send_All(fd, data, size);
+    free(data);
+    return status;
+}
+
+/**
+ * @brief Reads the request line of a connection and answers it.
+ * Requests:
+ *   RUN [SESSION]    Runs the script following the line.
+ *   IMAGE [SESSION]  Runs the script following the line, then sends the active image.
+ *   CLOSE SESSION    Frees a session.
+ *   SHUTDOWN         Stops the server once the queued requests are answered.
+ * 
+ * @param server The server.
+ * @param fd     The connection.
+ * @return EXIT_SUCCESS if the request was answered, EXIT_FAILURE otherwise.
+ */
+static u_int8_t Serve_Request(SERVER *server, int fd) {
+    char line[SERVE_LINE], *save = NULL;
+    const char *reply = "ERROR invalid request\n";
+
+    if (Read_Line(fd, line, sizeof(line))) {
+        Send_All(fd, reply, strlen(reply));
+        return EXIT_FAILURE;
+    }
+
+    char *verb = strtok_r(line, " \t\r", &save);
+    char *name = verb ? strtok_r(NULL, " \t\r", &save) : NULL;
+    bool extra = name && strtok_r(NULL, " \t\r", &save);
+    u_int8_t status = EXIT_FAILURE;
+
+    if (!verb || extra) {
+        // Keep the invalid request reply.
+    } else if (!strcmp(verb, "RUN") || !strcmp(verb, "IMAGE")) {
+        return Serve_Run(server, fd, name, !strcmp(verb, "IMAGE"));
+    } else if (!strcmp(verb, "CLOSE") && name) {
+        status = Close_Session(server, name);
+        reply = status ? "ERROR unknown session\n" : "OK 0 0 0\n";
+    } else if (!strcmp(verb, "SHUTDOWN") && !name) {
+        Serve_Stop(SIGTERM);
+        status = EXIT_SUCCESS;
+        reply = "OK 0 0 0\n";
+    }
+
+    Send_All(fd, reply, strlen(reply));
+    return status;
+}
+
+/**
+ * @brief Answers the queued connections until the server stops and the queue is empty (thread routine).
+ */
+static void *Serve_Worker(void *arg) {
+    SERVER *server = (SERVER*)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        while (!server->count && !server->stopping)
+            pthread_cond_wait(&server->ready, &server->lock);
+        if (!server->count) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+
+        int fd = server->queue[server->head];
+        server->head = (server->head + 1) % SERVE_QUEUE;
+        server->count--;
+        pthread_cond_signal(&server->space);
+        pthread_mutex_unlock(&server->lock);
+
+        u_int8_t status = Serve_Request(server, fd);
+        close(fd);
+
+        pthread_mutex_lock(&server->lock);
+        server->requests++;
+        if (status) server->failed++;
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Binds and listens on a Unix socket.
+ * A socket file left by a server that is gone is replaced, a live one is not.
+ * The socket is bound to a temporary name, made owner-only and listening, then
+ * renamed to its path: requests read and write files as the user of the server,
+ * so no other user may connect, and clients never find it refusing connections.
+ * 
+ * @param path The path of the socket.
+ * @return The listening socket, or -1 on failure.
+ */
+static int Serve_Listen(const char *path) {
+    struct sockaddr_un addr, temp;
+    memset(&addr, 0, sizeof(addr));
+    memset(&temp, 0, sizeof(temp));
+    addr.sun_family = temp.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path) ||
+        snprintf(temp.sun_path, sizeof(temp.sun_path), "%s.%ld.tmp", path, (long)getpid()) >=
+        (int)sizeof(temp.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    struct stat st;
+    if (!lstat(path, &st)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool stale = S_ISSOCK(st.st_mode) && probe >= 0 &&
+                     connect(probe, (struct sockaddr*)&addr, sizeof(addr)) && errno == ECONNREFUSED;
+        if (probe >= 0) close(probe);
+        if (!stale) return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    unlink(temp.sun_path);
+    bool bound = !bind(fd, (struct sockaddr*)&temp, sizeof(temp));
+    if (!bound || chmod(temp.sun_path, S_IRUSR | S_IWUSR) || listen(fd, SERVE_QUEUE) ||
+        rename(temp.sun_path, path)) {
+        if (bound) unlink(temp.sun_path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Serves the scripts sent to a Unix socket until SIGINT, SIGTERM or a SHUTDOWN request.
+ * Accepted connections wait in a bounded queue for a pool of workers; the accept
+ * loop blocks while the queue is full. Every request runs on its own context, or on
+ * a named session kept between requests with its image and canvases; decoded
+ * insert images stay in the process-wide cache. Once stopped, the queued requests
+ * are still answered, then the sessions are freed and the socket is removed.
+ * 
+ * @param options The options, --jobs gives the number of workers.
+ * @return EXIT_SUCCESS if the server stopped cleanly, EXIT_FAILURE otherwise.
+ */
+static u_int8_t Run_Server(const OPTIONS *options) {
+    static SERVER server;
+    pthread_t threads[BATCH_WORKERS];
+    int started = 0, wake[2];
+
+    memset(&server, 0, sizeof(server));
+    server.options = options;
+
+    if (pipe(wake))
+        return EXIT_FAILURE;
+    fcntl(wake[1], F_SETFL, O_NONBLOCK);
+    Serve_Wakeup = wake[1];
+
+    int listener = Serve_Listen(options->serve);
+    if (listener < 0) {
+        fprintf(stderr, "ERROR: cannot listen on %s...\n", options->serve);
+        close(wake[0]);
+        close(wake[1]);
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = Serve_Stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+    pthread_cond_init(&server.space, NULL);
+    for (int i = 0; i < options->workers; i++)
+        if (!pthread_create(&threads[started], NULL, Serve_Worker, &server))
+            started++;
+
+    fprintf(stderr, "SERVE: %s, %d workers\n", options->serve, started);
+
+    struct timeval timeout = { SERVE_TIMEOUT, 0 };
+    struct pollfd fds[2] = { { wake[0], POLLIN, 0 }, { listener, POLLIN, 0 } };
+    while (started) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[0].revents)
+            break;
+        if (!(fds[1].revents & POLLIN))
+            continue;
+
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) continue;
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        pthread_mutex_lock(&server.lock);
+        while (server.count == SERVE_QUEUE)
+            pthread_cond_wait(&server.space, &server.lock);
+        server.queue[(server.head + server.count) % SERVE_QUEUE] = fd;
+        server.count++;
+        pthread_cond_signal(&server.ready);
+        pthread_mutex_unlock(&server.lock);
+    }
+
+    // Answer the queued requests, then free the sessions.
+    pthread_mutex_lock(&server.lock);
+    server.stopping = true;
+    pthread_cond_broadcast(&server.ready);
+    pthread_mutex_unlock(&server.lock);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    close(listener);
+    unlink(options->serve);
+
+    size_t sessions = 0;
+    for (int i = 0; i < SERVE_SESSIONS; i++) {
+        if (server.sessions[i]) {
+            Drop_Session(&server, server.sessions[i]);
+            sessions++;
+        }
+    }
+
+    fprintf(stderr, "SERVE: %zu requests, %zu failed, %zu sessions\n",
+            server.requests, server.failed, sessions);
+
+    Serve_Wakeup = -1;
+    close(wake[0]);
+    close(wake[1]);
+    pthread_cond_destroy(&server.space);
+    pthread_cond_destroy(&server.ready);
+    pthread_mutex_destroy(&server.lock);
+    return started ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * @brief Sends a request to a server and prints its reply.
+ * For RUN and IMAGE the script is read from stdin. The reply line is printed on
+ * stderr, the image of an IMAGE request is written to stdout.
+ * 
+ * @param options The options, with the socket and the words of the request.
+ * @return EXIT_SUCCESS if the server answered "OK", EXIT_FAILURE otherwise.
+ */
+static u_int8_t Run_Client(const OPTIONS *options) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(options->connect) >= sizeof(addr.sun_path))
+        return EXIT_FAILURE;
+    strcpy(addr.sun_path, options->connect);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        fprintf(stderr, "ERROR: cannot connect to %s...\n", options->connect);
+        if (fd >= 0) close(fd);
+        return EXIT_FAILURE;
+    }
+
+    char line[SERVE_LINE];
+    snprintf(line, sizeof(line), "%s%s%s\n", options->request[0],
+             options->words > 1 ? " " : "", options->words > 1 ? options->request[1] : "");
+    u_int8_t status = Send_All(fd, line, strlen(line));
+
+    // The script follows the request line, up to the end of stdin.
+    bool script = !strcmp(options->request[0], "RUN") || !strcmp(options->request[0], "IMAGE");
+    char *block = (char*)malloc(LEX_BLOCK);
+    ssize_t bytes = 0;
+    if (!block) status = EXIT_FAILURE;
+    while (!status && script && (bytes = read(STDIN_FILENO, block, LEX_BLOCK)) != 0) {
+        if (bytes < 0 && errno == EINTR) continue;
+        status = bytes < 0 ? EXIT_FAILURE : Send_All(fd, block, (size_t)bytes);
+    }
+    shutdown(fd, SHUT_WR);
+
+    if (!status && Read_Line(fd, line, sizeof(line)))
+        status = EXIT_FAILURE;
+    if (!status) {
+        fprintf(stderr, "%s\n", line);
+        status = strncmp(line, "OK ", 3) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    // The rest of the reply is the image.
+    while (!status && (bytes = recv(fd, block, LEX_BLOCK, 0)) != 0) {
+        if (bytes < 0 && errno == EINTR) continue;
+        status = bytes < 0 || fwrite(block, 1, (size_t)bytes, stdout) != (size_t)bytes;
+    }
+
+    free(block);
+    close(fd);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    OPTIONS options = { 1, NULL, NULL, false, false, false, (int)max(1, min(cpus, BATCH_WORKERS)),
+                        NULL, 0, NULL, NULL, NULL, 0 };
+
+    if (Parse_Options(&options, argc, argv)) {
+        fprintf(stderr, "ERROR: invalid options...\n");
+        fprintf(stderr, "usage: %s [--threads N] [--optimize] [--stats] [--canvas-dir D] [--trace F]"
+                        " [--jobs N] [--batch SCRIPT... | --serve SOCKET | --connect SOCKET REQUEST [SESSION]]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (options.batch) {
+        u_int8_t status = Run_Batch(&options);
+        Bmp_Report(NULL, stderr);
+        Bmp_Shutdown();
+        return status;
+    }
+
+    if (options.serve) {
+        u_int8_t status = Run_Server(&options);
+        Bmp_Report(NULL, stderr);
+        Bmp_Shutdown();
+        return status;
+    }
+
+    if (options.connect)
+        return Run_Client(&options);
+
     // Initialize the BMP object.
-    BMP *bmp = Create_BMP();
+    BMP_CONTEXT *ctx = Open_Context(&options);
 
-    if (!bmp) {
+    if (!ctx) {
         fprintf(stderr, "ERROR: BMP initialization failed...\n");
         return EXIT_FAILURE;
     }
 
-    while (strcmp(CMD, "quit")) {
-        if (scanf("%s", CMD) != 1) {
-            fprintf(stderr, "ERROR: invalid instruction...\n");
-            Destroy_BMP(bmp);
-            return EXIT_FAILURE; // Exit the loop on input failure.
-        }
+    if (options.trace && Bmp_Set_Trace(ctx, options.trace)) {
+        fprintf(stderr, "ERROR: tracing needs a build with TRACE=on...\n");
+        Bmp_Destroy(ctx);
+        return EXIT_FAILURE;
+    }
+
+    BMP_RUN run;
+    u_int8_t status = Bmp_Run(ctx, STDIN_FILENO, options.optimize, &run);
+
+    // Saves run in the background, report the ones that failed.
+    if (run.save_failed)
+        fprintf(stderr, "ERROR: %zu background saves failed...\n", run.save_failed);
+
+    if (options.stats) {
+        fprintf(stderr, "OPTIMIZE: %zu commands, %zu removed (%zu sets, %zu covered, %zu merged)\n",
+                run.commands, run.sets + run.covered + run.merged,
+                run.sets, run.covered, run.merged);
+        fprintf(stderr, "ALLOCS: %zu heap allocations by the commands\n", run.allocs);
+    }
+
+    if (status) {
+        fprintf(stderr, "ERROR: %s...\n", run.error);
+        Bmp_Destroy(ctx);
+        Bmp_Shutdown();
+        return EXIT_FAILURE; // Exit on input failure.
+    }
 
-        // Check commands by their full name.
-        if (!strcmp(CMD, "save"))
-            if (Handle_Save(bmp))   fprintf(stderr, "ERROR: saving map...\n");
-        if (!strcmp(CMD, "edit"))
-            if (Handle_Edit(bmp))   fprintf(stderr, "ERROR: editing map...\n");
-        if (!strcmp(CMD, "set"))
-            if (Handle_Set(bmp))    fprintf(stderr, "ERROR: setting parameters...\n");
-        if (!strcmp(CMD, "draw"))
-            if (Handle_Draw(bmp))   fprintf(stderr, "ERROR: drawing...\n");
-        if (!strcmp(CMD, "fill"))
-            if (Handle_Fill(bmp))   fprintf(stderr, "ERROR: filling...\n");
-        if (!strcmp(CMD, "insert"))
-            if (Handle_Insert(bmp)) fprintf(stderr, "ERROR: inserting image...\n");
-    }
-
-    Destroy_BMP(bmp);
+    Bmp_Report(ctx, stderr);
+    Bmp_Destroy(ctx);
+    Bmp_Shutdown();
     return EXIT_SUCCESS;
 }
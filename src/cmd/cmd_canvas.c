@@ -0,0 +1,591 @@
+#include "../include/bmp_image.h"
+#include "../include/lib/cmd_insert.h"
+#include "../include/lib/cmd_canvas.h"
+
+/* -----------------------------------------POOL----------------------------------------- */
+
+typedef struct PoolBlock {
+    u_int8_t             *img;        // Pixels of a released image.
+    size_t               bytes;       // Size of the pixels.
+    struct PoolBlock     *next;       // Block released before this one.
+} POOL_BLOCK;
+
+// Process-wide pool of released pixels, reused by images of the same size.
+static struct {
+    pthread_mutex_t      lock;
+    POOL_BLOCK           *head;       // Block released last.
+    size_t               bytes;       // Pixels held by the pool.
+    size_t               hits;
+    size_t               misses;
+} POOL = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 };
+
+/**
+ * @brief Frees the blocks that do not fit in POOL_BUDGET, the oldest first.
+ * The pool lock must be held.
+ */
+static void _POOL_TRIM(void) {
+    size_t kept = 0;
+
+    for (POOL_BLOCK **link = &POOL.head; *link;) {
+        POOL_BLOCK *block = *link;
+        if (kept + block->bytes <= POOL_BUDGET) {
+            kept += block->bytes;
+            link = &block->next;
+            continue;
+        }
+
+        *link = block->next;
+        POOL.bytes -= block->bytes;
+        free(block->img);
+        free(block);
+    }
+}
+
+/**
+ * @brief Allocates pixels, reusing a released block of the same size if any.
+ * 
+ * @param bytes The size of the pixels.
+ * @return The pixels, or NULL if out of memory.
+ */
+static u_int8_t *_POOL_ALLOC(size_t bytes) {
+    pthread_mutex_lock(&POOL.lock);
+
+    for (POOL_BLOCK **link = &POOL.head; *link; link = &(*link)->next) {
+        POOL_BLOCK *block = *link;
+        if (block->bytes != bytes)
+            continue;
+
+        u_int8_t *img = block->img;
+        *link = block->next;
+        POOL.bytes -= bytes;
+        POOL.hits++;
+        pthread_mutex_unlock(&POOL.lock);
+
+        free(block);
+        return img;
+    }
+
+    POOL.misses++;
+    pthread_mutex_unlock(&POOL.lock);
+    return (u_int8_t*)malloc(bytes);
+}
+
+/**
+ * @brief Hands pixels back to the pool, they are freed if they do not fit.
+ * 
+ * @param img   The pixels.
+ * @param bytes The size of the pixels.
+ */
+static void _POOL_PUT(u_int8_t *img, size_t bytes) {
+    POOL_BLOCK *block = bytes <= POOL_BUDGET ? (POOL_BLOCK*)malloc(sizeof(POOL_BLOCK)) : NULL;
+    if (!block) {
+        free(img);
+        return;
+    }
+
+    block->img = img;
+    block->bytes = bytes;
+
+    pthread_mutex_lock(&POOL.lock);
+    block->next = POOL.head;
+    POOL.head = block;
+    POOL.bytes += bytes;
+    _POOL_TRIM();
+    pthread_mutex_unlock(&POOL.lock);
+}
+
+/**
+ * @brief Frees every block held by the pool.
+ */
+void POOL_CLEAR(void) {
+    pthread_mutex_lock(&POOL.lock);
+    while (POOL.head) {
+        POOL_BLOCK *block = POOL.head;
+        POOL.head = block->next;
+        free(block->img);
+        free(block);
+    }
+    POOL.bytes = 0;
+    pthread_mutex_unlock(&POOL.lock);
+}
+
+/**
+ * @brief Maps the pixels of the BMP image on a new file of the canvas directory.
+ * The file is unlinked right away and sized sparse, the mapping is shared so
+ * the kernel pages the pixels out to the file instead of keeping them in memory.
+ * 
+ * @param bmp   The BMP structure, with its canvas directory.
+ * @param bytes The size in bytes of the pixels.
+ * @return EXIT_SUCCESS if the pixels are mapped, EXIT_FAILURE otherwise.
+ */
+static u_int8_t _CANVAS_MAP(BMP *bmp, size_t bytes) {
+    size_t length = strlen(bmp->canvas_dir) + sizeof("/bmp-canvas-XXXXXX");
+    char *path = (char*)malloc(length);
+    if (!path) return EXIT_FAILURE;
+
+    snprintf(path, length, "%s/bmp-canvas-XXXXXX", bmp->canvas_dir);
+    int fd = mkstemp(path);
+    if (fd >= 0) unlink(path);
+    free(path);
+    if (fd < 0) return EXIT_FAILURE;
+
+    if ((off_t)bytes < 0 || ftruncate(fd, (off_t)bytes)) {
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    u_int8_t *map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return EXIT_FAILURE;
+
+    bmp->map = map;
+    bmp->map_size = bytes;
+    bmp->img = map;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Allocates the pixels of the BMP image for its width and height.
+ * The size is computed in 64 bits and checked for overflow. With a canvas
+ * directory the pixels are mapped on a file, otherwise they come from the pool.
+ * 
+ * @param bmp The BMP structure, with its information header.
+ * @return EXIT_SUCCESS if the pixels are allocated, EXIT_FAILURE otherwise.
+ */
+u_int8_t CANVAS_ALLOC(BMP *bmp) {
+    size_t pixels, bytes;
+
+    if (bmp->info.width <= 0 || bmp->info.height <= 0 ||
+        __builtin_mul_overflow(IMG_SIDE(bmp->info.width), IMG_SIDE(bmp->info.height), &pixels) ||
+        __builtin_mul_overflow(pixels, (size_t)PIXEL_BYTES, &bytes))
+        return EXIT_FAILURE;
+
+    if (bmp->canvas_dir)
+        return _CANVAS_MAP(bmp, bytes);
+
+    bmp->img = _POOL_ALLOC(bytes);
+    if (!bmp->img)
+        return EXIT_FAILURE;
+
+    COUNT_ALLOC(bmp, bytes);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Hands the pixels of the BMP image back.
+ * Mappings are unmapped, allocated pixels go to the pool for the next image
+ * of the same size.
+ * 
+ * @param bmp The BMP structure, its information header still the one of the pixels.
+ */
+void CANVAS_RELEASE(BMP *bmp) {
+    if (bmp->map) {
+        munmap(bmp->map, bmp->map_size);
+        bmp->map = NULL;
+        bmp->map_size = 0;
+        bmp->map_dev = 0;
+        bmp->map_ino = 0;
+    } else if (bmp->img) {
+        _POOL_PUT(bmp->img, IMG_BYTES(bmp->info.width, bmp->info.height));
+    }
+    bmp->img = NULL;
+}
+
+/* -----------------------------------------POOL----------------------------------------- */
+/* ----------------------------------------CANVAS---------------------------------------- */
+
+// A named canvas. The pixels of the active one live in the BMP of the session,
+// its fields here stay empty until it is parked.
+typedef struct Canvas {
+    char                 *name;
+    bmp_infoheader       info;
+    u_int8_t             *img;
+    u_int8_t             *map;
+    size_t               map_size;
+    dev_t                map_dev;
+    ino_t                map_ino;
+} CANVAS;
+
+struct CanvasSet {
+    CANVAS               *items;
+    size_t               count;
+    size_t               capacity;
+    size_t               active;      // Canvas whose pixels are in the BMP.
+};
+
+/**
+ * @brief Swaps the pixels of the BMP with the ones of a canvas.
+ */
+static void _CANVAS_SWAP(BMP *bmp, CANVAS *canvas) {
+    bmp_infoheader info = bmp->info;
+    u_int8_t *img = bmp->img, *map = bmp->map;
+    size_t map_size = bmp->map_size;
+    dev_t map_dev = bmp->map_dev;
+    ino_t map_ino = bmp->map_ino;
+
+    bmp->info = canvas->info;
+    bmp->img = canvas->img;
+    bmp->map = canvas->map;
+    bmp->map_size = canvas->map_size;
+    bmp->map_dev = canvas->map_dev;
+    bmp->map_ino = canvas->map_ino;
+
+    canvas->info = info;
+    canvas->img = img;
+    canvas->map = map;
+    canvas->map_size = map_size;
+    canvas->map_dev = map_dev;
+    canvas->map_ino = map_ino;
+}
+
+/**
+ * @brief Hands the pixels of a parked canvas back to the pool.
+ */
+static void _CANVAS_DROP(CANVAS *canvas) {
+    BMP view;
+    memset(&view, 0, sizeof(view));
+    _CANVAS_SWAP(&view, canvas);
+    CANVAS_RELEASE(&view);
+}
+
+/**
+ * @brief Looks a canvas up by name.
+ * 
+ * @return The index of the canvas, or the number of canvases if there is none.
+ */
+static size_t _CANVAS_FIND(const CANVASES *set, const char *name) {
+    size_t i = 0;
+    while (i < set->count && strcmp(set->items[i].name, name))
+        i++;
+    return i;
+}
+
+/**
+ * @brief Adds an empty canvas.
+ * 
+ * @return The index of the canvas, or the number of canvases if out of memory.
+ */
+static size_t _CANVAS_ADD(CANVASES *set, const char *name) {
+    if (set->count == set->capacity) {
+        size_t capacity = set->capacity ? 2 * set->capacity : 4;
+        CANVAS *items = (CANVAS*)realloc(set->items, capacity * sizeof(CANVAS));
+        if (!items) return set->count;
+        set->items = items;
+        set->capacity = capacity;
+    }
+
+    CANVAS *canvas = set->items + set->count;
+    memset(canvas, 0, sizeof(*canvas));
+    canvas->name = strdup(name);
+    if (!canvas->name) return set->count;
+
+    return set->count++;
+}
+
+/**
+ * @brief Gets the canvases of the BMP, created on first use with the
+ * CANVAS_MAIN canvas holding the current image.
+ * 
+ * @return The canvases, or NULL if out of memory.
+ */
+static CANVASES *_CANVAS_SET(BMP *bmp) {
+    if (bmp->canvases)
+        return bmp->canvases;
+
+    CANVASES *set = (CANVASES*)calloc(1, sizeof(CANVASES));
+    if (!set) return NULL;
+
+    if (_CANVAS_ADD(set, CANVAS_MAIN) == set->count) {
+        free(set->items);
+        free(set);
+        return NULL;
+    }
+
+    bmp->canvases = set;
+    return set;
+}
+
+/**
+ * @brief Makes a canvas the active one, parking the pixels of the current one.
+ * The save in flight reads the pixels parked, so it is waited for first.
+ */
+static void _CANVAS_ACTIVATE(BMP *bmp, CANVASES *set, size_t index) {
+    if (index == set->active)
+        return;
+
+    SAVE_WAIT(bmp);
+    _CANVAS_SWAP(bmp, set->items + set->active);
+    _CANVAS_SWAP(bmp, set->items + index);
+    set->active = index;
+}
+
+/**
+ * @brief Loads an image file into a named canvas and makes it the active one.
+ * The canvas is created if there is none with this name, otherwise its image
+ * is replaced as by EDIT. If the image cannot be loaded, the canvases are left
+ * as they were: a canvas created for it is forgotten and the previous one stays active.
+ * 
+ * @param bmp  The BMP structure of the session.
+ * @param name The name of the canvas.
+ * @param file The filename of the input BMP file.
+ * @return EXIT_SUCCESS if the image is loaded, EXIT_FAILURE otherwise.
+ */
+u_int8_t CANVAS_OPEN(BMP *bmp, const char *name, char *file) {
+    CANVASES *set = _CANVAS_SET(bmp);
+    if (!set) return EXIT_FAILURE;
+
+    size_t previous = set->active;
+    size_t index = _CANVAS_FIND(set, name);
+    bool added = index == set->count;
+    if (added && _CANVAS_ADD(set, name) == set->count)
+        return EXIT_FAILURE;
+
+    _CANVAS_ACTIVATE(bmp, set, index);
+    if (!EDIT(file, bmp))
+        return EXIT_SUCCESS;
+
+    // EDIT kept the image of the canvas, a new one is the last and empty.
+    _CANVAS_ACTIVATE(bmp, set, previous);
+    if (added) {
+        _CANVAS_DROP(set->items + index);
+        free(set->items[index].name);
+        set->count--;
+    }
+
+    return EXIT_FAILURE;
+}
+
+/**
+ * @brief Makes a named canvas the active one: the next commands run on it.
+ * 
+ * @param bmp  The BMP structure of the session.
+ * @param name The name of the canvas.
+ * @return EXIT_SUCCESS if the canvas exists, EXIT_FAILURE otherwise.
+ */
+u_int8_t CANVAS_USE(BMP *bmp, const char *name) {
+    CANVASES *set = _CANVAS_SET(bmp);
+    if (!set) return EXIT_FAILURE;
+
+    size_t index = _CANVAS_FIND(set, name);
+    if (index == set->count)
+        return EXIT_FAILURE;
+
+    _CANVAS_ACTIVATE(bmp, set, index);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Copies the pixels of a canvas into another one.
+ * The destination is created if there is none with this name, otherwise its
+ * image is replaced. The active canvas does not change.
+ * 
+ * @param bmp The BMP structure of the session.
+ * @param src The name of the canvas copied.
+ * @param dst The name of the canvas receiving the copy.
+ * @return EXIT_SUCCESS if the canvas is copied, EXIT_FAILURE otherwise.
+ */
+u_int8_t CANVAS_CLONE(BMP *bmp, const char *src, const char *dst) {
+    CANVASES *set = _CANVAS_SET(bmp);
+    if (!set) return EXIT_FAILURE;
+
+    size_t from = _CANVAS_FIND(set, src);
+    if (from == set->count)
+        return EXIT_FAILURE;
+    if (!strcmp(src, dst))
+        return EXIT_SUCCESS;
+
+    size_t to = _CANVAS_FIND(set, dst);
+    if (to == set->count && (to = _CANVAS_ADD(set, dst)) == set->count)
+        return EXIT_FAILURE;
+
+    const bmp_infoheader *info = from == set->active ? &bmp->info : &set->items[from].info;
+    const u_int8_t *img = from == set->active ? bmp->img : set->items[from].img;
+    if (!img) return EXIT_FAILURE;
+
+    // The copy holds the same layout, so the pixels are copied as they are.
+    BMP copy;
+    memset(&copy, 0, sizeof(copy));
+    copy.info = *info;
+    copy.canvas_dir = bmp->canvas_dir;
+    if (CANVAS_ALLOC(&copy))
+        return EXIT_FAILURE;
+    memcpy(copy.img, img, IMG_BYTES(info->width, info->height));
+    bmp->allocs += copy.allocs;
+
+    if (to == set->active) {
+        SAVE_WAIT(bmp);
+        CANVAS_RELEASE(bmp);
+        bmp->info = copy.info;
+        bmp->img = copy.img;
+        bmp->map = copy.map;
+        bmp->map_size = copy.map_size;
+        bmp->map_dev = copy.map_dev;
+        bmp->map_ino = copy.map_ino;
+    } else {
+        _CANVAS_DROP(set->items + to);
+        _CANVAS_SWAP(&copy, set->items + to);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Frees the pixels of a named canvas and forgets its name.
+ * Closing the active canvas makes CANVAS_MAIN active again. CANVAS_MAIN
+ * itself is only emptied.
+ * 
+ * @param bmp  The BMP structure of the session.
+ * @param name The name of the canvas.
+ * @return EXIT_SUCCESS if the canvas existed, EXIT_FAILURE otherwise.
+ */
+u_int8_t CANVAS_CLOSE(BMP *bmp, const char *name) {
+    CANVASES *set = _CANVAS_SET(bmp);
+    if (!set) return EXIT_FAILURE;
+
+    size_t index = _CANVAS_FIND(set, name);
+    if (index == set->count)
+        return EXIT_FAILURE;
+
+    if (index == set->active) {
+        SAVE_WAIT(bmp);
+        CANVAS_RELEASE(bmp);
+        memset(&bmp->info, 0, sizeof(bmp->info));
+    } else {
+        _CANVAS_DROP(set->items + index);
+    }
+
+    // CANVAS_MAIN is the first canvas and stays.
+    if (!index)
+        return EXIT_SUCCESS;
+
+    free(set->items[index].name);
+    memmove(set->items + index, set->items + index + 1,
+            (set->count - index - 1) * sizeof(CANVAS));
+    set->count--;
+
+    if (index == set->active) {
+        set->active = 0;
+        _CANVAS_SWAP(bmp, set->items);
+    } else if (index < set->active) {
+        set->active--;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Copies the pixels of the BMP image out of the file they are mapped from.
+ * 
+ * @param bmp The BMP structure, active or a view of a parked canvas.
+ * @param st  The status of the file.
+ * @return EXIT_SUCCESS if the pixels are not mapped from the file or are copied,
+ * EXIT_FAILURE if out of memory.
+ */
+static u_int8_t _CANVAS_UNMAP(BMP *bmp, const struct stat *st) {
+    if (!bmp->map || !bmp->map_ino || bmp->map_dev != st->st_dev || bmp->map_ino != st->st_ino)
+        return EXIT_SUCCESS;
+
+    BMP copy;
+    memset(&copy, 0, sizeof(copy));
+    copy.info = bmp->info;
+    copy.canvas_dir = bmp->canvas_dir;
+    if (CANVAS_ALLOC(&copy))
+        return EXIT_FAILURE;
+    memcpy(copy.img, bmp->img, IMG_BYTES(bmp->info.width, bmp->info.height));
+
+    CANVAS_RELEASE(bmp);
+    bmp->img = copy.img;
+    bmp->map = copy.map;
+    bmp->map_size = copy.map_size;
+    bmp->allocs += copy.allocs;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Copies the pixels of every canvas mapped from a file out of it.
+ * An image edited from a file is drawn on a private mapping of it, and the
+ * pages never written are still read from the file: they must be copied before
+ * the file is emptied or rewritten. No save may be in flight.
+ * 
+ * @param bmp The BMP structure of the session.
+ * @param st  The status of the file.
+ * @return EXIT_SUCCESS if no pixels are read from the file anymore, EXIT_FAILURE otherwise.
+ */
+u_int8_t CANVAS_DETACH(BMP *bmp, const struct stat *st) {
+    if (_CANVAS_UNMAP(bmp, st))
+        return EXIT_FAILURE;
+
+    CANVASES *set = bmp->canvases;
+    for (size_t i = 0; set && i < set->count; i++) {
+        if (i == set->active || !set->items[i].map)
+            continue;
+
+        BMP view;
+        memset(&view, 0, sizeof(view));
+        view.canvas_dir = bmp->canvas_dir;
+        _CANVAS_SWAP(&view, set->items + i);
+        u_int8_t status = _CANVAS_UNMAP(&view, st);
+        _CANVAS_SWAP(&view, set->items + i);
+        bmp->allocs += view.allocs;
+        if (status) return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Reports the pixel bytes held by every canvas and by the pool.
+ * Nothing is reported if no canvas was named.
+ * 
+ * @param bmp  The BMP structure of the session.
+ * @param fout The output file stream of the report.
+ */
+void CANVAS_REPORT(const BMP *bmp, FILE *fout) {
+    const CANVASES *set = bmp->canvases;
+    if (!set) return;
+
+    size_t total = 0;
+    for (size_t i = 0; i < set->count; i++) {
+        const CANVAS *canvas = set->items + i;
+        const bmp_infoheader *info = i == set->active ? &bmp->info : &canvas->info;
+        const u_int8_t *img = i == set->active ? bmp->img : canvas->img;
+        const u_int8_t *map = i == set->active ? bmp->map : canvas->map;
+        size_t map_size = i == set->active ? bmp->map_size : canvas->map_size;
+
+        size_t bytes = !img ? 0 : map ? map_size : IMG_BYTES(info->width, info->height);
+        total += bytes;
+        fprintf(fout, "CANVAS %s: %dx%d, %zu bytes%s%s\n", canvas->name,
+                img ? info->width : 0, img ? info->height : 0, bytes,
+                map ? " mapped" : "", i == set->active ? " (active)" : "");
+    }
+
+    pthread_mutex_lock(&POOL.lock);
+    fprintf(fout, "CANVAS: %zu canvases, %zu bytes, pool %zu hits, %zu misses, %zu bytes held\n",
+            set->count, total, POOL.hits, POOL.misses, POOL.bytes);
+    pthread_mutex_unlock(&POOL.lock);
+}
+
+/**
+ * @brief Frees the parked canvases of the BMP image and their names.
+ * The pixels of the active canvas stay in the BMP.
+ * 
+ * @param bmp The BMP structure of the session.
+ */
+void CANVAS_FREE(BMP *bmp) {
+    CANVASES *set = bmp->canvases;
+    if (!set) return;
+
+    for (size_t i = 0; i < set->count; i++) {
+        BMP view;
+        memset(&view, 0, sizeof(view));
+        _CANVAS_SWAP(&view, set->items + i);
+        FREE_BMP(&view);
+        free(set->items[i].name);
+    }
+
+    free(set->items);
+    free(set);
+    bmp->canvases = NULL;
+}
+
+/* ----------------------------------------CANVAS---------------------------------------- */
@@ -1,9 +1,29 @@
 #include "../include/bmp_image.h"
+#include "../include/lib/cmd_span.h"
+
+/**
+ * @brief Checks if rows of the brush can be written by its kernel.
+ * They must lie inside the image (and band), be contiguous in its layout, and
+ * no save may be in flight: ROW_FILL clips them and copies the pages otherwise.
+ * 
+ * @param bmp  The BMP image.
+ * @param row  The first row.
+ * @param col  The first column.
+ * @param rows The number of rows.
+ * @return true if the kernel of the brush can write them, false otherwise.
+ */
+static inline bool _STAMP_INSIDE(const BMP *bmp, long long row, long long col, int rows) {
+    return bmp->stamp && !bmp->snap && col >= 0 &&
+           row >= BAND_TOP(bmp) && row + rows <= BAND_END(bmp) &&
+           col + bmp->brush_size <= bmp->info.width &&
+           ROW_RUN(bmp, row, col) >= bmp->brush_size;
+}
 
 /**
  * @brief Draws a dot at the specified coordinates with a brush size.
  * Draws a dot with the specified brush size and color
- * at the given coordinates (y1, x1) on the BMP image.
+ * at the given coordinates (y1, x1) on the BMP image. Inside the image, the
+ * kernel of the brush size stamps it; on the borders, the rows are clipped.
  * 
  * @param bmp The BMP image.
  * @param y1  The Y-coordinate of the dot.
@@ -17,31 +37,122 @@ u_int8_t DOT(BMP *bmp, int y1, int x1) {
     // Half of the brush size.
     int half = (int)(bmp->brush_size / 2);
 
+    if (_STAMP_INSIDE(bmp, (long long)x1 - half, (long long)y1 - half, bmp->brush_size)) {
+        bmp->stamp(bmp, x1 - half, y1 - half, bmp->brush_size);
+        return EXIT_SUCCESS;
+    }
+
     // Calculate the starting and ending indices 
     // for the rows and columns to draw the dot.
-    int Si = max(0, x1 - half);
+    int Si = max(BAND_TOP(bmp), x1 - half);
     int Sj = max(0, y1 - half);
-    int Ei = min(bmp->info.height, x1 + half + 1);
+    int Ei = min(BAND_END(bmp), x1 + half + 1);
     int Ej = min(bmp->info.width, y1 + half + 1);
 
-    // Iterate through the rows and columns within the brush size.
-    for (int l = Si; l < Ei; l++) {
-        for (int j = Sj; j < Ej; j++) {
-            // Calculate the index in the image data for the current pixel.
-            int ImgIdx = l * bmp->info.width * SIZE_COLOR + j * SIZE_COLOR;
-            // Copy the brush color to the current pixel in the image.
-            memcpy(bmp->img + ImgIdx, bmp->brush_color, SIZE_COLOR);
-        }
-    }
+    // Paint every row within the brush size as one span.
+    for (int l = Si; l < Ei && Sj < Ej; l++)
+        ROW_FILL(bmp, l, Sj, bmp->brush_color, Ej - Sj);
 
     return EXIT_SUCCESS;
 }
 
+/**
+ * @brief Paints a horizontal run of pixels with the brush color.
+ * The run is clipped against the left and right borders of the image.
+ * 
+ * @param bmp   The BMP image.
+ * @param row   The row of the run.
+ * @param left  The first column of the run.
+ * @param right The last column of the run.
+ */
+static void _DRAW_SPAN(BMP *bmp, int row, long long left, long long right) {
+    left = max(left, 0);
+    right = min(right, bmp->info.width - 1);
+
+    if (left <= right)
+        ROW_FILL(bmp, row, (int)left, bmp->brush_color, right - left + 1);
+}
+
+/**
+ * @brief Divides delta * t by steps, as floor quotient and remainder.
+ * The product is taken unsigned, since both factors are below 2^32.
+ * 
+ * @param delta The minor coordinate moved over the whole line, |delta| <= steps.
+ * @param steps The steps of the line along its major axis.
+ * @param t     The step, 0 <= t <= steps.
+ * @param quot  Set to the floor quotient.
+ * @param rem   Set to the remainder, 0 <= rem < steps.
+ */
+static inline void _LINE_DIVIDE(long long delta, long long steps, long long t,
+                                long long *quot, long long *rem) {
+    unsigned long long num = (unsigned long long)llabs(delta) * (unsigned long long)t;
+    *quot = (long long)(num / (unsigned long long)steps);
+    *rem = (long long)(num % (unsigned long long)steps);
+    if (delta < 0) {
+        *quot = -*quot;
+        if (*rem) *rem = steps - *rem, (*quot)--;
+    }
+}
+
+/**
+ * @brief Gets the point of a line at a step.
+ * The minor coordinate is minor + delta * t / steps rounded toward zero, as the
+ * division of the original stepping did.
+ * 
+ * @param minor The minor coordinate of the first point.
+ * @param delta The minor coordinate moved over the whole line.
+ * @param steps The steps of the line along its major axis.
+ * @param t     The step.
+ * @return The minor coordinate of the point.
+ */
+static inline long long _LINE_POINT(long long minor, long long delta, long long steps, long long t) {
+    long long quot, rem;
+    _LINE_DIVIDE(delta, steps, t, &quot, &rem);
+    quot += minor;
+    return quot + (quot < 0 && rem);
+}
+
+/**
+ * @brief Finds where a line crosses a bound of its minor axis.
+ * The minor coordinate moves one way along the line, so the steps past the
+ * bound form a suffix of [lo, hi], found by bisection: rounding makes the step
+ * crossing the bound too far from the exact parameter for a single division.
+ * 
+ * @param minor The minor coordinate of the first point.
+ * @param delta The minor coordinate moved over the whole line.
+ * @param steps The steps of the line along its major axis.
+ * @param lo    The first step searched.
+ * @param hi    The last step searched.
+ * @param bound The bound, reached moving the way of delta.
+ * @return The first step reaching the bound, hi + 1 if none does.
+ */
+static long long _LINE_ENTER(long long minor, long long delta, long long steps,
+                             long long lo, long long hi, long long bound) {
+    long long sign = delta < 0 ? -1 : 1;
+    hi++;
+    while (lo < hi) {
+        long long mid = lo + (hi - lo) / 2;
+        if (sign * _LINE_POINT(minor, delta, steps, mid) >= sign * bound) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
 /**
  * @brief Draws a line on the BMP image between two points.
  * Draws a line between the specified points (y1, x1) and (y2, x2) on the BMP image.
  * The line is drawn using the brush color and size defined in the BMP structure.
  * 
+ * The points of the line are the ones DOT used to be stamped on: one point per
+ * step along the longer axis, the other coordinate rounded toward zero. The steps
+ * are first clipped against the image (or band) grown by half the brush, like a
+ * Liang-Barsky clip of the parameter: the brush of the points left out cannot
+ * reach a pixel, so the work follows the visible part of the line only. The kept
+ * points are generated with an incremental quotient and remainder, and grouped
+ * by row. The brush squares centered on them cover, on every row, one run of
+ * columns bounded by the points of the first and last rows in reach of the
+ * brush, so each pixel of the line is written once.
+ * 
  * @param bmp The BMP image.
  * @param y1  The Y-coordinate of the starting point.
  * @param x1  The X-coordinate of the starting point.
@@ -61,57 +172,91 @@ u_int8_t LINE(BMP *bmp, int y1, int x1, int y2, int x2) {
         return EXIT_SUCCESS;
     }
 
-    // If the line is vertical (same X-coordinates),
-    // draw the line pixel by pixel along the Y-axis.
-    if (x1 == x2) {
-        if (y1 > y2)
-            swap(&y1, &y2, SIZE_INT);
-        for (int y = y1; y <= y2; y++)
-            DOT(bmp, y, x1);
+    // Step along the rows when the line is closer to vertical (in rows),
+    // along the columns otherwise, from the smaller end of that axis.
+    bool steep = llabs((long long)x1 - x2) > llabs((long long)y1 - y2);
+    long long major = steep ? min(x1, x2) : min(y1, y2);
+    long long steps = steep ? llabs((long long)x1 - x2) : llabs((long long)y1 - y2);
+    bool swapped = steep ? x1 > x2 : y1 > y2;
+    long long minor = steep ? (swapped ? y2 : y1) : (swapped ? x2 : x1);
+    long long delta = (steep ? (swapped ? (long long)y1 - y2 : (long long)y2 - y1)
+                             : (swapped ? (long long)x1 - x2 : (long long)x2 - x1));
+
+    int half = (int)(bmp->brush_size / 2);
+    long long top = BAND_TOP(bmp), end = BAND_END(bmp);
+
+    // Points whose brush can reach the image (or band), on both axes.
+    long long row_lo = top - half, row_hi = end - 1 + half;
+    long long col_lo = -half, col_hi = (long long)bmp->info.width - 1 + half;
+    long long major_lo = steep ? row_lo : col_lo, major_hi = steep ? row_hi : col_hi;
+    long long minor_lo = steep ? col_lo : row_lo, minor_hi = steep ? col_hi : row_hi;
+
+    // Steps entering and leaving the grown image: the major axis clips them
+    // exactly, the minor axis where its rounded coordinate crosses the bounds.
+    long long begin = max(major_lo - major, 0);
+    long long stop = min(major_hi - major, steps);
+    if (begin > stop)
         return EXIT_SUCCESS;
-    }
 
-    // If the line is horizontal (same Y-coordinates),
-    // draw the line pixel by pixel along the X-axis.
-    if (y1 == y2) {
-        if (x1 > x2)
-            swap(&x1, &x2, SIZE_INT);
-        for (int x = x1; x <= x2; x++)
-            DOT(bmp, y1, x);
+    begin = _LINE_ENTER(minor, delta, steps, begin, stop, delta < 0 ? minor_hi : minor_lo);
+    stop = _LINE_ENTER(minor, delta, steps, begin, stop, delta < 0 ? minor_lo - 1 : minor_hi + 1) - 1;
+    if (begin > stop)
         return EXIT_SUCCESS;
+
+    // Rows holding the kept points, every one of them holds at least one.
+    long long minor_begin = _LINE_POINT(minor, delta, steps, begin);
+    long long minor_stop = _LINE_POINT(minor, delta, steps, stop);
+    long long first = steep ? major + begin : min(minor_begin, minor_stop);
+    long long last = steep ? major + stop : max(minor_begin, minor_stop);
+
+    // One run of point columns per row.
+    size_t rows = (size_t)(last - first + 1);
+    if (rows > bmp->stack_size) {
+        SPAN *stack = (SPAN*)realloc(bmp->stack, rows * sizeof(SPAN));
+        if (!stack) return EXIT_FAILURE;
+        bmp->stack = stack;
+        bmp->stack_size = rows;
+        COUNT_ALLOC(bmp, rows * sizeof(SPAN));
     }
+    SPAN *runs = bmp->stack;
+    for (size_t l = 0; l < rows; l++)
+        runs[l] = (SPAN){ INT_MAX, INT_MIN, (int)(first + l), 0 };
 
-    int distX, distY;
-    // Calculate the absolute distances in the X and Y directions.
-    if (abs(x1 - x2) <= abs(y1 - y2)) {
-        // If the line is closer to vertical,
-        // draw it pixel by pixel along the Y-axis.
-        if (y1 > y2) {
-            swap(&y1, &y2, SIZE_INT);
-            swap(&x1, &x2, SIZE_INT);
-        }
+    // minor + delta * t / steps as floor quotient and remainder.
+    long long quot, rem;
+    _LINE_DIVIDE(delta, steps, begin, &quot, &rem);
+    quot += minor;
 
-        distX = x2 - x1, distY = y2 - y1;
+    for (long long t = begin; t <= stop; t++) {
+        // Round toward zero, as the division of the original stepping did.
+        long long point = quot + (quot < 0 && rem);
+        long long row = steep ? major + t : point;
+        long long col = steep ? point : major + t;
 
-        // Calculate the corresponding X-coordinate for the current Y-coordinate.
-        for (int y = y1; y <= y2; y++) {
-            int x = (distX * (y - y1) + distY * x1) / distY;
-            DOT(bmp, y, x);
-        }
-    } else {
-        // If the line is closer to horizontal,
-        // draw it pixel by pixel along the X-axis.
-        if (x1 > x2) {
-            swap(&y1, &y2, SIZE_INT);
-            swap(&x1, &x2, SIZE_INT);
-        }
+        SPAN *run = runs + (row - first);
+        run->left = (int)min(run->left, col);
+        run->right = (int)max(run->right, col);
 
-        distX = x2 - x1, distY = y2 - y1;
-        // Calculate the corresponding Y-coordinate for the current X-coordinate.
-        for (int x = x1; x <= x2; x++) {
-            int y = (distY * (x - x1) + distX * y1) / distX;
-            DOT(bmp, y, x);
-        }
+        rem += delta;
+        if (rem >= steps) rem -= steps, quot++;
+        if (rem < 0) rem += steps, quot--;
+    }
+
+    // Every row gets the columns of the points in reach of the brush. Rows of
+    // one brush width, most of a steep line, go to the kernel of the brush.
+    long long row_first = max(first - half, top);
+    long long row_last = min(last + half, end - 1);
+
+    for (long long row = row_first; row <= row_last; row++) {
+        SPAN *a = runs + (max(row - half, first) - first);
+        SPAN *b = runs + (min(row + half, last) - first);
+        long long left = (long long)min(a->left, b->left) - half;
+        long long right = (long long)max(a->right, b->right) + half;
+
+        if (right - left + 1 == bmp->brush_size && _STAMP_INSIDE(bmp, row, left, 1))
+            bmp->stamp(bmp, (int)row, (int)left, 1);
+        else
+            _DRAW_SPAN(bmp, (int)row, left, right);
     }
 
     return EXIT_SUCCESS;
@@ -161,3 +306,188 @@ u_int8_t TRIANGLE(BMP *bmp, int y1, int x1, int y2, int x2, int y3, int x3) {
     if (LINE(bmp, y1, x1, y2, x2)) return EXIT_FAILURE;
     return EXIT_SUCCESS;
 }
+
+/**
+ * @brief Draws a filled rectangle on the BMP image, border and interior.
+ * Paints in one pass what RECTANGLE followed by a FILL inside it paints on a
+ * uniform interior: the rectangle grown by half the brush size on every side,
+ * one span per row.
+ * 
+ * @param bmp    The BMP image.
+ * @param y1     The Y-coordinate of the top-left corner of the rectangle.
+ * @param x1     The X-coordinate of the top-left corner of the rectangle.
+ * @param width  The width of the rectangle.
+ * @param height The height of the rectangle.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE if there is an error.
+ */
+u_int8_t FILLED_RECTANGLE(BMP *bmp, int y1, int x1, int width, int height) {
+    if (!bmp || !(bmp->brush_size % 2) || !bmp->img)
+        return EXIT_FAILURE;
+
+    long long half = bmp->brush_size / 2;
+    long long left = min((long long)y1, (long long)y1 + width) - half;
+    long long right = max((long long)y1, (long long)y1 + width) + half;
+    long long top = max(min((long long)x1, (long long)x1 + height) - half, (long long)BAND_TOP(bmp));
+    long long bottom = min(max((long long)x1, (long long)x1 + height) + half,
+                           (long long)BAND_END(bmp) - 1);
+
+    for (long long row = top; row <= bottom; row++)
+        _DRAW_SPAN(bmp, (int)row, left, right);
+
+    return EXIT_SUCCESS;
+}
+
+typedef struct PolygonEdge {
+    long long            first;       // First row crossed by the edge.
+    long long            last;        // Row after the last row crossed by the edge.
+    long long            quot;        // Column crossed on the current row: quot + rem / den.
+    long long            rem;
+    long long            den;         // Rows spanned by the edge.
+    long long            step_quot;   // Columns moved per row: step_quot + step_rem / den.
+    long long            step_rem;
+} EDGE;
+
+/**
+ * @brief Orders two edges by the column where they cross the current row.
+ * The fractions are compared as unsigned products: both factors are below 2^32.
+ */
+static bool _EDGE_BEFORE(const EDGE *a, const EDGE *b) {
+    if (a->quot != b->quot)
+        return a->quot < b->quot;
+    return (unsigned long long)a->rem * (unsigned long long)b->den <
+           (unsigned long long)b->rem * (unsigned long long)a->den;
+}
+
+/**
+ * @brief Paints the interior of a polygon with an active edge table.
+ * Pixels whose center is inside the polygon (even-odd rule) are painted, one
+ * span per pair of active edges per row. Every edge covers the rows from its
+ * upper end included to its lower end excluded, so a vertex is crossed once.
+ * The edges walk their columns with an incremental quotient and remainder.
+ * 
+ * @param bmp   The BMP image.
+ * @param y     The Y-coordinates of the vertices.
+ * @param x     The X-coordinates of the vertices.
+ * @param count The number of vertices, at most POLY_VERTS.
+ */
+static void _POLYGON_SPANS(BMP *bmp, const int *y, const int *x, int count) {
+    EDGE edges[POLY_VERTS];
+    EDGE *active[POLY_VERTS];
+    int total = 0;
+
+    // Edge table, sorted by first row.
+    for (int i = 0; i < count; i++) {
+        int j = (i + 1) % count;
+        if (x[i] == x[j]) continue;
+
+        int a = x[i] < x[j] ? i : j, b = x[i] < x[j] ? j : i;
+        EDGE edge;
+        edge.first = x[a];
+        edge.last = x[b];
+        edge.den = (long long)x[b] - x[a];
+
+        long long dx = (long long)y[b] - y[a];
+        edge.step_quot = dx / edge.den;
+        edge.step_rem = dx % edge.den;
+        if (edge.step_rem < 0) edge.step_rem += edge.den, edge.step_quot--;
+        edge.quot = y[a];
+        edge.rem = 0;
+
+        int k = total++;
+        for (; k > 0 && edges[k - 1].first > edge.first; k--)
+            edges[k] = edges[k - 1];
+        edges[k] = edge;
+    }
+
+    if (!total) return;
+
+    long long row = max(edges[0].first, (long long)BAND_TOP(bmp));
+    long long bottom = BAND_END(bmp);
+    int next = 0, actives = 0;
+
+    for (; row < bottom && (next < total || actives); row++) {
+        // Move the edges starting on this row (or above the image) to the active table.
+        for (; next < total && edges[next].first <= row; next++) {
+            EDGE *edge = edges + next;
+            if (edge->last <= row) continue;
+
+            // Catch up with the row in one division, unsigned since both factors are below den.
+            long long skip = row - edge->first;
+            unsigned long long num = (unsigned long long)skip * (unsigned long long)edge->step_rem;
+            edge->quot += skip * edge->step_quot + (long long)(num / (unsigned long long)edge->den);
+            edge->rem = (long long)(num % (unsigned long long)edge->den);
+            active[actives++] = edge;
+        }
+
+        // Drop the edges ending on this row.
+        int kept = 0;
+        for (int i = 0; i < actives; i++)
+            if (active[i]->last > row) active[kept++] = active[i];
+        actives = kept;
+
+        // Order the active edges by column, they are almost sorted already.
+        for (int i = 1; i < actives; i++) {
+            EDGE *edge = active[i];
+            int k = i;
+            for (; k > 0 && _EDGE_BEFORE(edge, active[k - 1]); k--)
+                active[k] = active[k - 1];
+            active[k] = edge;
+        }
+
+        for (int i = 0; i + 1 < actives; i += 2) {
+            const EDGE *a = active[i], *b = active[i + 1];
+            _DRAW_SPAN(bmp, (int)row, a->quot + (a->rem > 0), b->quot);
+        }
+
+        for (int i = 0; i < actives; i++) {
+            EDGE *edge = active[i];
+            edge->quot += edge->step_quot;
+            edge->rem += edge->step_rem;
+            if (edge->rem >= edge->den) edge->rem -= edge->den, edge->quot++;
+        }
+    }
+}
+
+/**
+ * @brief Draws a filled polygon on the BMP image.
+ * Paints the interior of the polygon with a scanline rasterizer, then draws its
+ * edges with LINE, using the brush color and size defined in the BMP structure.
+ * 
+ * @param bmp   The BMP image.
+ * @param y     The Y-coordinates of the vertices.
+ * @param x     The X-coordinates of the vertices.
+ * @param count The number of vertices, 3 to POLY_VERTS.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE if there is an error.
+ */
+u_int8_t POLYGON(BMP *bmp, const int *y, const int *x, int count) {
+    if (!bmp || !(bmp->brush_size % 2) || !bmp->img ||
+        count < 3 || count > POLY_VERTS)
+        return EXIT_FAILURE;
+
+    _POLYGON_SPANS(bmp, y, x, count);
+
+    for (int i = 0; i < count; i++) {
+        int j = (i + 1) % count;
+        if (LINE(bmp, y[i], x[i], y[j], x[j])) return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Draws a filled triangle on the BMP image, border and interior.
+ * 
+ * @param bmp The BMP image.
+ * @param y1  The Y-coordinate of the first vertex of the triangle.
+ * @param x1  The X-coordinate of the first vertex of the triangle.
+ * @param y2  The Y-coordinate of the second vertex of the triangle.
+ * @param x2  The X-coordinate of the second vertex of the triangle.
+ * @param y3  The Y-coordinate of the third vertex of the triangle.
+ * @param x3  The X-coordinate of the third vertex of the triangle.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE if there is an error.
+ */
+u_int8_t FILLED_TRIANGLE(BMP *bmp, int y1, int x1, int y2, int x2, int y3, int x3) {
+    const int y[] = { y1, y2, y3 };
+    const int x[] = { x1, x2, x3 };
+    return POLYGON(bmp, y, x, 3);
+}
@@ -1,8 +1,11 @@
 #include "../include/bmp_image.h"
+#include "../include/lib/cmd_span.h"
+#include "../include/lib/cmd_scratch.h"
 
 /**
  * @brief Sets the brush color in the BMP image.
- * Sets the brush color to the specified RGB values (R, G, B) in the BMP image.
+ * Sets the brush color to the specified RGB values (R, G, B) in the BMP image,
+ * and lays it out once in the line of pixels the brush kernels copy.
  *
  * @param bmp The BMP image.
  * @param R   The red component of the brush color.
@@ -17,13 +20,15 @@ u_int8_t SET_COLOR(BMP *bmp, u_int8_t R, u_int8_t G, u_int8_t B) {
     memcpy(bmp->brush_color + 2, &R, 1);
     memcpy(bmp->brush_color + 1, &G, 1);
     memcpy(bmp->brush_color + 0, &B, 1);
+    SPAN_FILL(bmp->brush_line, bmp->brush_color, BRUSH_KERNELS);
 
     return EXIT_SUCCESS;
 }
 
 /**
  * @brief Sets the brush size in the BMP image.
- * Sets the brush size to the specified value in the BMP image.
+ * Sets the brush size to the specified value in the BMP image, and picks the
+ * brush kernel of the size once for the draws that follow.
  * 
  * @param bmp        The BMP image.
  * @param brush_size The brush size to set.
@@ -32,51 +37,470 @@ u_int8_t SET_COLOR(BMP *bmp, u_int8_t R, u_int8_t G, u_int8_t B) {
 u_int8_t SET_LINE(BMP *bmp, u_int8_t brush_size) {
     if (!(brush_size & 1) || !bmp) return EXIT_FAILURE;
     bmp->brush_size = brush_size;
+    bmp->stamp = STAMP_KERNEL(brush_size);
     return EXIT_SUCCESS;
 }
 
 /**
- * @brief Recursively fills a pixel and its neighboring pixels with the brush color.
- * Used by the FILL function to recursively fill a pixel and
- * its neighboring pixels with the brush color. It stops when it encounters a different
- * color or reaches the image boundaries, DFS fill algorithm.
+ * @brief Checks if a pixel still has the color of the region being filled.
+ * 
+ * @param bmp    The BMP image.
+ * @param target The color of the region being filled.
+ * @param row    The row of the pixel.
+ * @param col    The column of the pixel.
+ * @return true if the pixel belongs to the region, false otherwise.
+ */
+static inline bool _FILL_MATCH(BMP *bmp, const u_int8_t *target, int row, int col) {
+    const u_int8_t *pixel = PIXEL(bmp, row, col);
+#ifdef BMP_BGRX
+    // Whole pixels, the fourth byte is always zero.
+    u_int32_t a, b;
+    memcpy(&a, pixel, PIXEL_BYTES);
+    memcpy(&b, target, PIXEL_BYTES);
+    return a == b;
+#else
+    return pixel[0] == target[0] && pixel[1] == target[1] && pixel[2] == target[2];
+#endif
+}
+
+/**
+ * @brief Paints a horizontal run of pixels with the brush color.
  * 
  * @param bmp   The BMP image.
- * @param brush The color to fill with.
- * @param y     The Y-coordinate of the pixel.
- * @param x     The X-coordinate of the pixel.
- * @return EXIT_SUCCESS if successful, EXIT_FAILURE if there is an error.
+ * @param row   The row of the run.
+ * @param left  The first column of the run.
+ * @param right The last column of the run.
  */
-u_int8_t _FILL_PIXEL(BMP *bmp, u_int8_t *brush, int y, int x) {
-    if (y < 0 || y >= bmp->info.width || x < 0 || x >= bmp->info.height)
-        return EXIT_FAILURE;
+static void _FILL_SPAN(BMP *bmp, int row, int left, int right) {
+    ROW_FILL(bmp, row, left, bmp->brush_color, right - left + 1);
+}
 
-    int pixel = (y + x * bmp->info.width) * SIZE_COLOR;
+/**
+ * @brief Pushes a filled span on the fill work stack.
+ * The span is scanned later on the row (row + dir). The stack lives in the BMP
+ * structure and only grows, so consecutive fills reuse the same memory.
+ * 
+ * @param bmp   The BMP image.
+ * @param top   The number of spans currently on the stack.
+ * @param left  The first column of the span.
+ * @param right The last column of the span.
+ * @param row   The row of the span.
+ * @param dir   The direction of the row to scan next (+1 / -1).
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE if the stack cannot grow.
+ */
+static u_int8_t _FILL_PUSH(BMP *bmp, size_t *top, int left, int right, int row, int dir) {
+    // Nothing to scan beyond the image boundaries.
+    if (row + dir < 0 || row + dir >= bmp->info.height)
+        return EXIT_SUCCESS;
 
-    if (bmp->img[pixel] != brush[0] || 
-        bmp->img[pixel + 1] != brush[1] ||
-        bmp->img[pixel + 2] != brush[2])
-        return EXIT_FAILURE;
+    if (*top == bmp->stack_size) {
+        size_t size = bmp->stack_size ? bmp->stack_size * 2 : FILL_STACK;
+        SPAN *stack = (SPAN*)realloc(bmp->stack, size * sizeof(SPAN));
+        if (!stack) return EXIT_FAILURE;
+        bmp->stack = stack;
+        bmp->stack_size = size;
+        COUNT_ALLOC(bmp, size * sizeof(SPAN));
+    }
+
+    bmp->stack[(*top)++] = (SPAN){ left, right, row, dir };
+    return EXIT_SUCCESS;
+}
 
-    if (bmp->img[pixel] == bmp->brush_color[0] &&
-        bmp->img[pixel + 1] == bmp->brush_color[1] &&
-        bmp->img[pixel + 2] == bmp->brush_color[2])
+/**
+ * @brief Paints the run holding the starting pixel and pushes both of its neighbours.
+ * 
+ * @param bmp   The BMP image.
+ * @param brush The color of the area being filled.
+ * @param y     The Y-coordinate of the starting pixel.
+ * @param x     The X-coordinate of the starting pixel.
+ * @param top   The number of spans on the work stack, set.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE if the stack cannot grow.
+ */
+static u_int8_t _FILL_SEED(BMP *bmp, const u_int8_t *brush, int y, int x, size_t *top) {
+    int width = bmp->info.width;
+
+    int left = y, right = y;
+    while (left > 0 && _FILL_MATCH(bmp, brush, x, left - 1))
+        left--;
+    while (right < width - 1 && _FILL_MATCH(bmp, brush, x, right + 1))
+        right++;
+    _FILL_SPAN(bmp, x, left, right);
+    TRACE_ADD(bmp, visited, right - left + 1);
+
+    *top = 0;
+    if (_FILL_PUSH(bmp, top, left, right, x, 1) ||
+        _FILL_PUSH(bmp, top, left, right, x, -1))
         return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
 
-    memcpy(bmp->img + pixel, bmp->brush_color, SIZE_COLOR);
+/**
+ * @brief Serial scanline fill of the area holding the starting pixel.
+ * Every horizontal run is painted at once and the rows above and below it are
+ * scanned from an explicit work stack, so the C stack depth does not depend on
+ * the size of the area. The scan stops once budget pixels are painted: the
+ * spans left on the stack are then the rows still to scan next to the area.
+ * 
+ * @param bmp    The BMP image.
+ * @param brush  The color of the area being filled.
+ * @param top    The number of spans on the work stack, updated.
+ * @param budget The number of pixels painted before the scan stops.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE if there is an error.
+ */
+static u_int8_t _FILL_SCAN(BMP *bmp, const u_int8_t *brush, size_t *top, size_t budget) {
+    int width = bmp->info.width;
+    size_t painted = 0;
+
+    while (*top && painted < budget) {
+        SPAN span = bmp->stack[--*top];
+        int row = span.row + span.dir;
+        TRACE_ADD(bmp, visited, span.right - span.left + 1);
 
-    _FILL_PIXEL(bmp, brush, y + 1, x);
-    _FILL_PIXEL(bmp, brush, y, x + 1);
-    _FILL_PIXEL(bmp, brush, y - 1, x);
-    _FILL_PIXEL(bmp, brush, y, x - 1);
+        for (int col = span.left; col <= span.right; col++) {
+            if (!_FILL_MATCH(bmp, brush, row, col))
+                continue;
+
+            // Extend the run touching the parent span in both directions.
+            int left = col, right = col;
+            while (left > 0 && _FILL_MATCH(bmp, brush, row, left - 1))
+                left--;
+            while (right < width - 1 && _FILL_MATCH(bmp, brush, row, right + 1))
+                right++;
+            _FILL_SPAN(bmp, row, left, right);
+            TRACE_ADD(bmp, visited, max(span.left - left, 0) + max(right - span.right, 0));
+            painted += right - left + 1;
+
+            // Keep going in the same direction, and turn back
+            // where the run leaks past the ends of its parent.
+            if (_FILL_PUSH(bmp, top, left, right, row, span.dir))
+                return EXIT_FAILURE;
+            if (left < span.left &&
+                _FILL_PUSH(bmp, top, left, span.left - 1, row, -span.dir))
+                return EXIT_FAILURE;
+            if (right > span.right &&
+                _FILL_PUSH(bmp, top, span.right + 1, right, row, -span.dir))
+                return EXIT_FAILURE;
+
+            col = right;
+        }
+    }
 
     return EXIT_SUCCESS;
 }
 
+/* -------------------------------------BAND FILL-------------------------------------- */
+
+typedef struct FillRun {
+    int              left;            // First column of the run.
+    int              right;           // Last column of the run.
+} RUN;
+
+typedef struct FillBand {
+    BMP              *bmp;            // The BMP image.
+    const u_int8_t   *brush;          // The color of the area being filled.
+    int              first;           // First row of the band.
+    int              last;            // Row after the last row of the band.
+    RUN              *runs;           // Runs of the band, row after row.
+    size_t           count;           // Number of runs of the band.
+    size_t           size;            // Capacity of the runs vector.
+    size_t           offset;          // Index of the first run among all bands.
+    size_t           *rows;           // Index of the first run of every row (band local).
+    size_t           *parent;         // Union-find forest over the runs of all bands.
+    u_int8_t         *chosen;         // Roots of the sets joining the area painted, shared.
+    u_int8_t         status;          // EXIT_SUCCESS / EXIT_FAILURE of the last pass.
+} FILL_BAND;
+
+/**
+ * @brief Finds the representative run of a union-find set, halving the path walked.
+ * 
+ * @param parent The union-find forest.
+ * @param run    The run to look up.
+ * @return The index of the representative run.
+ */
+static size_t _FIND_RUN(size_t *parent, size_t run) {
+    while (parent[run] != run) {
+        parent[run] = parent[parent[run]];
+        run = parent[run];
+    }
+    return run;
+}
+
+/**
+ * @brief Merges the sets of two runs, the smaller index becomes the root.
+ */
+static void _UNION_RUN(size_t *parent, size_t a, size_t b) {
+    a = _FIND_RUN(parent, a);
+    b = _FIND_RUN(parent, b);
+    if (a < b) parent[b] = a;
+    if (b < a) parent[a] = b;
+}
+
+/**
+ * @brief Gets the runs [begin, end) of a row of a band, as global indices.
+ */
+static void _BAND_ROW(const FILL_BAND *band, int row, size_t *begin, size_t *end) {
+    *begin = band->offset + band->rows[row];
+    *end = band->offset + (row + 1 < band->last ? band->rows[row + 1] : band->count);
+}
+
+/**
+ * @brief Unions the runs of two consecutive rows that touch vertically.
+ * Both rows hold runs sorted by column, so one merge-like pass finds every
+ * pair of overlapping runs.
+ * 
+ * @param parent The union-find forest.
+ * @param band_a The band of the first row.
+ * @param row_a  The first row.
+ * @param band_b The band of the second row.
+ * @param row_b  The second row.
+ */
+static void _UNION_ROWS(size_t *parent, const FILL_BAND *band_a, int row_a,
+                        const FILL_BAND *band_b, int row_b) {
+    size_t a, a_end, b, b_end;
+    _BAND_ROW(band_a, row_a, &a, &a_end);
+    _BAND_ROW(band_b, row_b, &b, &b_end);
+
+    while (a < a_end && b < b_end) {
+        const RUN *ra = band_a->runs + (a - band_a->offset);
+        const RUN *rb = band_b->runs + (b - band_b->offset);
+        if (ra->left <= rb->right && rb->left <= ra->right)
+            _UNION_RUN(parent, a, b);
+        if (ra->right < rb->right) a++; else b++;
+    }
+}
+
+/**
+ * @brief First pass of a band: collects the runs holding the area color.
+ */
+static void *_BAND_RUNS(void *arg) {
+    FILL_BAND *band = (FILL_BAND*)arg;
+    BMP *bmp = band->bmp;
+    int width = bmp->info.width;
+
+    band->status = EXIT_FAILURE;
+    for (int row = band->first; row < band->last; row++) {
+        band->rows[row] = band->count;
+
+        for (int col = 0; col < width; col++) {
+            if (!_FILL_MATCH(bmp, band->brush, row, col))
+                continue;
+
+            int right = col;
+            while (right < width - 1 && _FILL_MATCH(bmp, band->brush, row, right + 1))
+                right++;
+
+            if (band->count == band->size) {
+                size_t size = band->size ? band->size * 2 : FILL_STACK;
+                RUN *runs = (RUN*)realloc(band->runs, size * sizeof(RUN));
+                if (!runs) return NULL;
+                band->runs = runs;
+                band->size = size;
+                COUNT_ALLOC(bmp, size * sizeof(RUN));
+            }
+            band->runs[band->count++] = (RUN){ col, right };
+            col = right;
+        }
+    }
+
+    TRACE_ADD(bmp, visited, (size_t)(band->last - band->first) * width);
+    TRACE_DONE(bmp);
+    band->status = EXIT_SUCCESS;
+    return NULL;
+}
+
+/**
+ * @brief Second pass of a band: unions touching runs inside the band.
+ * Every band only links runs of its own index range, so bands never race.
+ */
+static void *_BAND_UNION(void *arg) {
+    FILL_BAND *band = (FILL_BAND*)arg;
+
+    for (size_t run = 0; run < band->count; run++)
+        band->parent[band->offset + run] = band->offset + run;
+
+    for (int row = band->first + 1; row < band->last; row++)
+        _UNION_ROWS(band->parent, band, row - 1, band, row);
+
+    band->status = EXIT_SUCCESS;
+    return NULL;
+}
+
+/**
+ * @brief Last pass of a band: paints the runs connected to the area painted.
+ * The forest is flat and only read here, shared between all bands.
+ */
+static void *_BAND_PAINT(void *arg) {
+    FILL_BAND *band = (FILL_BAND*)arg;
+
+    for (int row = band->first; row < band->last; row++) {
+        size_t begin, end;
+        _BAND_ROW(band, row, &begin, &end);
+
+        for (size_t run = begin; run < end; run++) {
+            if (!band->chosen[band->parent[run]])
+                continue;
+            const RUN *span = band->runs + (run - band->offset);
+            _FILL_SPAN(band->bmp, row, span->left, span->right);
+        }
+    }
+
+    TRACE_DONE(band->bmp);
+    band->status = EXIT_SUCCESS;
+    return NULL;
+}
+
+/**
+ * @brief Runs one pass over all bands, one thread per band.
+ * Bands whose thread cannot be started run on the calling thread.
+ * 
+ * @param bands The bands.
+ * @param count The number of bands.
+ * @param pass  The pass to run on every band.
+ * @return EXIT_SUCCESS if every band succeeded, EXIT_FAILURE otherwise.
+ */
+static u_int8_t _BAND_PASS(FILL_BAND *bands, int count, void *(*pass)(void*)) {
+    pthread_t threads[FILL_THREADS];
+    bool started[FILL_THREADS];
+    u_int8_t status = EXIT_SUCCESS;
+
+    for (int i = 0; i < count; i++) {
+        started[i] = i && !pthread_create(&threads[i], NULL, pass, bands + i);
+        if (i && !started[i]) pass(bands + i);
+    }
+    pass(bands);
+
+    for (int i = 0; i < count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        if (bands[i].status) status = EXIT_FAILURE;
+    }
+
+    return status;
+}
+
+/**
+ * @brief Marks the sets of the runs touching a span left on the stack by the serial scan.
+ * 
+ * @param bands  The bands, holding their runs.
+ * @param span   The span, whose next row is to scan.
+ * @param chosen The roots of the sets to paint, updated.
+ */
+static void _FILL_CHOOSE(const FILL_BAND *bands, const SPAN *span, u_int8_t *chosen) {
+    int row = span->row + span->dir;
+    const FILL_BAND *band = bands;
+    while (row >= band->last) band++;
+
+    // The runs of a row are sorted: find the first one ending in the span.
+    size_t begin, end;
+    _BAND_ROW(band, row, &begin, &end);
+    for (size_t high = end; begin < high; ) {
+        size_t mid = begin + (high - begin) / 2;
+        if (band->runs[mid - band->offset].right < span->left) begin = mid + 1;
+        else high = mid;
+    }
+
+    for (size_t run = begin; run < end && band->runs[run - band->offset].left <= span->right; run++)
+        chosen[band->parent[run]] = 1;
+}
+
+/**
+ * @brief Links the runs collected by all bands and paints the rest of the filled area.
+ * 
+ * @param bands   The bands, holding their runs.
+ * @param threads The number of bands.
+ * @param spans   The spans left on the stack by the serial scan.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE if there is an error.
+ */
+static u_int8_t _FILL_LINK(FILL_BAND *bands, int threads, size_t spans) {
+    BMP *bmp = bands->bmp;
+    size_t total = 0;
+    for (int i = 0; i < threads; i++) {
+        bands[i].offset = total;
+        total += bands[i].count;
+    }
+
+    // Released with the rows by _FILL_BANDS.
+    size_t *parent = (size_t*)SCRATCH_ALLOC(bmp, total * sizeof(size_t));
+    u_int8_t *chosen = (u_int8_t*)SCRATCH_ALLOC(bmp, total);
+    if (!parent || !chosen) return EXIT_FAILURE;
+    memset(chosen, 0, total);
+
+    for (int i = 0; i < threads; i++) {
+        bands[i].parent = parent;
+        bands[i].chosen = chosen;
+    }
+
+    if (_BAND_PASS(bands, threads, _BAND_UNION))
+        return EXIT_FAILURE;
+
+    // Merge the last row of every band with the first row of the next one.
+    for (int i = 1; i < threads; i++)
+        _UNION_ROWS(parent, bands + i - 1, bands[i].first - 1, bands + i, bands[i].first);
+
+    // A run points to a smaller index, so one pass in index order makes
+    // every run point to its root.
+    for (size_t run = 0; run < total; run++)
+        parent[run] = parent[parent[run]];
+
+    for (size_t i = 0; i < spans; i++)
+        _FILL_CHOOSE(bands, bmp->stack + i, chosen);
+
+    return _BAND_PASS(bands, threads, _BAND_PAINT);
+}
+
+/**
+ * @brief Band-parallel fill of the rest of an area the serial scan stopped on.
+ * The image is split into horizontal bands. Every band collects its runs of the
+ * area color and unions the ones touching vertically, the borders between the
+ * bands are then merged, and every band paints the runs in the sets touching
+ * the spans left to scan. The result is the same as the serial fill.
+ * 
+ * @param bmp     The BMP image.
+ * @param brush   The color of the area being filled.
+ * @param spans   The spans left on the stack by the serial scan.
+ * @param threads The number of bands.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE if there is an error.
+ */
+static u_int8_t _FILL_BANDS(BMP *bmp, const u_int8_t *brush, size_t spans, int threads) {
+    int height = bmp->info.height;
+    size_t mark = SCRATCH_MARK(bmp);
+
+    size_t *rows = (size_t*)SCRATCH_ALLOC(bmp, height * sizeof(size_t));
+    if (!rows) return EXIT_FAILURE;
+
+    FILL_BAND bands[FILL_THREADS];
+    memset(bands, 0, sizeof(bands));
+
+    // Every band grows the runs kept from the fills before.
+    for (int i = 0; i < threads; i++) {
+        size_t bytes;
+        SCRATCH_TAKE(bmp, i, (void**)&bands[i].runs, &bytes);
+        bands[i].size  = bytes / sizeof(RUN);
+        bands[i].bmp   = bmp;
+        bands[i].brush = brush;
+        bands[i].first = (int)((long long)height * i / threads);
+        bands[i].last  = (int)((long long)height * (i + 1) / threads);
+        bands[i].rows  = rows;
+    }
+
+    u_int8_t status = _BAND_PASS(bands, threads, _BAND_RUNS);
+    if (!status)
+        status = _FILL_LINK(bands, threads, spans);
+
+    for (int i = 0; i < threads; i++)
+        SCRATCH_KEEP(bmp, i, bands[i].runs, bands[i].size * sizeof(RUN));
+    SCRATCH_RELEASE(bmp, mark);
+    return status;
+}
+
+/* -------------------------------------BAND FILL-------------------------------------- */
+
 /**
  * @brief Fills an area of the BMP image with the brush color.
- * Fills an area of the BMP image starting from the specified pixel (y, x)
- * with the brush color. It uses a recursive algorithm to fill the connected region.
+ * Fills the 4-connected area of the BMP image holding the color of the starting
+ * pixel (y, x) with the brush color, with a serial scanline fill. With more
+ * than one thread set on the BMP, a fill painting more than 1/FILL_SERIAL of
+ * the image is finished band by band in parallel: the bands scan the whole
+ * image, which only pays off for large areas.
  *
  * @param bmp The BMP image.
  * @param y   The Y-coordinate of the starting pixel.
@@ -87,23 +511,27 @@ u_int8_t FILL(BMP *bmp, int y, int x) {
     if (!bmp || !bmp->img) 
         return EXIT_FAILURE;
 
-    u_int8_t *brush = (u_int8_t*)malloc(SIZE_COLOR);
-    if (!brush) return EXIT_FAILURE;
-
-    int pixel = (y + x * bmp->info.width) * SIZE_COLOR;
+    if (y < 0 || y >= bmp->info.width || x < 0 || x >= bmp->info.height)
+        return EXIT_FAILURE;
 
-    memcpy(brush, bmp->img + pixel, SIZE_COLOR);
+    u_int8_t brush[PIXEL_BYTES];
+    memcpy(brush, PIXEL(bmp, x, y), PIXEL_BYTES);
 
     if (brush[0] == bmp->brush_color[0] &&
         brush[1] == bmp->brush_color[1] &&
-        brush[2] == bmp->brush_color[2]) {
-        free(brush);
+        brush[2] == bmp->brush_color[2])
         return EXIT_FAILURE;
-    }
 
-    _FILL_PIXEL(bmp, brush, y, x);
+    // Every band should get a few rows to be worth a thread.
+    int threads = min(bmp->threads, bmp->info.height / FILL_ROWS);
+    size_t budget = threads > 1 ?
+        (size_t)bmp->info.width * bmp->info.height / FILL_SERIAL : SIZE_MAX;
+
+    size_t top;
+    if (_FILL_SEED(bmp, brush, y, x, &top) || _FILL_SCAN(bmp, brush, &top, budget))
+        return EXIT_FAILURE;
+    if (top)
+        return _FILL_BANDS(bmp, brush, top, min(threads, FILL_THREADS));
 
-    free(brush);
-    brush = NULL;
     return EXIT_SUCCESS;
 }
@@ -1,81 +1,378 @@
 #include "../include/bmp_image.h"
+#include "../include/lib/cmd_span.h"
+#include "../include/lib/cmd_snap.h"
+#include "../include/lib/cmd_scratch.h"
+#include "../include/lib/cmd_canvas.h"
+#include "../include/lib/cmd_insert.h"
 
 /* -----------------------------------------SAVE----------------------------------------- */
 
+// A file being saved: a temporary file renamed over the target once whole, or,
+// when that cannot be made, the target itself written in place.
+typedef struct SaveFile {
+    int                  fd;          // Output file descriptor.
+    struct stat          st;          // Status of the file replaced (st_ino 0 if new), or of the file written in place.
+    char                 *temp;       // Temporary file written, NULL if written in place.
+    char                 *target;     // File the temporary file is renamed to.
+} SAVE_FILE;
+
+struct SaveJob {
+    pthread_t            writer;      // Thread writing the file.
+    SAVE_FILE            out;         // Output file.
+    BMP                  view;        // The BMP image saved, read through its snapshot.
+    u_int8_t             status;      // Result of the write.
+};
+
+// Temporary files made by the process, numbering the next one.
+static unsigned int SAVE_SERIAL;
+
 /**
- * @brief Writes the BMP file header to the output file stream.
- * Writes the BMP file header information, including the file type marker,
- * file size, and image data offset, to the output file stream.
+ * @brief Computes the size of the BMP file of an image: headers, rows and padding.
  * 
- * @param fout The output file stream where the header will be written.
- * @param bmp  The BMP structure containing image information.
- * @return EXIT_SUCCESS if the header is successfully written, EXIT_FAILURE otherwise.
+ * @param info The information header of the image.
+ * @return The size of the file in bytes.
  */
-static u_int8_t _SAVE_HEADER(FILE *fout, BMP *bmp) {
-    // Create a BMP file header structure.
-    bmp_fileheader header;
+static inline size_t _FILE_BYTES(const bmp_infoheader *info) {
+    return SIZE_BMP + (WIDTH((size_t)info->width) + CALCULATE_PADDING(info->width)) * (size_t)info->height;
+}
 
+/**
+ * @brief Builds the BMP file header of the image.
+ * Sets the BMP file header information, including the file type marker,
+ * file size, and image data offset. The size is computed in 64 bits and clamped
+ * to SIZE_FILE_MAX, the most a 32-bit bf_size holds: readers of bigger files
+ * (EDIT and INSERT too) size the pixels from the width and height instead.
+ * 
+ * @param header The BMP file header to fill in.
+ * @param bmp    The BMP structure containing image information.
+ */
+static void _SAVE_HEADER(bmp_fileheader *header, const BMP *bmp) {
     // Set the BMP file type markers ('BM').
-    header.file_mark1 = 'B';
-    header.file_mark2 = 'M';
+    header->file_mark1 = 'B';
+    header->file_mark2 = 'M';
 
     // Unused fields are set to zero.
-    header.unused1 = 0;
-    header.unused2 = 0;
+    header->unused1 = 0;
+    header->unused2 = 0;
 
     // Calculate and set the total file size including image data.
-    header.bf_size = SIZE_BMP + bmp->info.width * bmp->info.height * SIZE_COLOR;
+    u_int64_t size = SIZE_BMP + WIDTH((u_int64_t)bmp->info.width) * (u_int64_t)bmp->info.height;
+    header->bf_size = (u_int32_t)min(size, (u_int64_t)SIZE_FILE_MAX);
     // Set the offset to the start of image data.
-    header.img_data_offset = SIZE_BMP;
+    header->img_data_offset = SIZE_BMP;
+}
 
-    // Write the BMP file header and info to the output file stream.
-    if (fwrite(&header, sizeof(header), 1, fout) != 1)
-        return EXIT_FAILURE;
-    if (fwrite(&bmp->info, sizeof(bmp->info), 1, fout) != 1)
-        return EXIT_FAILURE;
+/**
+ * @brief Writes a batch of buffers to the output file.
+ * Issues vectored writes until every buffer is fully written,
+ * resuming after short writes and interrupted calls. A write that makes no
+ * progress fails, as any error does, instead of being retried forever.
+ * 
+ * @param fd    The output file descriptor.
+ * @param iov   The buffers to write, consumed while writing.
+ * @param count The number of buffers.
+ * @return EXIT_SUCCESS if everything is written, EXIT_FAILURE otherwise.
+ */
+static u_int8_t _SAVE_WRITE(int fd, struct iovec *iov, int count) {
+    while (count) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return EXIT_FAILURE;
+        }
+        if (!written) {
+            errno = EIO;
+            return EXIT_FAILURE;
+        }
+
+        // Drop the buffers fully written, then advance in the partial one.
+        while (count && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++, count--;
+        }
+        if (count) {
+            iov->iov_base = (u_int8_t*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
 
     return EXIT_SUCCESS;
 }
 
 /**
- * @brief Writes the image data and padding to the output file stream.
- * Writes the image data and padding to the output file stream.
- * It ensures that each row of image data is followed by the appropriate amount of padding
- * to align the data on a 4-byte boundary.
+ * @brief Copies a row of the BMP image, packed, for a save.
+ * An image with a snapshot is read as it was when the snapshot was taken.
  * 
- * @param fout The output file stream where the image data will be written.
- * @param bmp  The BMP structure containing image information and data.
+ * @param bmp  The BMP image.
+ * @param row  The row.
+ * @param line The buffer receiving the packed row.
+ * @param raw  A row of pixels as held in memory, for a snapshot of a BGRX image.
+ */
+static void _SAVE_ROW(const BMP *bmp, int row, u_int8_t *line, u_int8_t *raw) {
+    if (!bmp->snap) {
+        ROW_READ(bmp, row, 0, line, bmp->info.width);
+        return;
+    }
+
+    for (int col = 0; col < bmp->info.width;) {
+        size_t run = min((size_t)(bmp->info.width - col), ROW_RUN(bmp, row, col));
+        SNAP_READ(bmp->snap, PIXEL(bmp, row, col), IMG_BGRX ? raw : line, run * PIXEL_BYTES);
+        if (IMG_BGRX)
+            PIXEL_PACK(line, raw, run);
+        line += WIDTH(run);
+        col += (int)run;
+    }
+}
+
+/**
+ * @brief Writes the headers, image data and padding to the output file.
+ * Without padding the headers and the whole image go out in one vectored write.
+ * Otherwise every row is followed by the padding that aligns it on a 4-byte
+ * boundary, and rows are written in batches of SAVE_IOV buffers per system call.
+ * A tiled or BGRX image is copied back to packed rows, SAVE_STAGE rows per batch,
+ * and so is an image read through a snapshot.
+ * 
+ * @param fd  The output file descriptor.
+ * @param bmp The BMP structure containing image information and data.
  * @return EXIT_SUCCESS if the image data is successfully written, EXIT_FAILURE otherwise.
  */
-static u_int8_t _SAVE_INFO(FILE *fout, BMP *bmp) {
+static u_int8_t _SAVE_INFO(int fd, const BMP *bmp) {
+    static u_int8_t zero[SIZE_INT]; // PADDING BYTES!
+
+    bmp_fileheader header;
+    _SAVE_HEADER(&header, bmp);
+
     // Calculate the padding needed for each row of the image.
-    int padding = CALCULATE_PADDING(bmp->info.width);
+    size_t padding = CALCULATE_PADDING(bmp->info.width);
     // Calculate the width of each row in bytes.
-    int width = WIDTH(bmp->info.width);
-    // Initialize the index for accessing the image data.
-    int idxW = 0, byte = 0; // PADDING BYTE!
+    size_t width = WIDTH((size_t)bmp->info.width);
+
+    struct iovec iov[SAVE_IOV];
+    int count = 0;
+
+    iov[count++] = (struct iovec){ &header, sizeof(header) };
+    iov[count++] = (struct iovec){ (void*)&bmp->info, sizeof(bmp->info) };
+
+    bool staging = IMG_CONVERT || bmp->snap;
+    if (!padding && !staging) {
+        iov[count++] = (struct iovec){ bmp->img, width * bmp->info.height };
+        return _SAVE_WRITE(fd, iov, count);
+    }
+
+    u_int8_t *stage = NULL, *raw = NULL;
+    if (staging && !(stage = (u_int8_t*)malloc(width * SAVE_STAGE)))
+        return EXIT_FAILURE;
+    // A snapshot of a BGRX image is read before it is packed.
+    if (IMG_BGRX && bmp->snap &&
+        !(raw = (u_int8_t*)malloc((size_t)bmp->info.width * PIXEL_BYTES))) {
+        free(stage);
+        return EXIT_FAILURE;
+    }
+
+    u_int8_t status = EXIT_SUCCESS;
+    int staged = 0;
 
     // Loop through each row of the image.
-    for (int l = 0; l < bmp->info.height; l++) {
-        int line = fwrite(bmp->img + idxW, 1, width, fout);
-        if (line != width) {
-            return EXIT_FAILURE;
+    for (int l = 0; l < bmp->info.height && !status; l++) {
+        u_int8_t *line = PIXEL(bmp, l, 0);
+        if (staging) {
+            line = stage + staged++ * width;
+            _SAVE_ROW(bmp, l, line, raw);
         }
-        idxW += width;
-        // Write the padding bytes to ensure 4-byte alignment.
-        line = fwrite(&byte, 1, padding, fout);
-        if (line < padding) {
-            return EXIT_FAILURE;
+
+        iov[count++] = (struct iovec){ line, width };
+        if (padding)
+            iov[count++] = (struct iovec){ zero, padding };
+
+        // Flush the batch once it cannot take another row.
+        if (count + 2 > SAVE_IOV || staged == SAVE_STAGE) {
+            status = _SAVE_WRITE(fd, iov, count);
+            count = staged = 0;
         }
     }
 
+    if (!status)
+        status = _SAVE_WRITE(fd, iov, count);
+    free(stage);
+    free(raw);
+    return status;
+}
+
+/**
+ * @brief Empties the output file, if it is a regular file.
+ * It is emptied here rather than when opened: dropping the pages of a big
+ * file takes a while.
+ * 
+ * @param fd The output file descriptor.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE otherwise.
+ */
+static u_int8_t _SAVE_EMPTY(int fd) {
+    struct stat st;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && ftruncate(fd, 0))
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Opens the file of a save.
+ * A regular file, or a new one, is written to a temporary file next to it
+ * (symbolic links followed), renamed over it once whole: the old contents stay
+ * whole until then, and the pixels mapped from the old file stay readable.
+ * The temporary file takes the permissions of the file it replaces. Other
+ * files, or targets whose directory cannot take a temporary file, are written
+ * in place.
+ * 
+ * @param file The name of the file to save the image to.
+ * @param out  The output file to fill in.
+ * @return EXIT_SUCCESS if the file is open, EXIT_FAILURE otherwise.
+ */
+static u_int8_t _SAVE_OPEN(const char *file, SAVE_FILE *out) {
+    memset(out, 0, sizeof(*out));
+
+    bool exists = !stat(file, &out->st);
+    if (!exists) memset(&out->st, 0, sizeof(out->st));
+
+    if (!exists || S_ISREG(out->st.st_mode)) {
+        out->target = exists ? realpath(file, NULL) : strdup(file);
+        size_t length = out->target ? strlen(out->target) + 64 : 0;
+        out->temp = length ? (char*)malloc(length) : NULL;
+
+        if (out->temp) {
+            snprintf(out->temp, length, "%s.%ld-%u.tmp", out->target, (long)getpid(),
+                     __atomic_fetch_add(&SAVE_SERIAL, 1, __ATOMIC_RELAXED));
+            out->fd = open(out->temp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+            if (out->fd >= 0) {
+                if (exists) fchmod(out->fd, out->st.st_mode & 07777);
+                return EXIT_SUCCESS;
+            }
+        }
+
+        FREE_MEMORY((void**)&out->temp);
+        FREE_MEMORY((void**)&out->target);
+    }
+
+    out->fd = open(file, O_WRONLY | O_CREAT, 0666);
+    if (out->fd < 0) return EXIT_FAILURE;
+
+    if (fstat(out->fd, &out->st)) {
+        close(out->fd);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Writes the headers and image data to the file of a save.
+ * A file written in place is emptied first.
+ * 
+ * @param out The output file.
+ * @param bmp The BMP structure containing the image data.
+ * @return EXIT_SUCCESS if the image is written, EXIT_FAILURE otherwise.
+ */
+static u_int8_t _SAVE_BODY(const SAVE_FILE *out, const BMP *bmp) {
+    if (!out->temp && _SAVE_EMPTY(out->fd))
+        return EXIT_FAILURE;
+    return _SAVE_INFO(out->fd, bmp);
+}
+
+/**
+ * @brief Closes the file of a save, then renames the temporary file over the
+ * target if the image is written, or removes it otherwise.
+ * 
+ * @param out    The output file.
+ * @param status The result of the write.
+ * @return EXIT_SUCCESS if the file is saved, EXIT_FAILURE otherwise.
+ */
+static u_int8_t _SAVE_CLOSE(SAVE_FILE *out, u_int8_t status) {
+    if (close(out->fd))
+        status = EXIT_FAILURE;
+
+    if (out->temp && (status || rename(out->temp, out->target))) {
+        unlink(out->temp);
+        status = EXIT_FAILURE;
+    }
+
+    FREE_MEMORY((void**)&out->temp);
+    FREE_MEMORY((void**)&out->target);
+    return status;
+}
+
+/**
+ * @brief Writes the headers and image data of a save in flight, then closes the file.
+ * 
+ * @param arg The save job.
+ */
+static void *_SAVE_THREAD(void *arg) {
+    SAVE_JOB *job = (SAVE_JOB*)arg;
+
+    u_int8_t status = _SAVE_BODY(&job->out, &job->view);
+    SNAP_DONE(job->view.snap);
+
+    job->status = _SAVE_CLOSE(&job->out, status);
+    return NULL;
+}
+
+/**
+ * @brief Starts writing the BMP image to an open file in the background.
+ * The pixels are not copied: a copy-on-write snapshot is taken, so the pages
+ * written before the file is done are copied then, one by one.
+ * 
+ * @param out The output file, closed by the writer.
+ * @param bmp The BMP structure containing the image data.
+ * @return EXIT_SUCCESS if the writer is started, EXIT_FAILURE otherwise.
+ */
+static u_int8_t _SAVE_START(const SAVE_FILE *out, BMP *bmp) {
+    SAVE_JOB *job = (SAVE_JOB*)calloc(1, sizeof(SAVE_JOB));
+    if (!job) return EXIT_FAILURE;
+
+    job->out = *out;
+    job->view = *bmp;
+    job->view.save = NULL;
+    job->view.snap = SNAP_TAKE(bmp);
+
+    if (!job->view.snap ||
+        pthread_create(&job->writer, NULL, _SAVE_THREAD, job)) {
+        SNAP_FREE(job->view.snap);
+        free(job);
+        return EXIT_FAILURE;
+    }
+
+    bmp->snap = job->view.snap;
+    bmp->save = job;
     return EXIT_SUCCESS;
 }
 
+/**
+ * @brief Waits for the save in flight of the BMP image, if any.
+ * A failed save is counted in save_failed.
+ * 
+ * @param bmp The BMP structure.
+ * @return EXIT_SUCCESS if there is no save in flight or it is written, EXIT_FAILURE otherwise.
+ */
+u_int8_t SAVE_WAIT(BMP *bmp) {
+    SAVE_JOB *job = bmp->save;
+    if (!job) return EXIT_SUCCESS;
+
+    pthread_join(job->writer, NULL);
+    u_int8_t status = job->status;
+
+    SNAP_FREE(bmp->snap);
+    bmp->snap = NULL;
+    bmp->save = NULL;
+    free(job);
+
+    if (status)
+        bmp->save_failed++;
+    return status;
+}
+
 /**
  * @brief Saves the BMP image to a file.
  * Saves the BMP image represented by the BMP
- * structure to a file with the specified filename.
+ * structure to a file with the specified filename. The file is opened right
+ * away (see _SAVE_OPEN), then written in the background from a snapshot, after
+ * the previous save: SAVE_WAIT waits for it. Without memory for the snapshot,
+ * it is written right away.
  * 
  * @param file The name of the file to save the image to.
  * @param bmp  The BMP structure containing the image data.
@@ -86,22 +383,83 @@ u_int8_t SAVE(char *file, BMP *bmp) {
     if (!file || !bmp || !bmp->img) 
         return EXIT_FAILURE;
 
-    FILE *fout = fopen(file, "wb");
-    if (!fout) return EXIT_FAILURE;
+    // One save in flight at a time, in the order of the script.
+    SAVE_WAIT(bmp);
 
-    // Write the BMP file header and information header.
-    if (_SAVE_HEADER(fout, bmp)) {
-        fclose(fout);
+    SAVE_FILE out;
+    if (_SAVE_OPEN(file, &out))
         return EXIT_FAILURE;
-    }
 
-    // Write the image data and padding to the output file.
-    if (_SAVE_INFO(fout, bmp)) {
-        fclose(fout);
+    // Pixels still read from a file written in place must be copied before it is emptied.
+    if (!out.temp && CANVAS_DETACH(bmp, &out.st))
+        return _SAVE_CLOSE(&out, EXIT_FAILURE);
+
+    TRACE_ADD(bmp, wrote, _FILE_BYTES(&bmp->info));
+    if (!_SAVE_START(&out, bmp))
+        return EXIT_SUCCESS;
+
+    // Write the headers, the image data and padding to the output file.
+    return _SAVE_CLOSE(&out, _SAVE_BODY(&out, bmp));
+}
+
+/**
+ * @brief Writes the BMP image to an open file descriptor, right away.
+ * The file is written from its current offset and stays open.
+ * 
+ * @param fd  The output file descriptor.
+ * @param bmp The BMP structure containing the image data.
+ * @return EXIT_SUCCESS if the image is written, EXIT_FAILURE otherwise.
+ */
+u_int8_t SAVE_FD(int fd, BMP *bmp) {
+    if (fd < 0 || !bmp || !bmp->img)
+        return EXIT_FAILURE;
+
+    // The pixels are read live, not through the snapshot of the save in flight.
+    SAVE_WAIT(bmp);
+
+    // The file may be the one the pixels are mapped from, emptied by the caller.
+    struct stat st;
+    if (!fstat(fd, &st) && CANVAS_DETACH(bmp, &st))
+        return EXIT_FAILURE;
+
+    TRACE_ADD(bmp, wrote, _FILE_BYTES(&bmp->info));
+    return _SAVE_INFO(fd, bmp);
+}
+
+/**
+ * @brief Encodes the BMP image into a new buffer, as a BMP file.
+ * 
+ * @param bmp  The BMP structure containing the image data.
+ * @param data Set to the buffer, to be freed by the caller.
+ * @param size Set to the number of bytes of the buffer.
+ * @return EXIT_SUCCESS if the image is encoded, EXIT_FAILURE otherwise.
+ */
+u_int8_t SAVE_MEMORY(BMP *bmp, u_int8_t **data, size_t *size) {
+    if (!bmp || !bmp->img || !data || !size)
         return EXIT_FAILURE;
+
+    size_t width = WIDTH((size_t)bmp->info.width);
+    size_t padding = CALCULATE_PADDING(bmp->info.width);
+    size_t bytes = _FILE_BYTES(&bmp->info);
+
+    u_int8_t *buffer = (u_int8_t*)malloc(bytes);
+    if (!buffer) return EXIT_FAILURE;
+    COUNT_ALLOC(bmp, bytes);
+    TRACE_ADD(bmp, wrote, bytes);
+
+    bmp_fileheader header;
+    _SAVE_HEADER(&header, bmp);
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), &bmp->info, sizeof(bmp->info));
+
+    u_int8_t *line = buffer + SIZE_BMP;
+    for (int l = 0; l < bmp->info.height; l++, line += width + padding) {
+        ROW_READ(bmp, l, 0, line, bmp->info.width);
+        memset(line + width, 0, padding);
     }
 
-    fclose(fout);
+    *data = buffer;
+    *size = bytes;
     return EXIT_SUCCESS;
 }
 
@@ -129,8 +487,8 @@ static u_int8_t _EDIT_HEADER(FILE *fin, BMP *bmp) {
     // Read and validate the BMP header.
     if (fread(&bmp->info, sizeof(bmp->info), 1, fin) != 1)
         return EXIT_FAILURE;
-    // Ensure that the BMP uses 24-bit color depth (SIZE_RGB).
-    if (bmp->info.bit_pix != SIZE_RGB)
+    // Ensure that the BMP uses 24-bit color depth (SIZE_RGB) and has pixels.
+    if (bmp->info.bit_pix != SIZE_RGB || bmp->info.width <= 0 || bmp->info.height <= 0)
         return EXIT_FAILURE;
 
     return EXIT_SUCCESS;
@@ -147,49 +505,153 @@ static u_int8_t _EDIT_HEADER(FILE *fin, BMP *bmp) {
  */
 static u_int8_t _EDIT_INFO(FILE *fin, BMP *bmp) {
     // Allocate memory for the image PIXEL data.
-    int rgb_size = bmp->info.width * bmp->info.height * SIZE_COLOR;
-    bmp->img = malloc(rgb_size);
-    if (!bmp->img) return EXIT_FAILURE;
+    if (CANVAS_ALLOC(bmp))
+        return EXIT_FAILURE;
 
     // Calculate the padding needed for each row of the image.
-    int padding = CALCULATE_PADDING(bmp->info.width);
+    size_t padding = CALCULATE_PADDING(bmp->info.width);
     // Calculate the width of each row in bytes.
-    int width = WIDTH(bmp->info.width);
-    // Initialize the index for accessing the image data.
-    int idxW = 0;
+    size_t width = WIDTH((size_t)bmp->info.width);
+    // Padding bytes are read, the stream may not be seekable.
+    u_int8_t pad[SIZE_INT];
+    // A tiled or BGRX image reads each row in a buffer first.
+    size_t mark = SCRATCH_MARK(bmp);
+    u_int8_t *row = IMG_CONVERT ? (u_int8_t*)SCRATCH_ALLOC(bmp, width) : NULL;
+    if (IMG_CONVERT && !row) {
+        FREE_BMP(bmp);
+        return EXIT_FAILURE;
+    }
 
     // Loop through each row of the image.
     for (int l = 0; l < bmp->info.height; l++) {
+        u_int8_t *dst = IMG_CONVERT ? row : PIXEL(bmp, l, 0);
         // Read a line of image data from the input file stream.
-        int line = fread(bmp->img + idxW, 1, width, fin);
-        // If reading the line fails, free the memory.
-        if (line != width) {
+        size_t line = fread(dst, 1, width, fin);
+        // If reading the line (or skipping the padding) fails, free the memory.
+        if (line != width || fread(pad, 1, padding, fin) != padding) {
+            SCRATCH_RELEASE(bmp, mark);
             FREE_BMP(bmp);
             return EXIT_FAILURE;
         }
-        idxW += width;
-        // Skip padding bytes.
-        fseek(fin, padding, SEEK_CUR);
+        if (IMG_CONVERT)
+            ROW_WRITE(bmp, l, 0, row, bmp->info.width);
     }
 
+    SCRATCH_RELEASE(bmp, mark);
     return EXIT_SUCCESS;
 }
 
 /**
- * @brief Edits a BMP image by reading and updating its content from an input file.
- * Reads an input BMP file, validates and stores its contents in the
- * provided BMP structure, effectively editing the image.
+ * @brief Validates the headers of a BMP file held in memory.
+ * The signature, the color depth and the size must match, and every row with
+ * its padding must be within the buffer.
  * 
- * @param file The filename of the input BMP file.
- * @param bmp  The BMP structure to store the edited image.
+ * @param data The bytes of the BMP file.
+ * @param size The number of bytes.
+ * @param info The information header, read from the buffer.
+ * @return EXIT_SUCCESS if the file is valid, EXIT_FAILURE otherwise.
  */
-u_int8_t EDIT(char *file, BMP *bmp) {
-    // Check for invalid input parameters.
-    if (!bmp || !file)
+static u_int8_t _EDIT_CHECK(const u_int8_t *data, size_t size, bmp_infoheader *info) {
+    if (size < SIZE_BMP)
+        return EXIT_FAILURE;
+
+    bmp_fileheader header;
+    memcpy(&header, data, sizeof(header));
+    memcpy(info, data + sizeof(header), sizeof(*info));
+
+    // Validate the BMP file signature, color depth and size.
+    if (header.file_mark1 != 'B' || header.file_mark2 != 'M' ||
+        info->bit_pix != SIZE_RGB || info->width <= 0 || info->height <= 0)
+        return EXIT_FAILURE;
+
+    // The image data follows the headers, each row padded to 4 bytes.
+    size_t line = WIDTH((size_t)info->width) + CALCULATE_PADDING(info->width);
+    if (size - SIZE_BMP < line * (size_t)info->height)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Copies the rows of a BMP file held in memory into new pixels.
+ * The rows are depadded in a single pass. The buffer must be validated by _EDIT_CHECK.
+ * 
+ * @param data The bytes of the BMP file.
+ * @param bmp  The BMP structure, with its information header.
+ * @return EXIT_SUCCESS if the image is copied, EXIT_FAILURE if out of memory.
+ */
+static u_int8_t _EDIT_ROWS(const u_int8_t *data, BMP *bmp) {
+    if (CANVAS_ALLOC(bmp))
         return EXIT_FAILURE;
 
-    FILE *fin = fopen(file, "rb");
-    if (!fin) return EXIT_FAILURE;
+    size_t line = WIDTH((size_t)bmp->info.width) + CALCULATE_PADDING(bmp->info.width);
+    const u_int8_t *row = data + SIZE_BMP;
+    for (int l = 0; l < bmp->info.height; l++, row += line)
+        ROW_WRITE(bmp, l, 0, row, bmp->info.width);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Maps an input BMP file and populates the BMP structure from the mapping.
+ * The whole file is mapped private (copy-on-write). When the rows carry no padding
+ * the image data is used in place: pages are read on first access and only the
+ * ones drawn on get copied. Otherwise the rows are depadded in a single pass from
+ * the mapping into a new buffer and the mapping is dropped, as for a tiled or
+ * BGRX image and for a canvas directory.
+ * 
+ * @param fd  The input file descriptor, a regular file.
+ * @param bmp The BMP structure to store the image.
+ * @return EXIT_SUCCESS if the image is successfully mapped, EXIT_FAILURE otherwise.
+ */
+static u_int8_t _EDIT_MAP(int fd, BMP *bmp) {
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < SIZE_BMP)
+        return EXIT_FAILURE;
+
+    size_t map_size = (size_t)st.st_size;
+    u_int8_t *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return EXIT_FAILURE;
+
+    if (_EDIT_CHECK(map, map_size, &bmp->info)) {
+        munmap(map, map_size);
+        return EXIT_FAILURE;
+    }
+
+    // Rows are already packed, draw straight on the file pages.
+    if (!CALCULATE_PADDING(bmp->info.width) && !IMG_CONVERT && !bmp->canvas_dir) {
+        bmp->map = map;
+        bmp->map_size = map_size;
+        bmp->map_dev = st.st_dev;
+        bmp->map_ino = st.st_ino;
+        bmp->img = map + SIZE_BMP;
+        return EXIT_SUCCESS;
+    }
+
+    madvise(map, map_size, MADV_SEQUENTIAL);
+    u_int8_t status = _EDIT_ROWS(map, bmp);
+
+    munmap(map, map_size);
+    return status;
+}
+
+/**
+ * @brief Reads an input BMP file as a stream into an empty BMP structure.
+ * The descriptor is duplicated, so it stays open; the stream may read ahead.
+ * 
+ * @param fd  The input file descriptor.
+ * @param bmp The BMP structure to store the image, without pixels.
+ * @return EXIT_SUCCESS if the image is read, EXIT_FAILURE otherwise.
+ */
+static u_int8_t _EDIT_STREAM(int fd, BMP *bmp) {
+    int copy = dup(fd);
+    if (copy < 0) return EXIT_FAILURE;
+
+    FILE *fin = fdopen(copy, "rb");
+    if (!fin) {
+        close(copy);
+        return EXIT_FAILURE;
+    }
 
     // Edit the BMP file header and information header.
     if (_EDIT_HEADER(fin, bmp)) {
@@ -207,123 +669,552 @@ u_int8_t EDIT(char *file, BMP *bmp) {
     return EXIT_SUCCESS;
 }
 
+/**
+ * @brief Replaces the image of the BMP with one read aside.
+ * The old pixels are handed back to the pool.
+ * 
+ * @param bmp  The BMP structure.
+ * @param next The BMP structure holding the new image.
+ */
+static void _EDIT_SWAP(BMP *bmp, const BMP *next) {
+    CANVAS_RELEASE(bmp);
+    bmp->info = next->info;
+    bmp->img = next->img;
+    bmp->map = next->map;
+    bmp->map_size = next->map_size;
+    bmp->map_dev = next->map_dev;
+    bmp->map_ino = next->map_ino;
+}
+
+/**
+ * @brief Edits a BMP image by reading it from an open file descriptor.
+ * Regular files are memory-mapped, anything else is read as a stream. The
+ * descriptor stays open. The new image is read aside: the current one is kept
+ * if it fails, and handed back to the pool once it succeeds.
+ * 
+ * @param fd  The input file descriptor.
+ * @param bmp The BMP structure to store the edited image.
+ * @return EXIT_SUCCESS if the image is read, EXIT_FAILURE otherwise.
+ */
+u_int8_t EDIT_FD(int fd, BMP *bmp) {
+    if (!bmp || fd < 0)
+        return EXIT_FAILURE;
+
+    // The save in flight still reads the pixels.
+    SAVE_WAIT(bmp);
+
+    BMP next;
+    memset(&next, 0, sizeof(next));
+    next.canvas_dir = bmp->canvas_dir;
+    next.trace = bmp->trace;
+    next.scratch = bmp->scratch;
+
+    struct stat st;
+    bool regular = !fstat(fd, &st) && S_ISREG(st.st_mode);
+    u_int8_t status = regular ? _EDIT_MAP(fd, &next) : _EDIT_STREAM(fd, &next);
+
+    // The scratch memory may have been created while reading.
+    bmp->scratch = next.scratch;
+    bmp->allocs += next.allocs;
+    if (status) return EXIT_FAILURE;
+
+    TRACE_ADD(bmp, read, _FILE_BYTES(&next.info));
+    _EDIT_SWAP(bmp, &next);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Edits a BMP image by copying it from a BMP file held in memory.
+ * The buffer is only read, the current image is kept if it is not valid.
+ * 
+ * @param data The bytes of the BMP file.
+ * @param size The number of bytes.
+ * @param bmp  The BMP structure to store the edited image.
+ * @return EXIT_SUCCESS if the image is read, EXIT_FAILURE otherwise.
+ */
+u_int8_t EDIT_MEMORY(const u_int8_t *data, size_t size, BMP *bmp) {
+    if (!bmp || !data)
+        return EXIT_FAILURE;
+
+    SAVE_WAIT(bmp);
+
+    BMP next;
+    memset(&next, 0, sizeof(next));
+    next.canvas_dir = bmp->canvas_dir;
+    next.trace = bmp->trace;
+
+    u_int8_t status = _EDIT_CHECK(data, size, &next.info) || _EDIT_ROWS(data, &next);
+    bmp->allocs += next.allocs;
+    if (status) return EXIT_FAILURE;
+
+    TRACE_ADD(bmp, read, _FILE_BYTES(&next.info));
+    _EDIT_SWAP(bmp, &next);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Edits a BMP image by reading and updating its content from an input file.
+ * Reads an input BMP file, validates and stores its contents in the
+ * provided BMP structure, effectively editing the image (see EDIT_FD).
+ * 
+ * @param file The filename of the input BMP file.
+ * @param bmp  The BMP structure to store the edited image.
+ * @return EXIT_SUCCESS if the image is read, EXIT_FAILURE otherwise.
+ */
+u_int8_t EDIT(char *file, BMP *bmp) {
+    // Check for invalid input parameters.
+    if (!bmp || !file)
+        return EXIT_FAILURE;
+
+    // The save in flight may be writing the file.
+    SAVE_WAIT(bmp);
+
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) return EXIT_FAILURE;
+
+    u_int8_t status = EDIT_FD(fd, bmp);
+    close(fd);
+    return status;
+}
+
 /* -----------------------------------------EDIT----------------------------------------- */
 /* ----------------------------------------INSERT----------------------------------------- */
 
+typedef struct InsertClip {
+    int                  row;         // First row of the BMP covered by the image.
+    int                  col;         // First column of the BMP covered by the image.
+    int                  src_row;     // Row of the image copied on the first row.
+    int                  src_col;     // Column of the image copied on the first column.
+    int                  rows;        // Number of rows copied.
+    int                  cols;        // Number of columns copied.
+} CLIP;
+
 /**
  * @brief Reads and validates the BMP file header and information header from a file.
  * Reads and validates both the BMP file header and information header
- * from the input file stream. It checks if the file signature and color depth are valid.
+ * from the input file. It checks if the file signature, color depth and size are valid.
  * 
- * @param fin    The input file stream.
- * @param header Pointer to a bmp_fileheader structure to store the file header.
- * @param info   Pointer to a bmp_infoheader structure to store the information header.
+ * @param fd   The input file descriptor.
+ * @param info Pointer to a bmp_infoheader structure to store the information header.
  * @return EXIT_SUCCESS if the headers are successfully read and validated, EXIT_FAILURE otherwise.
  */
-static u_int8_t _HEADER_INFO(FILE *fin, bmp_fileheader *header, bmp_infoheader *info) {
+static u_int8_t _HEADER_INFO(int fd, bmp_infoheader *info) {
+    bmp_fileheader header;
+
     // Read and validate the BMP header.
-    if (fread(header, sizeof(*header), 1, fin) != 1)
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
         return EXIT_FAILURE;
     // Validate the BMP file signature.
-    if (header->file_mark1 != 'B' || header->file_mark2 != 'M')
+    if (header.file_mark1 != 'B' || header.file_mark2 != 'M')
         return EXIT_FAILURE;
     // Read and validate the BMP info.
-    if (fread(info, sizeof(*info), 1, fin) != 1)
+    if (pread(fd, info, sizeof(*info), sizeof(header)) != sizeof(*info))
         return EXIT_FAILURE;
     // Validate the BMP information header.
-    if (info->bit_pix != SIZE_RGB)
+    if (info->bit_pix != SIZE_RGB || info->width <= 0 || info->height <= 0)
         return EXIT_FAILURE;
     return EXIT_SUCCESS;
 }
 
 /**
- * @brief Reads image data and padding from a file and stores it in a buffer.
- * Reads image data and padding from the input file stream and stores
- * it in the provided image buffer. It correctly accounts for padding bytes in each row.
+ * @brief Reads a block of bytes at an offset of a file, resuming short reads.
  * 
- * @param fin     The input file stream.
- * @param img     Pointer to the image data buffer where the data will be stored.
- * @param _width  The width of the image.
- * @param _height The height of the image.
- * @return EXIT_SUCCESS if the image data is successfully read and stored, EXIT_FAILURE otherwise.
+ * @param fd     The input file descriptor.
+ * @param buf    The buffer receiving the bytes.
+ * @param bytes  The number of bytes to read.
+ * @param offset The offset of the first byte in the file.
+ * @return EXIT_SUCCESS if every byte is read, EXIT_FAILURE otherwise.
  */
-static u_int8_t _READ_INFO(FILE *fin, char *img, int _width, int _height) {
-    // Calculate the padding needed for each row of the image.
-    int padding = CALCULATE_PADDING(_width);
-    // Calculate the width of each row in bytes.
-    int width = WIDTH(_width);
-    // Initialize the index for accessing the image data.
-    int idxW = 0;
+static u_int8_t _PREAD_ALL(int fd, u_int8_t *buf, size_t bytes, off_t offset) {
+    while (bytes) {
+        ssize_t line = pread(fd, buf, bytes, offset);
+        if (line < 0 && errno == EINTR) continue;
+        if (line <= 0) return EXIT_FAILURE;
+        buf += line, offset += line;
+        bytes -= line;
+    }
+    return EXIT_SUCCESS;
+}
 
-    // Loop through each row of the image.
-    for (int l = 0; l < _height; l++) {
-        // Read a line of image data from the input file stream.
-        int line = fread(img + idxW, 1, width, fin);
-        // If reading the line fails, free the memory.
-        if (line != width) {
+/**
+ * @brief Reads a clipped block of image data from a file straight into a buffer.
+ * Only the requested columns of the requested rows are read, skipping the padding,
+ * with one read per row, or a single read when the rows are contiguous both in
+ * the file and in the buffer.
+ * 
+ * @param fd     The input file descriptor.
+ * @param info   The information header of the image file.
+ * @param clip   The block to read, source coordinates.
+ * @param dst    The buffer receiving the first pixel of the block.
+ * @param stride The size in bytes of a row of the buffer.
+ * @return EXIT_SUCCESS if the image data is successfully read, EXIT_FAILURE otherwise.
+ */
+static u_int8_t _READ_INFO(int fd, const bmp_infoheader *info, const CLIP *clip,
+                           u_int8_t *dst, size_t stride) {
+    // Calculate the size in bytes of a row of the file, padding included.
+    size_t line = WIDTH((size_t)info->width) + CALCULATE_PADDING(info->width);
+    size_t width = WIDTH((size_t)clip->cols);
+    size_t rows = clip->rows;
+    off_t offset = SIZE_BMP + clip->src_row * line + WIDTH((size_t)clip->src_col);
+
+    if (width == line && width == stride) {
+        width *= rows;
+        rows = 1;
+    }
+
+    for (size_t l = 0; l < rows; l++) {
+        if (_PREAD_ALL(fd, dst + l * stride, width, offset + l * line))
             return EXIT_FAILURE;
-        }
-        idxW += width;
-        // Skip padding bytes.
-        fseek(fin, padding, SEEK_CUR);
     }
 
     return EXIT_SUCCESS;
 }
 
 /**
- * @brief Copies image data from one buffer to another with specified offsets and dimensions.
- * Copies image data from one buffer to another, considering specified offsets
- * and dimensions. It is used to insert one image into another at a given position.
+ * @brief Reads the overlapping block of an image file into the BMP image.
+ * Rows land straight in a row-major BGR image, a tiled or BGRX one takes them
+ * one at a time through a row buffer, as does an image with a save in flight.
  * 
- * @param bmp     The target BMP structure where the image data will be copied.
- * @param img     The source image data buffer to be copied, RGB pixels info.
- * @param y       The vertical position (row) where the insertion will start.
- * @param x       The horizontal position (column) where the insertion will start.
- * @param _width  The width of the source image to be copied.
- * @param _height The height of the source image to be copied.
- * @return EXIT_SUCCESS if the image data is successfully copied, EXIT_FAILURE otherwise.
+ * @param fd   The input file descriptor.
+ * @param info The information header of the image file.
+ * @param bmp  The target BMP structure.
+ * @param clip The overlapping block.
+ * @return EXIT_SUCCESS if the image data is successfully read, EXIT_FAILURE otherwise.
  */
-static u_int8_t _COPY_INFO(BMP *bmp, char *img, int y, int x, int _width, int _height) {
-    int height = bmp->info.height;
-    int width  = bmp->info.width;
+static u_int8_t _STREAM_INFO(int fd, const bmp_infoheader *info, BMP *bmp, const CLIP *clip) {
+    CLIP src = *clip;
+    src.row = src.col = 0;
 
-    // Calculate the source and target indices.
-    int idxH = height * y * SIZE_COLOR;
-    int idxW = width  * x * SIZE_COLOR;
+    if (!IMG_CONVERT && !bmp->snap)
+        return _READ_INFO(fd, info, &src, PIXEL(bmp, clip->row, clip->col),
+                          WIDTH((size_t)bmp->info.width));
 
-    // If both y and x are greater than 0,
-    // adjust the indices accordingly.
-    if (y > 0 && x > 0) {
-        idxW = (y + x * width) * SIZE_COLOR;
-        idxH = 0;
+    size_t mark = SCRATCH_MARK(bmp);
+    u_int8_t *row = (u_int8_t*)SCRATCH_ALLOC(bmp, WIDTH((size_t)clip->cols));
+    if (!row) return EXIT_FAILURE;
+
+    u_int8_t status = EXIT_SUCCESS;
+    src.rows = 1;
+    for (int l = 0; l < clip->rows && !status; l++, src.src_row++) {
+        status = _READ_INFO(fd, info, &src, row, WIDTH((size_t)clip->cols));
+        if (!status)
+            ROW_WRITE(bmp, clip->row + l, clip->col, row, clip->cols);
     }
 
-    // Calculate the width (W) and height (H) for copying.
-    int W = (_width  + y) > width  ? (width - y) * SIZE_COLOR : _width * SIZE_COLOR;
-    int H = (_height + x) > height ? (height - x) : _height;
+    SCRATCH_RELEASE(bmp, mark);
+    return status;
+}
+
+/**
+ * @brief Computes the part of the BMP image covered by an inserted image.
+ * The image is placed with its first pixel at (y, x) and clipped against the
+ * borders of the BMP image.
+ * 
+ * @param bmp     The target BMP structure.
+ * @param y       The vertical position (column) of the image.
+ * @param x       The horizontal position (row) of the image.
+ * @param _width  The width of the image.
+ * @param _height The height of the image.
+ * @param clip    The overlapping block, in BMP and image coordinates.
+ * @return true if the image overlaps the BMP image, false otherwise.
+ */
+static bool _CLIP_INFO(BMP *bmp, int y, int x, int _width, int _height, CLIP *clip) {
+    long long col = max(y, 0);
+    long long row = max(x, 0);
+    long long cols = min((long long)y + _width, bmp->info.width) - col;
+    long long rows = min((long long)x + _height, bmp->info.height) - row;
+
+    if (cols <= 0 || rows <= 0)
+        return false;
+
+    clip->row = (int)row;
+    clip->col = (int)col;
+    clip->src_row = (int)(row - x);
+    clip->src_col = (int)(col - y);
+    clip->rows = (int)rows;
+    clip->cols = (int)cols;
+    return true;
+}
+
+/**
+ * @brief Copies the overlapping block of a decoded image into the BMP image.
+ * 
+ * @param bmp    The target BMP structure where the image data will be copied.
+ * @param img    The source image data buffer to be copied, RGB pixels info.
+ * @param _width The width of the source image.
+ * @param clip   The overlapping block.
+ */
+static void _COPY_INFO(BMP *bmp, const u_int8_t *img, int _width, const CLIP *clip) {
+    const u_int8_t *src = img + WIDTH((size_t)clip->src_row * _width + clip->src_col);
+
+    for (int l = 0; l < clip->rows; l++, src += WIDTH((size_t)_width))
+        ROW_WRITE(bmp, clip->row + l, clip->col, src, clip->cols);
+}
 
-    for (int l = 0; l < H; l++) {
-        memcpy(bmp->img + idxW, img + idxH, W);
-        idxH += W, idxW += W;
+typedef struct CachedImage {
+    char                 *file;       // Path of the image file.
+    struct timespec      mtime;       // Modification time of the file when decoded.
+    off_t                size;        // Size of the file when decoded.
+    bmp_infoheader       info;        // Information header of the image.
+    u_int8_t             *img;        // Depadded pixels of the image.
+    size_t               bytes;       // Size of the pixels.
+    int                  refs;        // Number of INSERT using the image.
+    bool                 cached;      // Whether the image is held by the cache.
+    struct CachedImage   *prev;       // More recently used image.
+    struct CachedImage   *next;       // Less recently used image.
+} CACHE_IMG;
+
+// Process-wide LRU cache of decoded INSERT images.
+static struct {
+    pthread_mutex_t      lock;
+    CACHE_IMG            *head;       // Most recently used image.
+    CACHE_IMG            *tail;       // Least recently used image.
+    size_t               bytes;       // Pixels held by the cache.
+    size_t               budget;      // Most pixels the cache may hold.
+    size_t               hits;
+    size_t               misses;
+    size_t               evictions;
+    size_t               streamed;    // Inserts read straight from the file.
+} CACHE = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, CACHE_BUDGET, 0, 0, 0, 0 };
+
+/**
+ * @brief Frees a decoded image.
+ */
+static void _CACHE_FREE(CACHE_IMG *image) {
+    free(image->file);
+    free(image->img);
+    free(image);
+}
 
-        // Adjust indices for the next row if necessary.
-        if ((y + _width) >= width) {
-            idxW += (y * SIZE_COLOR);
-            idxH += (_width - width + y) * SIZE_COLOR;
-        } else {
-            idxW += SIZE_COLOR * (width - _width);
+/**
+ * @brief Removes an image from the cache, it is freed once no INSERT uses it.
+ * The cache lock must be held.
+ */
+static void _CACHE_DROP(CACHE_IMG *image) {
+    if (image->prev) image->prev->next = image->next;
+    else CACHE.head = image->next;
+    if (image->next) image->next->prev = image->prev;
+    else CACHE.tail = image->prev;
+
+    image->prev = image->next = NULL;
+    image->cached = false;
+    CACHE.bytes -= image->bytes;
+
+    if (!image->refs)
+        _CACHE_FREE(image);
+}
+
+/**
+ * @brief Evicts the least recently used images until the cache fits its budget.
+ * Images still used by an INSERT are skipped. The cache lock must be held.
+ */
+static void _CACHE_EVICT(void) {
+    CACHE_IMG *image = CACHE.tail;
+
+    while (image && CACHE.bytes > CACHE.budget) {
+        CACHE_IMG *prev = image->prev;
+        if (!image->refs) {
+            _CACHE_DROP(image);
+            CACHE.evictions++;
         }
+        image = prev;
     }
+}
 
-    return EXIT_SUCCESS;
+/**
+ * @brief Gets the cached image of a file, whatever its status.
+ * The cache lock must be held.
+ */
+static CACHE_IMG *_CACHE_LOOKUP(const char *file) {
+    CACHE_IMG *image = CACHE.head;
+    while (image && strcmp(image->file, file))
+        image = image->next;
+    return image;
+}
+
+/**
+ * @brief Checks if a cached image was decoded from the file as it is now:
+ * same size and modification time.
+ */
+static bool _CACHE_FRESH(const CACHE_IMG *image, const struct stat *st) {
+    return image->size == st->st_size &&
+           image->mtime.tv_sec == st->st_mtim.tv_sec &&
+           image->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * @brief Takes a reference on a cached image and moves it to the front of the
+ * LRU list. The cache lock must be held.
+ */
+static void _CACHE_TAKE(CACHE_IMG *image) {
+    image->refs++;
+
+    if (image->prev) {
+        image->prev->next = image->next;
+        if (image->next) image->next->prev = image->prev;
+        else CACHE.tail = image->prev;
+        image->prev = NULL;
+        image->next = CACHE.head;
+        CACHE.head->prev = image;
+        CACHE.head = image;
+    }
+}
+
+/**
+ * @brief Looks a file up in the decoded image cache.
+ * A cached image is used only if the file still has the size and modification
+ * time it was decoded with, otherwise it is dropped. A found image must be
+ * handed back with _CACHE_RELEASE.
+ * 
+ * @param file The filename of the image file.
+ * @param st   The current status of the file.
+ * @return The cached image, or NULL on a miss.
+ */
+static CACHE_IMG *_CACHE_FIND(char *file, const struct stat *st) {
+    pthread_mutex_lock(&CACHE.lock);
+
+    CACHE_IMG *image = _CACHE_LOOKUP(file);
+
+    // The file changed since it was decoded.
+    if (image && !_CACHE_FRESH(image, st)) {
+        _CACHE_DROP(image);
+        image = NULL;
+    }
+
+    if (!image) {
+        CACHE.misses++;
+        pthread_mutex_unlock(&CACHE.lock);
+        return NULL;
+    }
+
+    CACHE.hits++;
+    _CACHE_TAKE(image);
+    pthread_mutex_unlock(&CACHE.lock);
+    return image;
+}
+
+/**
+ * @brief Decodes a whole image file and adds it to the cache.
+ * Images bigger than the whole budget are not decoded: NULL is returned with
+ * the file left to be streamed. If another thread added the same file while
+ * this one was decoding it, its image is used and this decode is dropped, so
+ * the file is held and counted in the budget once.
+ * 
+ * @param fd   The input file descriptor.
+ * @param file The filename of the image file.
+ * @param st   The status of the file.
+ * @param info The information header of the image file.
+ * @return The decoded image, to be handed back with _CACHE_RELEASE, or NULL.
+ */
+static CACHE_IMG *_CACHE_DECODE(int fd, char *file, const struct stat *st,
+                                const bmp_infoheader *info) {
+    size_t bytes = WIDTH((size_t)info->width) * info->height;
+
+    pthread_mutex_lock(&CACHE.lock);
+    bool fits = bytes <= CACHE.budget;
+    pthread_mutex_unlock(&CACHE.lock);
+    if (!fits) return NULL;
+
+    CACHE_IMG *image = (CACHE_IMG*)calloc(1, sizeof(CACHE_IMG));
+    if (!image) return NULL;
+
+    image->info = *info;
+    image->bytes = bytes;
+    image->mtime = st->st_mtim;
+    image->size = st->st_size;
+    image->img = (u_int8_t*)malloc(bytes);
+    image->file = strdup(file);
+
+    CLIP whole = { 0, 0, 0, 0, info->height, info->width };
+    if (!image->img || !image->file ||
+        _READ_INFO(fd, info, &whole, image->img, WIDTH((size_t)info->width))) {
+        _CACHE_FREE(image);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&CACHE.lock);
+
+    CACHE_IMG *other = _CACHE_LOOKUP(file);
+    if (other && _CACHE_FRESH(other, st)) {
+        _CACHE_TAKE(other);
+        pthread_mutex_unlock(&CACHE.lock);
+        _CACHE_FREE(image);
+        return other;
+    }
+    if (other) _CACHE_DROP(other);
+
+    image->refs = 1;
+    image->cached = true;
+    image->next = CACHE.head;
+    if (CACHE.head) CACHE.head->prev = image;
+    else CACHE.tail = image;
+    CACHE.head = image;
+    CACHE.bytes += image->bytes;
+    _CACHE_EVICT();
+    pthread_mutex_unlock(&CACHE.lock);
+
+    return image;
+}
+
+/**
+ * @brief Hands back an image got from _CACHE_FIND or _CACHE_DECODE.
+ * Images out of the cache are freed once no INSERT uses them.
+ */
+static void _CACHE_RELEASE(CACHE_IMG *image) {
+    pthread_mutex_lock(&CACHE.lock);
+    if (!--image->refs) {
+        if (!image->cached)
+            _CACHE_FREE(image);
+        else
+            _CACHE_EVICT();
+    }
+    pthread_mutex_unlock(&CACHE.lock);
+}
+
+/**
+ * @brief Sets the memory budget of the decoded image cache.
+ * Shrinking the budget evicts images right away, 0 disables the cache.
+ * 
+ * @param bytes The most pixel bytes the cache may hold.
+ */
+void CACHE_SIZE(size_t bytes) {
+    pthread_mutex_lock(&CACHE.lock);
+    CACHE.budget = bytes;
+    _CACHE_EVICT();
+    pthread_mutex_unlock(&CACHE.lock);
+}
+
+/**
+ * @brief Reports the decoded image cache counters.
+ * Nothing is reported if no image was inserted.
+ * 
+ * @param fout The output file stream of the report.
+ */
+void CACHE_REPORT(FILE *fout) {
+    pthread_mutex_lock(&CACHE.lock);
+    if (CACHE.hits || CACHE.misses)
+        fprintf(fout, "CACHE: %zu hits, %zu misses, %zu streamed, %zu evictions, %zu bytes held\n",
+                CACHE.hits, CACHE.misses, CACHE.streamed, CACHE.evictions, CACHE.bytes);
+    pthread_mutex_unlock(&CACHE.lock);
+}
+
+/**
+ * @brief Frees every image held by the decoded image cache.
+ */
+void CACHE_CLEAR(void) {
+    pthread_mutex_lock(&CACHE.lock);
+    while (CACHE.head)
+        _CACHE_DROP(CACHE.head);
+    pthread_mutex_unlock(&CACHE.lock);
 }
 
 /**
  * @brief Inserts an image into a BMP structure at a specified position.
- * Inserts an image from a file into a BMP structure at a specified position.
- * It reads the image data from the file, copies it into the BMP structure, and adjusts the
- * target position accordingly.
+ * Inserts an image from a file into a BMP structure at a specified position,
+ * clipped against the borders of the BMP image. A decoded image from the
+ * process-wide cache is copied when there is one. Images too big for the cache
+ * are streamed instead: only the rows and columns overlapping the BMP image are
+ * read from the file, straight into the BMP image.
  * 
  * @param file The filename of the image file to insert.
  * @param bmp  The target BMP structure where the image will be inserted.
@@ -335,43 +1226,74 @@ u_int8_t INSERT(char *file, BMP *bmp, int y, int x) {
     if (!file || !bmp || !bmp->img) 
         return EXIT_FAILURE;
 
-    FILE *fin = fopen(file, "rb");
-    if (!fin) return EXIT_FAILURE;
+    int fd = open(file, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st)) {
+        close(fd);
+        return EXIT_FAILURE;
+    }
 
-    bmp_fileheader header;
-    bmp_infoheader info;
+    // The file is still being saved: it is missing, or is the file the save
+    // replaces or writes in place. Wait for it to be whole, then read it again.
+    const SAVE_JOB *job = bmp->save;
+    if (job && (fd < 0 ? errno == ENOENT :
+                job->out.st.st_ino && job->out.st.st_dev == st.st_dev && job->out.st.st_ino == st.st_ino)) {
+        if (fd >= 0) close(fd);
+        if (SAVE_WAIT(bmp)) return EXIT_FAILURE;
 
-    // Read and validate the BMP header and information header.
-    if (_HEADER_INFO(fin, &header, &info)) {
-        fclose(fin);
-        return EXIT_FAILURE;
+        fd = open(file, O_RDONLY);
+        if (fd >= 0 && fstat(fd, &st)) {
+            close(fd);
+            return EXIT_FAILURE;
+        }
     }
+    if (fd < 0) return EXIT_FAILURE;
 
-    int rgb_size = info.width * info.height * SIZE_COLOR;
-    char *img = (char*)malloc(rgb_size);
+    CLIP clip;
+    CACHE_IMG *image = _CACHE_FIND(file, &st);
 
-    if (!img) {
-        fclose(fin);
-        return EXIT_FAILURE;
+    if (image) {
+        close(fd);
+        if (_CLIP_INFO(bmp, y, x, image->info.width, image->info.height, &clip))
+            _COPY_INFO(bmp, image->img, image->info.width, &clip);
+        _CACHE_RELEASE(image);
+        return EXIT_SUCCESS;
     }
 
-    // Read image data from the file.
-    if (_READ_INFO(fin, img, info.width, info.height)) {
-        free(img);
-        fclose(fin);
+    bmp_infoheader info;
+
+    // Read and validate the headers, and make sure every row is in the file.
+    if (_HEADER_INFO(fd, &info) || (size_t)st.st_size < SIZE_BMP +
+        (WIDTH((size_t)info.width) + CALCULATE_PADDING(info.width)) * info.height) {
+        close(fd);
         return EXIT_FAILURE;
     }
 
-    // Copy the image data into the BMP structure at the specified position.
-    if (_COPY_INFO(bmp, img, y, x, info.width, info.height)) {
-        free(img);
-        fclose(fin);
-        return EXIT_FAILURE;
+    image = _CACHE_DECODE(fd, file, &st, &info);
+
+    if (image) {
+        close(fd);
+        TRACE_ADD(bmp, read, _FILE_BYTES(&info));
+        COUNT_ALLOC(bmp, image->bytes);
+        if (_CLIP_INFO(bmp, y, x, info.width, info.height, &clip))
+            _COPY_INFO(bmp, image->img, info.width, &clip);
+        _CACHE_RELEASE(image);
+        return EXIT_SUCCESS;
     }
 
-    free(img);
-    fclose(fin);
-    return EXIT_SUCCESS;
+    // Too big to be cached: read only the overlapping block.
+    u_int8_t status = EXIT_SUCCESS;
+    if (_CLIP_INFO(bmp, y, x, info.width, info.height, &clip)) {
+        TRACE_ADD(bmp, read, WIDTH((size_t)clip.cols) * (size_t)clip.rows);
+        status = _STREAM_INFO(fd, &info, bmp, &clip);
+    }
+
+    pthread_mutex_lock(&CACHE.lock);
+    CACHE.streamed++;
+    pthread_mutex_unlock(&CACHE.lock);
+
+    close(fd);
+    return status;
 }
 
 /* ----------------------------------------INSERT----------------------------------------- */
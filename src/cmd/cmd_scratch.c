@@ -0,0 +1,173 @@
+#include "../include/lib/cmd_scratch.h"
+
+// Scratch memory taken from the heap while the arena was full.
+typedef struct ScratchBlock {
+    struct ScratchBlock  *next;
+} SCRATCH_BLOCK;
+
+struct Scratch {
+    u_int8_t             *data;       // Arena reused by every command.
+    size_t               size;        // Bytes of the arena.
+    size_t               used;        // Bytes of the arena in use.
+    size_t               spilled;     // Bytes in use in the blocks.
+    size_t               peak;        // Most bytes in use at once, blocks included.
+    SCRATCH_BLOCK        *blocks;     // Taken while the arena was full, until it grows.
+    void                 *bands[FILL_THREADS]; // Buffers kept for the bands.
+    size_t               band_bytes[FILL_THREADS];
+};
+
+/**
+ * @brief Gets the scratch memory of the BMP image, created on first use.
+ * 
+ * @param bmp The BMP image.
+ * @return The scratch memory, or NULL if out of memory.
+ */
+static SCRATCH *_SCRATCH_GET(BMP *bmp) {
+    if (!bmp->scratch) {
+        bmp->scratch = (SCRATCH*)calloc(1, sizeof(SCRATCH));
+        if (bmp->scratch) COUNT_ALLOC(bmp, sizeof(SCRATCH));
+    }
+    return bmp->scratch;
+}
+
+/**
+ * @brief Takes scratch memory of the BMP image.
+ * The memory is bumped off an arena kept by the BMP, so once the arena fits
+ * the largest command no command allocates. When the arena is full the bytes
+ * come from a block of the heap, and the arena grows to the most bytes used at
+ * once when all the scratch memory is released. Only the thread running the
+ * commands takes scratch memory; bands get theirs before they start.
+ * 
+ * @param bmp   The BMP image.
+ * @param bytes The number of bytes.
+ * @return The memory, aligned on SCRATCH_ALIGN bytes, or NULL if out of memory.
+ */
+void *SCRATCH_ALLOC(BMP *bmp, size_t bytes) {
+    SCRATCH *scratch = _SCRATCH_GET(bmp);
+    if (!scratch) return NULL;
+
+    bytes = (max(bytes, 1) + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+    scratch->peak = max(scratch->peak, scratch->used + scratch->spilled + bytes);
+
+    if (scratch->size - scratch->used >= bytes) {
+        u_int8_t *ptr = scratch->data + scratch->used;
+        scratch->used += bytes;
+        return ptr;
+    }
+
+    // The block header takes a whole alignment unit, the bytes follow it.
+    SCRATCH_BLOCK *block = (SCRATCH_BLOCK*)aligned_alloc(SCRATCH_ALIGN, SCRATCH_ALIGN + bytes);
+    if (!block) return NULL;
+    COUNT_ALLOC(bmp, SCRATCH_ALIGN + bytes);
+
+    block->next = scratch->blocks;
+    scratch->blocks = block;
+    scratch->spilled += bytes;
+    return (u_int8_t*)block + SCRATCH_ALIGN;
+}
+
+/**
+ * @brief Marks the scratch memory in use.
+ * 
+ * @param bmp The BMP image.
+ * @return The mark, to give to SCRATCH_RELEASE.
+ */
+size_t SCRATCH_MARK(const BMP *bmp) {
+    return bmp->scratch ? bmp->scratch->used : 0;
+}
+
+/**
+ * @brief Releases the scratch memory taken since a mark.
+ * Blocks are freed once all the scratch memory is released, the arena then
+ * grows to hold them next time.
+ * 
+ * @param bmp  The BMP image.
+ * @param mark The mark taken by SCRATCH_MARK.
+ */
+void SCRATCH_RELEASE(BMP *bmp, size_t mark) {
+    SCRATCH *scratch = bmp->scratch;
+    if (!scratch) return;
+
+    scratch->used = mark;
+    if (mark || !scratch->blocks)
+        return;
+
+    while (scratch->blocks) {
+        SCRATCH_BLOCK *block = scratch->blocks;
+        scratch->blocks = block->next;
+        free(block);
+    }
+    scratch->spilled = 0;
+
+    // The peak is a multiple of SCRATCH_ALIGN, as aligned_alloc wants.
+    u_int8_t *data = (u_int8_t*)aligned_alloc(SCRATCH_ALIGN, scratch->peak);
+    if (!data) return;
+    COUNT_ALLOC(bmp, scratch->peak);
+
+    free(scratch->data);
+    scratch->data = data;
+    scratch->size = scratch->peak;
+}
+
+/**
+ * @brief Takes the buffer kept for a band.
+ * A band owns it until it is kept again, and may grow it with realloc: the
+ * buffers of the bands only reach the heap when a band needs more than ever.
+ * 
+ * @param bmp    The BMP image.
+ * @param band   The index of the band, below FILL_THREADS.
+ * @param buffer Set to the buffer, NULL if there is none yet.
+ * @param bytes  Set to the size of the buffer.
+ */
+void SCRATCH_TAKE(BMP *bmp, int band, void **buffer, size_t *bytes) {
+    SCRATCH *scratch = _SCRATCH_GET(bmp);
+
+    *buffer = NULL;
+    *bytes = 0;
+    if (!scratch) return;
+
+    *buffer = scratch->bands[band];
+    *bytes = scratch->band_bytes[band];
+    scratch->bands[band] = NULL;
+    scratch->band_bytes[band] = 0;
+}
+
+/**
+ * @brief Keeps the buffer of a band for the next commands.
+ * 
+ * @param bmp    The BMP image.
+ * @param band   The index of the band, below FILL_THREADS.
+ * @param buffer The buffer taken by SCRATCH_TAKE, maybe grown.
+ * @param bytes  The size of the buffer.
+ */
+void SCRATCH_KEEP(BMP *bmp, int band, void *buffer, size_t bytes) {
+    SCRATCH *scratch = bmp->scratch;
+    if (!scratch) {
+        free(buffer);
+        return;
+    }
+
+    free(scratch->bands[band]);
+    scratch->bands[band] = buffer;
+    scratch->band_bytes[band] = buffer ? bytes : 0;
+}
+
+/**
+ * @brief Frees the scratch memory of the BMP image and the buffers of its bands.
+ * 
+ * @param bmp The BMP image.
+ */
+void SCRATCH_FREE(BMP *bmp) {
+    SCRATCH *scratch = bmp->scratch;
+    if (!scratch) return;
+
+    while (scratch->blocks) {
+        SCRATCH_BLOCK *block = scratch->blocks;
+        scratch->blocks = block->next;
+        free(block);
+    }
+    for (int i = 0; i < FILL_THREADS; i++)
+        free(scratch->bands[i]);
+    free(scratch->data);
+    FREE_MEMORY((void**)&bmp->scratch);
+}
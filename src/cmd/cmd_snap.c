@@ -0,0 +1,147 @@
+#include "../include/lib/cmd_snap.h"
+
+struct Snapshot {
+    pthread_mutex_t      lock;
+    pthread_cond_t       read;        // Signaled once the snapshot is read.
+    const u_int8_t       *base;       // First byte of the first page.
+    const u_int8_t       *first;      // First byte of the image.
+    const u_int8_t       *end;        // Byte after the image.
+    size_t               pages;       // Number of pages of the image.
+    u_int8_t             **copies;    // Copy of every page written since the snapshot, or NULL.
+    bool                 done;        // Whether the snapshot is read.
+};
+
+/**
+ * @brief Takes a copy-on-write snapshot of the pixels of the BMP image.
+ * Nothing is copied yet: the pixels are split in SNAP_PAGE-byte pages, and a
+ * page is copied only when something is about to write on it (SNAP_TOUCH)
+ * before the snapshot is read.
+ * 
+ * @param bmp The BMP image.
+ * @return The snapshot, or NULL if out of memory.
+ */
+SNAP *SNAP_TAKE(const BMP *bmp) {
+    SNAP *snap = (SNAP*)calloc(1, sizeof(SNAP));
+    if (!snap) return NULL;
+
+    snap->first = bmp->img;
+    snap->end = bmp->img + IMG_BYTES(bmp->info.width, bmp->info.height);
+    snap->base = (const u_int8_t*)((uintptr_t)bmp->img & ~(uintptr_t)(SNAP_PAGE - 1));
+    snap->pages = ((size_t)(snap->end - snap->base) + SNAP_PAGE - 1) / SNAP_PAGE;
+    snap->copies = (u_int8_t**)calloc(snap->pages, sizeof(u_int8_t*));
+
+    if (!snap->copies) {
+        free(snap);
+        return NULL;
+    }
+
+    pthread_mutex_init(&snap->lock, NULL);
+    pthread_cond_init(&snap->read, NULL);
+    return snap;
+}
+
+/**
+ * @brief Copies a page of the image before it is written.
+ * Only the bytes of the page inside the image are copied. Out of memory, the
+ * writer waits for the snapshot to be read instead.
+ * 
+ * @param snap The snapshot.
+ * @param page The index of the page.
+ */
+static void _SNAP_COPY(SNAP *snap, size_t page) {
+    pthread_mutex_lock(&snap->lock);
+
+    while (!snap->copies[page] && !snap->done) {
+        u_int8_t *copy = (u_int8_t*)malloc(SNAP_PAGE);
+        if (!copy) {
+            pthread_cond_wait(&snap->read, &snap->lock);
+            continue;
+        }
+
+        const u_int8_t *start = snap->base + page * SNAP_PAGE;
+        const u_int8_t *from = max(start, snap->first);
+        const u_int8_t *to = min(start + SNAP_PAGE, snap->end);
+        memcpy(copy + (from - start), from, (size_t)(to - from));
+        __atomic_store_n(&snap->copies[page], copy, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&snap->lock);
+}
+
+/**
+ * @brief Copies the pages about to be written while the snapshot is read.
+ * Called by every writer of the pixels before it writes them. Pages already
+ * copied are skipped without taking the lock.
+ * 
+ * @param snap  The snapshot.
+ * @param dst   The first byte about to be written.
+ * @param bytes The number of bytes about to be written.
+ */
+void SNAP_TOUCH(SNAP *snap, const u_int8_t *dst, size_t bytes) {
+    if (!bytes || __atomic_load_n(&snap->done, __ATOMIC_ACQUIRE))
+        return;
+
+    size_t first = (size_t)(dst - snap->base) / SNAP_PAGE;
+    size_t last = (size_t)(dst + bytes - 1 - snap->base) / SNAP_PAGE;
+
+    for (size_t page = first; page <= last; page++) {
+        if (!__atomic_load_n(&snap->copies[page], __ATOMIC_ACQUIRE))
+            _SNAP_COPY(snap, page);
+    }
+}
+
+/**
+ * @brief Copies bytes of the BMP image as they were when the snapshot was taken.
+ * Pages written since then come from their copy, the others from the image:
+ * the lock keeps them from being copied and written meanwhile.
+ * 
+ * @param snap  The snapshot.
+ * @param src   The first byte, in the image.
+ * @param dst   The buffer receiving the bytes.
+ * @param bytes The number of bytes.
+ */
+void SNAP_READ(SNAP *snap, const u_int8_t *src, u_int8_t *dst, size_t bytes) {
+    pthread_mutex_lock(&snap->lock);
+
+    while (bytes) {
+        size_t page = (size_t)(src - snap->base) / SNAP_PAGE;
+        const u_int8_t *start = snap->base + page * SNAP_PAGE;
+        size_t chunk = min(bytes, (size_t)(start + SNAP_PAGE - src));
+
+        memcpy(dst, snap->copies[page] ? snap->copies[page] + (src - start) : src, chunk);
+        src += chunk, dst += chunk;
+        bytes -= chunk;
+    }
+
+    pthread_mutex_unlock(&snap->lock);
+}
+
+/**
+ * @brief Marks the snapshot as read: the pages written from now on are not copied.
+ * 
+ * @param snap The snapshot.
+ */
+void SNAP_DONE(SNAP *snap) {
+    pthread_mutex_lock(&snap->lock);
+    __atomic_store_n(&snap->done, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&snap->read);
+    pthread_mutex_unlock(&snap->lock);
+}
+
+/**
+ * @brief Frees a snapshot and its page copies.
+ * Nothing may write on the image through the snapshot anymore.
+ * 
+ * @param snap The snapshot.
+ */
+void SNAP_FREE(SNAP *snap) {
+    if (!snap) return;
+
+    for (size_t page = 0; page < snap->pages; page++)
+        free(snap->copies[page]);
+    free(snap->copies);
+
+    pthread_mutex_destroy(&snap->lock);
+    pthread_cond_destroy(&snap->read);
+    free(snap);
+}
@@ -0,0 +1,462 @@
+#include "../include/lib/cmd_span.h"
+#include "../include/lib/cmd_snap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPAN_X86
+#endif
+
+#ifndef BMP_BGRX
+
+/**
+ * @brief Packs 4 pixels of a BGR color into 3 words.
+ * 4 pixels are 12 bytes, so the words w[0], w[1], w[2] repeated in this order
+ * form the color pattern of any length multiple of 12 bytes.
+ * 
+ * @param w     The 3 pattern words.
+ * @param color The BGR color.
+ */
+static inline void _SPAN_WORDS(u_int32_t *w, const u_int8_t *color) {
+    u_int8_t bytes[4 * SIZE_COLOR];
+    for (int i = 0; i < 4 * SIZE_COLOR; i++)
+        bytes[i] = color[i % SIZE_COLOR];
+    memcpy(w, bytes, sizeof(bytes));
+}
+
+/**
+ * @brief Portable span kernel.
+ * Short spans are written pixel by pixel, longer ones by blocks of a
+ * SPAN_PERIOD-byte pattern, which holds a whole number of pixels.
+ */
+static void _SPAN_SCALAR(u_int8_t *dst, const u_int8_t *color, size_t count) {
+    if (count < SPAN_SMALL) {
+        for (size_t i = 0; i < count; i++, dst += SIZE_COLOR)
+            memcpy(dst, color, SIZE_COLOR);
+        return;
+    }
+
+    u_int32_t w[3], pattern[SPAN_PERIOD / SIZE_INT];
+    _SPAN_WORDS(w, color);
+    for (int i = 0; i < SPAN_PERIOD / SIZE_INT; i++)
+        pattern[i] = w[i % 3];
+
+    size_t bytes = count * SIZE_COLOR;
+    for (; bytes >= SPAN_PERIOD; bytes -= SPAN_PERIOD, dst += SPAN_PERIOD)
+        memcpy(dst, pattern, SPAN_PERIOD);
+    memcpy(dst, pattern, bytes);
+}
+
+#ifdef SPAN_X86
+
+/**
+ * @brief SSE2 span kernel.
+ * 16 pixels are 48 bytes, three 16-byte registers: the pattern is built once
+ * in three registers from the pattern words, then stored over and over.
+ */
+__attribute__((target("sse2")))
+static void _SPAN_SSE2(u_int8_t *dst, const u_int8_t *color, size_t count) {
+    if (count < SPAN_SMALL) {
+        _SPAN_SCALAR(dst, color, count);
+        return;
+    }
+
+    u_int32_t w[3];
+    _SPAN_WORDS(w, color);
+
+    __m128i p[3];
+    p[0] = _mm_setr_epi32(w[0], w[1], w[2], w[0]);
+    p[1] = _mm_setr_epi32(w[1], w[2], w[0], w[1]);
+    p[2] = _mm_setr_epi32(w[2], w[0], w[1], w[2]);
+
+    size_t bytes = count * SIZE_COLOR;
+    for (; bytes >= SPAN_PERIOD; bytes -= SPAN_PERIOD, dst += SPAN_PERIOD) {
+        _mm_storeu_si128((__m128i*)(dst + 0), p[0]);
+        _mm_storeu_si128((__m128i*)(dst + 16), p[1]);
+        _mm_storeu_si128((__m128i*)(dst + 32), p[2]);
+    }
+    memcpy(dst, p, bytes);
+}
+
+/**
+ * @brief AVX2 span kernel.
+ * 32 pixels are 96 bytes, three 32-byte registers, stored like the SSE2 kernel.
+ */
+__attribute__((target("avx2")))
+static void _SPAN_AVX2(u_int8_t *dst, const u_int8_t *color, size_t count) {
+    if (count < 2 * SPAN_SMALL) {
+        _SPAN_SSE2(dst, color, count);
+        return;
+    }
+
+    u_int32_t w[3];
+    _SPAN_WORDS(w, color);
+
+    __m256i p[3];
+    p[0] = _mm256_setr_epi32(w[0], w[1], w[2], w[0], w[1], w[2], w[0], w[1]);
+    p[1] = _mm256_setr_epi32(w[2], w[0], w[1], w[2], w[0], w[1], w[2], w[0]);
+    p[2] = _mm256_setr_epi32(w[1], w[2], w[0], w[1], w[2], w[0], w[1], w[2]);
+
+    size_t bytes = count * SIZE_COLOR;
+    for (; bytes >= 2 * SPAN_PERIOD; bytes -= 2 * SPAN_PERIOD, dst += 2 * SPAN_PERIOD) {
+        _mm256_storeu_si256((__m256i*)(dst + 0), p[0]);
+        _mm256_storeu_si256((__m256i*)(dst + 32), p[1]);
+        _mm256_storeu_si256((__m256i*)(dst + 64), p[2]);
+    }
+    memcpy(dst, p, bytes);
+}
+
+#endif /* SPAN_X86 */
+
+#else /* BMP_BGRX */
+
+/**
+ * @brief Portable span kernel of a BGRX image.
+ * Every pixel is one 32-bit word: B, G, R and a zero byte.
+ */
+static void _SPAN_SCALAR(u_int8_t *dst, const u_int8_t *color, size_t count) {
+    u_int8_t bytes[PIXEL_BYTES] = { color[0], color[1], color[2], 0 };
+    u_int32_t word;
+    memcpy(&word, bytes, PIXEL_BYTES);
+
+    for (size_t i = 0; i < count; i++, dst += PIXEL_BYTES)
+        memcpy(dst, &word, PIXEL_BYTES);
+}
+
+#ifdef SPAN_X86
+
+/**
+ * @brief SSE2 span kernel of a BGRX image, 4 pixels per store.
+ */
+__attribute__((target("sse2")))
+static void _SPAN_SSE2(u_int8_t *dst, const u_int8_t *color, size_t count) {
+    u_int8_t bytes[PIXEL_BYTES] = { color[0], color[1], color[2], 0 };
+    u_int32_t word;
+    memcpy(&word, bytes, PIXEL_BYTES);
+
+    __m128i p = _mm_set1_epi32((int)word);
+    for (; count >= 4; count -= 4, dst += 4 * PIXEL_BYTES)
+        _mm_storeu_si128((__m128i*)dst, p);
+    _SPAN_SCALAR(dst, color, count);
+}
+
+/**
+ * @brief AVX2 span kernel of a BGRX image, 8 pixels per store.
+ */
+__attribute__((target("avx2")))
+static void _SPAN_AVX2(u_int8_t *dst, const u_int8_t *color, size_t count) {
+    u_int8_t bytes[PIXEL_BYTES] = { color[0], color[1], color[2], 0 };
+    u_int32_t word;
+    memcpy(&word, bytes, PIXEL_BYTES);
+
+    __m256i p = _mm256_set1_epi32((int)word);
+    for (; count >= 8; count -= 8, dst += 8 * PIXEL_BYTES)
+        _mm256_storeu_si256((__m256i*)dst, p);
+    _SPAN_SSE2(dst, color, count);
+}
+
+#endif /* SPAN_X86 */
+
+// Converts count pixels between the packed BGR rows of a file and BGRX.
+typedef void (*PACK_FN)(u_int8_t *dst, const u_int8_t *src, size_t count);
+
+/**
+ * @brief Portable unpacking of BGR pixels to BGRX.
+ */
+static void _UNPACK_SCALAR(u_int8_t *dst, const u_int8_t *src, size_t count) {
+    for (size_t i = 0; i < count; i++, dst += PIXEL_BYTES, src += SIZE_COLOR) {
+        dst[0] = src[0], dst[1] = src[1], dst[2] = src[2];
+        dst[3] = 0;
+    }
+}
+
+/**
+ * @brief Portable packing of BGRX pixels to BGR.
+ */
+static void _PACK_SCALAR(u_int8_t *dst, const u_int8_t *src, size_t count) {
+    for (size_t i = 0; i < count; i++, dst += SIZE_COLOR, src += PIXEL_BYTES)
+        memcpy(dst, src, SIZE_COLOR);
+}
+
+#ifdef SPAN_X86
+
+/**
+ * @brief SSSE3 unpacking, 4 pixels per shuffle.
+ * A load reads 16 bytes for 12 used, so the loop stops 2 pixels before the end.
+ */
+__attribute__((target("ssse3")))
+static void _UNPACK_SSSE3(u_int8_t *dst, const u_int8_t *src, size_t count) {
+    const __m128i mask = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+
+    for (; count >= 6; count -= 4, src += 4 * SIZE_COLOR, dst += 4 * PIXEL_BYTES) {
+        __m128i v = _mm_loadu_si128((const __m128i*)src);
+        _mm_storeu_si128((__m128i*)dst, _mm_shuffle_epi8(v, mask));
+    }
+    _UNPACK_SCALAR(dst, src, count);
+}
+
+/**
+ * @brief SSSE3 packing, 4 pixels per shuffle.
+ * A store writes 16 bytes for 12 used, so the loop stops 2 pixels before the end.
+ */
+__attribute__((target("ssse3")))
+static void _PACK_SSSE3(u_int8_t *dst, const u_int8_t *src, size_t count) {
+    const __m128i mask = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    for (; count >= 6; count -= 4, src += 4 * PIXEL_BYTES, dst += 4 * SIZE_COLOR) {
+        __m128i v = _mm_loadu_si128((const __m128i*)src);
+        _mm_storeu_si128((__m128i*)dst, _mm_shuffle_epi8(v, mask));
+    }
+    _PACK_SCALAR(dst, src, count);
+}
+
+/**
+ * @brief AVX2 unpacking, 8 pixels per shuffle.
+ * Each lane is loaded from its own 12 bytes; the last load ends 4 bytes past
+ * the 8 pixels, so the loop stops 2 pixels before the end.
+ */
+__attribute__((target("avx2")))
+static void _UNPACK_AVX2(u_int8_t *dst, const u_int8_t *src, size_t count) {
+    const __m256i mask = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                          0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+
+    for (; count >= 10; count -= 8, src += 8 * SIZE_COLOR, dst += 8 * PIXEL_BYTES) {
+        __m128i lo = _mm_loadu_si128((const __m128i*)src);
+        __m128i hi = _mm_loadu_si128((const __m128i*)(src + 4 * SIZE_COLOR));
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        _mm256_storeu_si256((__m256i*)dst, _mm256_shuffle_epi8(v, mask));
+    }
+    _UNPACK_SSSE3(dst, src, count);
+}
+
+/**
+ * @brief AVX2 packing, 8 pixels per shuffle.
+ * Each lane is stored as 16 bytes for 12 used, so the loop stops 2 pixels
+ * before the end.
+ */
+__attribute__((target("avx2")))
+static void _PACK_AVX2(u_int8_t *dst, const u_int8_t *src, size_t count) {
+    const __m256i mask = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                          0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+    for (; count >= 10; count -= 8, src += 8 * PIXEL_BYTES, dst += 8 * SIZE_COLOR) {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)src), mask);
+        _mm_storeu_si128((__m128i*)dst, _mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i*)(dst + 4 * SIZE_COLOR), _mm256_extracti128_si256(v, 1));
+    }
+    _PACK_SSSE3(dst, src, count);
+}
+
+#endif /* SPAN_X86 */
+
+// Conversions picked for the CPU with the span kernel.
+static PACK_FN PACK_BEST = _PACK_SCALAR;
+static PACK_FN UNPACK_BEST = _UNPACK_SCALAR;
+
+#endif /* BMP_BGRX */
+
+// Kernel picked for the CPU by SPAN_INIT, the portable one until then.
+static SPAN_FN SPAN_BEST = _SPAN_SCALAR;
+static pthread_once_t SPAN_ONCE = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Picks the fastest span kernel supported by the CPU.
+ */
+static void _SPAN_SELECT(void) {
+#ifdef SPAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        SPAN_BEST = _SPAN_AVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        SPAN_BEST = _SPAN_SSE2;
+#ifdef BMP_BGRX
+    if (__builtin_cpu_supports("avx2"))
+        PACK_BEST = _PACK_AVX2, UNPACK_BEST = _UNPACK_AVX2;
+    else if (__builtin_cpu_supports("ssse3"))
+        PACK_BEST = _PACK_SSSE3, UNPACK_BEST = _UNPACK_SSSE3;
+#endif
+#endif
+}
+
+/**
+ * @brief Picks the span kernel and pixel conversions of the CPU, once.
+ * Called by Bmp_Create, so the spans of every command go straight to the
+ * kernel; the calls after the first do nothing.
+ */
+void SPAN_INIT(void) {
+    pthread_once(&SPAN_ONCE, _SPAN_SELECT);
+}
+
+/**
+ * @brief Writes count pixels of a BGR color, one after the other.
+ * Shared by every drawing primitive, 4 bytes per pixel in a BGRX image. The
+ * kernel is the one picked by SPAN_INIT: AVX2 or SSE2 when the CPU has them,
+ * the portable one otherwise.
+ * 
+ * @param dst   The first pixel to write.
+ * @param color The BGR color.
+ * @param count The number of pixels.
+ */
+void SPAN_FILL(u_int8_t *dst, const u_int8_t *color, size_t count) {
+    SPAN_BEST(dst, color, count);
+}
+
+/**
+ * @brief Gets a span kernel by name.
+ * 
+ * @param name The kernel name: "scalar", "sse2" or "avx2".
+ * @return The kernel, or NULL if it is unknown or the CPU lacks it.
+ */
+SPAN_FN SPAN_KERNEL(const char *name) {
+    if (!strcmp(name, "scalar"))
+        return _SPAN_SCALAR;
+#ifdef SPAN_X86
+    __builtin_cpu_init();
+    if (!strcmp(name, "sse2") && __builtin_cpu_supports("sse2"))
+        return _SPAN_SSE2;
+    if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2"))
+        return _SPAN_AVX2;
+#endif
+    return NULL;
+}
+
+/**
+ * @brief Packs pixels of the BMP vector of pixels to the BGR pixels of a file.
+ * A BGRX image packs them with the conversion picked by SPAN_INIT.
+ * 
+ * @param dst   The packed pixels.
+ * @param src   The pixels, as held in memory.
+ * @param count The number of pixels.
+ */
+void PIXEL_PACK(u_int8_t *dst, const u_int8_t *src, size_t count) {
+#ifdef BMP_BGRX
+    PACK_BEST(dst, src, count);
+#else
+    memcpy(dst, src, count * SIZE_COLOR);
+#endif
+}
+
+/**
+ * @brief Unpacks the BGR pixels of a file to the BMP vector of pixels.
+ * A BGRX image unpacks them with the conversion picked by SPAN_INIT.
+ * 
+ * @param dst   The pixels, as held in memory.
+ * @param src   The packed pixels.
+ * @param count The number of pixels.
+ */
+void PIXEL_UNPACK(u_int8_t *dst, const u_int8_t *src, size_t count) {
+#ifdef BMP_BGRX
+    UNPACK_BEST(dst, src, count);
+#else
+    memcpy(dst, src, count * SIZE_COLOR);
+#endif
+}
+
+/*
+ * Brush kernels, one per common brush size. Every row of a stamp is a copy of
+ * the brush line laid out by SET_COLOR, whose size is known at compile time:
+ * the line is loaded once into registers and the rows of a dot, a square of
+ * the brush size, are unrolled into a few stores each. The rows must be
+ * wholly inside the image and contiguous in its layout, with no save in flight.
+ */
+#define STAMP_KERNEL_OF(size) \
+static void _STAMP_##size(BMP *bmp, int row, int col, int rows) { \
+    u_int8_t line[(size) * PIXEL_BYTES]; \
+    memcpy(line, bmp->brush_line, sizeof(line)); \
+    TRACE_ADD(bmp, written, (size_t)(size) * rows); \
+    if (rows == (size)) { \
+        _Pragma("GCC unroll 16") \
+        for (int l = 0; l < (size); l++) \
+            memcpy(PIXEL(bmp, row + l, col), line, sizeof(line)); \
+        return; \
+    } \
+    for (int l = 0; l < rows; l++) \
+        memcpy(PIXEL(bmp, row + l, col), line, sizeof(line)); \
+}
+
+STAMP_KERNEL_OF(1)
+STAMP_KERNEL_OF(3)
+STAMP_KERNEL_OF(5)
+STAMP_KERNEL_OF(7)
+STAMP_KERNEL_OF(9)
+STAMP_KERNEL_OF(11)
+
+// Brush kernels by brush size, NULL for the sizes left to ROW_FILL.
+static const STAMP_FN STAMPS[BRUSH_KERNELS + 1] = {
+    [1] = _STAMP_1, [3] = _STAMP_3, [5] = _STAMP_5,
+    [7] = _STAMP_7, [9] = _STAMP_9, [11] = _STAMP_11
+};
+
+/**
+ * @brief Gets the brush kernel of a brush size.
+ * 
+ * @param size The brush size.
+ * @return The kernel, or NULL if the size has none.
+ */
+STAMP_FN STAMP_KERNEL(u_int8_t size) {
+    return size <= BRUSH_KERNELS ? STAMPS[size] : NULL;
+}
+
+/**
+ * @brief Writes pixels of a color on a row of the BMP image.
+ * The row is split into the runs that are contiguous in the layout of the
+ * image: one run in row-major order, one per tile when tiled. While a save
+ * is in flight, the pages of a run are copied for it first.
+ * 
+ * @param bmp   The BMP image.
+ * @param row   The row.
+ * @param col   The first column written.
+ * @param color The BGR color.
+ * @param count The number of pixels, within the row.
+ */
+void ROW_FILL(BMP *bmp, int row, int col, const u_int8_t *color, size_t count) {
+    TRACE_ADD(bmp, written, count);
+    while (count) {
+        size_t run = min(count, ROW_RUN(bmp, row, col));
+        u_int8_t *dst = PIXEL(bmp, row, col);
+        if (bmp->snap)
+            SNAP_TOUCH(bmp->snap, dst, run * PIXEL_BYTES);
+        SPAN_FILL(dst, color, run);
+        col += (int)run, count -= run;
+    }
+}
+
+/**
+ * @brief Copies packed pixels on a row of the BMP image.
+ * The pages written are copied first for a save in flight, as by ROW_FILL.
+ * 
+ * @param bmp   The BMP image.
+ * @param row   The row.
+ * @param col   The first column written.
+ * @param src   The pixels, packed.
+ * @param count The number of pixels, within the row.
+ */
+void ROW_WRITE(BMP *bmp, int row, int col, const u_int8_t *src, size_t count) {
+    TRACE_ADD(bmp, written, count);
+    while (count) {
+        size_t run = min(count, ROW_RUN(bmp, row, col));
+        u_int8_t *dst = PIXEL(bmp, row, col);
+        if (bmp->snap)
+            SNAP_TOUCH(bmp->snap, dst, run * PIXEL_BYTES);
+        PIXEL_UNPACK(dst, src, run);
+        src += run * SIZE_COLOR;
+        col += (int)run, count -= run;
+    }
+}
+
+/**
+ * @brief Copies the pixels of a row of the BMP image, packed.
+ * 
+ * @param bmp   The BMP image.
+ * @param row   The row.
+ * @param col   The first column read.
+ * @param dst   The buffer receiving the pixels.
+ * @param count The number of pixels, within the row.
+ */
+void ROW_READ(const BMP *bmp, int row, int col, u_int8_t *dst, size_t count) {
+    while (count) {
+        size_t run = min(count, ROW_RUN(bmp, row, col));
+        PIXEL_PACK(dst, PIXEL(bmp, row, col), run);
+        dst += run * SIZE_COLOR;
+        col += (int)run, count -= run;
+    }
+}
@@ -0,0 +1,330 @@
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../include/bmp_image.h"
+#include "../include/lib/cmd_trace.h"
+
+#ifdef BMP_TRACE
+
+// One command of the timeline.
+typedef struct TraceEvent {
+    const char           *name;
+    u_int64_t            start;       // Ticks since the trace was opened.
+    u_int64_t            ticks;
+    size_t               commands;    // Commands run together, more than one for a draw batch.
+    TRACE_COUNT          count;
+} TRACE_EVENT;
+
+// Totals of the commands of one name.
+typedef struct TraceTotal {
+    const char           *name;
+    size_t               calls;
+    size_t               commands;
+    u_int64_t            ticks;
+    u_int64_t            longest;
+    TRACE_COUNT          count;
+} TRACE_TOTAL;
+
+struct Trace {
+    char                 *file;       // Chrome trace written by TRACE_REPORT.
+    u_int64_t            origin;      // Ticks when the trace was opened.
+    double               opened;      // Seconds when the trace was opened, to time the ticks.
+    TRACE_COUNT          shared;      // Counts flushed by every thread.
+    TRACE_EVENT          *events;
+    size_t               count;
+    size_t               capacity;
+    size_t               dropped;     // Commands past TRACE_EVENTS, in the totals only.
+    TRACE_TOTAL          totals[TRACE_NAMES];
+    size_t               names;
+};
+
+_Thread_local TRACE_COUNT TRACE_THREAD;
+
+/**
+ * @brief Reads the monotonic clock.
+ * 
+ * @return The current time in seconds.
+ */
+static double _TRACE_SECONDS(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Reads the clock timing the commands: the time stamp counter where
+ * there is one, a few times cheaper than the monotonic clock, nanoseconds
+ * otherwise. The ticks are turned into seconds when the trace is reported.
+ * 
+ * @return The current time in ticks.
+ */
+static inline u_int64_t _TRACE_TICKS(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000000000u + (u_int64_t)ts.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Adds the counts of the calling thread to the trace and clears them.
+ * Draw and fill bands flush before their thread ends; the thread running the
+ * commands keeps its counts, read in place around every command.
+ * 
+ * @param trace The trace, NULL when not tracing.
+ */
+void TRACE_FLUSH(TRACE *trace) {
+    if (!trace) return;
+
+    TRACE_COUNT *local = &TRACE_THREAD;
+    __atomic_fetch_add(&trace->shared.written, local->written, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&trace->shared.visited, local->visited, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&trace->shared.read, local->read, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&trace->shared.wrote, local->wrote, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&trace->shared.allocs, local->allocs, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&trace->shared.alloc_bytes, local->alloc_bytes, __ATOMIC_RELAXED);
+    memset(local, 0, sizeof(*local));
+}
+
+/**
+ * @brief Reads the counts of a trace: the ones flushed by the bands and the
+ * ones of the calling thread, left in place so a command costs no atomic add.
+ */
+static void _TRACE_COUNTS(const TRACE *trace, TRACE_COUNT *count) {
+    const TRACE_COUNT *local = &TRACE_THREAD;
+    count->written = __atomic_load_n(&trace->shared.written, __ATOMIC_RELAXED) + local->written;
+    count->visited = __atomic_load_n(&trace->shared.visited, __ATOMIC_RELAXED) + local->visited;
+    count->read = __atomic_load_n(&trace->shared.read, __ATOMIC_RELAXED) + local->read;
+    count->wrote = __atomic_load_n(&trace->shared.wrote, __ATOMIC_RELAXED) + local->wrote;
+    count->allocs = __atomic_load_n(&trace->shared.allocs, __ATOMIC_RELAXED) + local->allocs;
+    count->alloc_bytes = __atomic_load_n(&trace->shared.alloc_bytes, __ATOMIC_RELAXED) + local->alloc_bytes;
+}
+
+/**
+ * @brief Adds the counts of a command to a total.
+ */
+static void _TRACE_SUM(TRACE_COUNT *total, const TRACE_COUNT *count) {
+    total->written += count->written;
+    total->visited += count->visited;
+    total->read += count->read;
+    total->wrote += count->wrote;
+    total->allocs += count->allocs;
+    total->alloc_bytes += count->alloc_bytes;
+}
+
+/**
+ * @brief Starts tracing the commands run on a BMP image.
+ * Every command run by Handle_Command, and every band-parallel draw batch, is
+ * timed and gets the pixels, bytes and allocations it used.
+ * 
+ * @param bmp  The BMP image.
+ * @param file The file receiving the Chrome trace (JSON).
+ * @return EXIT_SUCCESS if tracing started, EXIT_FAILURE otherwise.
+ */
+u_int8_t TRACE_OPEN(BMP *bmp, const char *file) {
+    if (!bmp || !file)
+        return EXIT_FAILURE;
+
+    TRACE *trace = (TRACE*)calloc(1, sizeof(TRACE));
+    if (!trace) return EXIT_FAILURE;
+
+    trace->file = strdup(file);
+    if (!trace->file) {
+        free(trace);
+        return EXIT_FAILURE;
+    }
+
+    TRACE_FREE(bmp);
+    trace->opened = _TRACE_SECONDS();
+    trace->origin = _TRACE_TICKS();
+    bmp->trace = trace;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Marks the start of a command: its clock and the counts so far.
+ * 
+ * @param trace The trace, NULL when not tracing.
+ * @param mark  The mark of the command.
+ */
+void TRACE_BEGIN(TRACE *trace, TRACE_MARK *mark) {
+    if (!trace) return;
+
+    _TRACE_COUNTS(trace, &mark->count);
+    mark->start = _TRACE_TICKS();
+}
+
+/**
+ * @brief Records a command started at a mark, in the timeline and the totals.
+ * 
+ * @param trace    The trace, NULL when not tracing.
+ * @param mark     The mark taken when the command started.
+ * @param name     The name of the command, a static string.
+ * @param commands The number of commands run.
+ */
+void TRACE_END(TRACE *trace, const TRACE_MARK *mark, const char *name, size_t commands) {
+    if (!trace) return;
+
+    u_int64_t end = _TRACE_TICKS();
+    TRACE_COUNT count;
+    _TRACE_COUNTS(trace, &count);
+    count.written -= mark->count.written;
+    count.visited -= mark->count.visited;
+    count.read -= mark->count.read;
+    count.wrote -= mark->count.wrote;
+    count.allocs -= mark->count.allocs;
+    count.alloc_bytes -= mark->count.alloc_bytes;
+
+    size_t slot = 0;
+    while (slot < trace->names && trace->totals[slot].name != name)
+        slot++;
+    if (slot == trace->names && slot < TRACE_NAMES)
+        trace->totals[trace->names++].name = name;
+    if (slot < trace->names) {
+        TRACE_TOTAL *total = trace->totals + slot;
+        total->calls++;
+        total->commands += commands;
+        total->ticks += end - mark->start;
+        total->longest = max(total->longest, end - mark->start);
+        _TRACE_SUM(&total->count, &count);
+    }
+
+    if (trace->count == trace->capacity && trace->capacity < TRACE_EVENTS) {
+        size_t capacity = trace->capacity ? min(trace->capacity * 2, TRACE_EVENTS) : 1024;
+        TRACE_EVENT *events = (TRACE_EVENT*)realloc(trace->events, capacity * sizeof(TRACE_EVENT));
+        if (events) {
+            trace->events = events;
+            trace->capacity = capacity;
+        }
+    }
+
+    if (trace->count == trace->capacity) {
+        trace->dropped++;
+        return;
+    }
+
+    TRACE_EVENT *event = trace->events + trace->count++;
+    event->name = name;
+    event->start = mark->start - trace->origin;
+    event->ticks = end - mark->start;
+    event->commands = commands;
+    event->count = count;
+}
+
+/**
+ * @brief Writes the timeline as a Chrome trace, one complete event per command.
+ * 
+ * @param trace The trace.
+ * @param tick  The seconds of a clock tick.
+ * @return EXIT_SUCCESS if the file is written, EXIT_FAILURE otherwise.
+ */
+static u_int8_t _TRACE_WRITE(const TRACE *trace, double tick) {
+    FILE *fout = fopen(trace->file, "w");
+    if (!fout) return EXIT_FAILURE;
+
+    // The timeline of a long script is large: a big buffer, and the zero counts left out.
+    setvbuf(fout, NULL, _IOFBF, 1 << 20);
+    fprintf(fout, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (size_t i = 0; i < trace->count; i++) {
+        const TRACE_EVENT *event = trace->events + i;
+        const size_t values[] = { event->count.written, event->count.visited, event->count.read,
+                                  event->count.wrote, event->count.allocs, event->count.alloc_bytes };
+        static const char *const keys[] = { "written", "visited", "read", "wrote", "allocs", "alloc_bytes" };
+
+        fprintf(fout, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"commands\":%zu",
+                i ? "," : "", event->name, event->start * tick * 1e6, event->ticks * tick * 1e6, event->commands);
+        for (size_t k = 0; k < sizeof(values) / sizeof(values[0]); k++)
+            if (values[k])
+                fprintf(fout, ",\"%s\":%zu", keys[k], values[k]);
+        fputs("}}", fout);
+    }
+    fprintf(fout, "\n],\"otherData\":{\"dropped\":%zu}}\n", trace->dropped);
+
+    return fclose(fout) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * @brief Prints the summary table of a trace and writes its Chrome trace.
+ * The table has a line per command name, the longest total time first.
+ * 
+ * @param trace The trace, NULL when not tracing.
+ * @param fout  The output file stream of the table.
+ * @return EXIT_SUCCESS if the trace is written, EXIT_FAILURE otherwise.
+ */
+u_int8_t TRACE_REPORT(TRACE *trace, FILE *fout) {
+    if (!trace) return EXIT_SUCCESS;
+
+    // Times the ticks against the monotonic clock, over the whole trace.
+    u_int64_t ticks = _TRACE_TICKS() - trace->origin;
+    double seconds = _TRACE_SECONDS() - trace->opened;
+    double tick = ticks && seconds > 0 ? seconds / ticks : 1e-9;
+
+    TRACE_TOTAL totals[TRACE_NAMES];
+    size_t names = trace->names;
+    memcpy(totals, trace->totals, names * sizeof(TRACE_TOTAL));
+
+    // Few names: insertion sort, the longest total first.
+    for (size_t i = 1; i < names; i++) {
+        TRACE_TOTAL total = totals[i];
+        size_t j = i;
+        for (; j && totals[j - 1].ticks < total.ticks; j--)
+            totals[j] = totals[j - 1];
+        totals[j] = total;
+    }
+
+    fprintf(fout, "TRACE: %-22s %8s %10s %10s %10s %12s %12s %12s %12s %8s\n", "command", "calls",
+            "total ms", "mean us", "max us", "written", "visited", "read B", "wrote B", "allocs");
+    for (size_t i = 0; i < names; i++) {
+        const TRACE_TOTAL *total = totals + i;
+        fprintf(fout, "TRACE: %-22s %8zu %10.3f %10.3f %10.3f %12zu %12zu %12zu %12zu %8zu\n",
+                total->name, total->calls, total->ticks * tick * 1e3, total->ticks * tick * 1e6 / total->calls,
+                total->longest * tick * 1e6, total->count.written, total->count.visited,
+                total->count.read, total->count.wrote, total->count.allocs);
+    }
+    if (trace->dropped)
+        fprintf(fout, "TRACE: %zu commands left out of the timeline\n", trace->dropped);
+
+    return _TRACE_WRITE(trace, tick);
+}
+
+/**
+ * @brief Stops tracing the BMP image and frees its trace.
+ * 
+ * @param bmp The BMP image.
+ */
+void TRACE_FREE(BMP *bmp) {
+    if (!bmp || !bmp->trace)
+        return;
+
+    free(bmp->trace->events);
+    free(bmp->trace->file);
+    FREE_MEMORY((void**)&bmp->trace);
+}
+
+#else
+
+// Built without tracing (TRACE=on): TRACE_OPEN fails, the rest does nothing.
+
+u_int8_t TRACE_OPEN(BMP *bmp, const char *file) {
+    return EXIT_FAILURE;
+}
+
+void TRACE_BEGIN(TRACE *trace, TRACE_MARK *mark) {
+}
+
+void TRACE_END(TRACE *trace, const TRACE_MARK *mark, const char *name, size_t commands) {
+}
+
+u_int8_t TRACE_REPORT(TRACE *trace, FILE *fout) {
+    return EXIT_SUCCESS;
+}
+
+void TRACE_FREE(BMP *bmp) {
+}
+
+#endif
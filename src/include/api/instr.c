@@ -1,137 +1,527 @@
 #include "./instr.h"
 
+// Messages of the failed commands, by command word.
+static const char *ERRORS[] = {
+    "saving map", "editing map", "setting parameters",
+    "drawing", "filling", "inserting image", "switching canvas"
+};
+
+#ifdef BMP_TRACE
+// Names of the traced commands, by operation.
+static const char *NAMES[] = {
+    "none", "invalid", "save", "edit", "set draw_color", "set line_width", "set cache",
+    "draw line", "draw rectangle", "draw triangle", "draw filled_rectangle",
+    "draw filled_triangle", "draw polygon", "fill", "insert", "canvas open",
+    "canvas use", "canvas clone", "canvas close"
+};
+#endif
+
 /**
- * @brief Handles the "save" command to save the BMP image to a file.
+ * @brief Reads a path into the text pool of the program.
+ * Paths are limited to INSTR_LENGTH - 1 bytes, as they were by the command buffer.
  * 
- * @param bmp The BMP structure containing the image data.
- * @return EXIT_SUCCESS if the image is successfully saved, EXIT_FAILURE otherwise.
+ * @param lex     The lexer reading the command arguments.
+ * @param program The program.
+ * @param offset  The offset of the path in the text pool.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE otherwise.
  */
-u_int8_t Handle_Save(BMP *bmp) {
-    if (fscanf(stdin, "%s", CMD) != 1)
+static u_int8_t _PARSE_PATH(LEXER *lex, PROGRAM *program, int *offset) {
+    const char *word = NULL;
+    size_t length = 0;
+
+    if (LEX_WORD(lex, &word, &length) || length >= INSTR_LENGTH)
         return EXIT_FAILURE;
-    return SAVE(CMD, bmp);
+    return PROGRAM_TEXT(program, word, length, offset);
+}
+
+/**
+ * @brief Reads count integers into the operands of a command.
+ * 
+ * @param lex     The lexer reading the command arguments.
+ * @param command The command.
+ * @param count   The number of operands.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE otherwise.
+ */
+static u_int8_t _PARSE_INTS(LEXER *lex, COMMAND *command, int count) {
+    for (int i = 0; i < count; i++)
+        if (LEX_INT(lex, &command->args[i]))
+            return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Turns the last command of the program into the report of its parse error.
+ * 
+ * @param program The program.
+ * @return EXIT_SUCCESS, the program still holds a command.
+ */
+static u_int8_t _PARSE_INVALID(PROGRAM *program) {
+    program->commands[program->count - 1].op = OP_INVALID;
+    return EXIT_SUCCESS;
 }
 
 /**
- * @brief Handles the "edit" command to edit the BMP image from a file.
+ * @brief Parses the "save" command to save the BMP image to a file.
  * 
- * @param bmp The BMP structure to store the edited image.
- * @return EXIT_SUCCESS if the image is successfully edited, EXIT_FAILURE otherwise.
+ * @param lex     The lexer reading the command arguments.
+ * @param program The program the command is appended to.
+ * @return EXIT_SUCCESS if a command (maybe invalid) was appended, EXIT_FAILURE if out of memory.
  */
-u_int8_t Handle_Edit(BMP *bmp) {
-    if (fscanf(stdin, "%s", CMD) != 1)
+u_int8_t Parse_Save(LEXER *lex, PROGRAM *program) {
+    COMMAND *command = PROGRAM_ADD(program, OP_SAVE, WORD_SAVE);
+    if (!command)
         return EXIT_FAILURE;
-    EDIT(CMD, bmp);
-    if (!bmp->img)
+    if (_PARSE_PATH(lex, program, &command->args[0]))
+        return _PARSE_INVALID(program);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Parses the "edit" command to edit the BMP image from a file.
+ * 
+ * @param lex     The lexer reading the command arguments.
+ * @param program The program the command is appended to.
+ * @return EXIT_SUCCESS if a command (maybe invalid) was appended, EXIT_FAILURE if out of memory.
+ */
+u_int8_t Parse_Edit(LEXER *lex, PROGRAM *program) {
+    COMMAND *command = PROGRAM_ADD(program, OP_EDIT, WORD_EDIT);
+    if (!command)
         return EXIT_FAILURE;
+    if (_PARSE_PATH(lex, program, &command->args[0]))
+        return _PARSE_INVALID(program);
     return EXIT_SUCCESS;
 }
 
 /**
- * @brief Handles the "set" command to set various properties of the BMP image.
+ * @brief Parses the "set" command to set various properties of the BMP image.
  * 
- * @param bmp The BMP structure containing the image data.
- * @return EXIT_SUCCESS if the properties are successfully set, EXIT_FAILURE otherwise.
+ * @param lex     The lexer reading the command arguments.
+ * @param program The program the command is appended to.
+ * @return EXIT_SUCCESS if a command (maybe invalid) was appended, EXIT_FAILURE if out of memory.
  */
-u_int8_t Handle_Set(BMP *bmp) {
-    int witdth = 0;
+u_int8_t Parse_Set(LEXER *lex, PROGRAM *program) {
     u_int8_t R = 0, G = 0, B = 0;
-    
-    if (fscanf(stdin, "%s", CMD) != 1)
+    const char *word = NULL;
+    size_t length = 0;
+
+    COMMAND *command = PROGRAM_ADD(program, OP_INVALID, WORD_SET);
+    if (!command)
         return EXIT_FAILURE;
+    if (LEX_WORD(lex, &word, &length))
+        return EXIT_SUCCESS;
 
-    switch (CMD[0]) {
+    switch (word[0]) {
         case 'd':
-            if (fscanf(stdin, "%hhu%hhu%hhu", &R, &G, &B) != 3)
-                return EXIT_FAILURE;
-            if (SET_COLOR(bmp, R, G, B))
-                return EXIT_FAILURE;
+            if (LEX_BYTE(lex, &R) || LEX_BYTE(lex, &G) || LEX_BYTE(lex, &B))
+                return EXIT_SUCCESS;
+            command->op = OP_SET_COLOR;
+            command->args[0] = R;
+            command->args[1] = G;
+            command->args[2] = B;
             break;
 
         case 'l':
-            if (fscanf(stdin, "%d", &witdth) != 1)
-                return EXIT_FAILURE;
-            if (SET_LINE(bmp, witdth))
-                return EXIT_FAILURE;
+            if (!_PARSE_INTS(lex, command, 1))
+                command->op = OP_SET_LINE;
+            break;
+
+        case 'c':
+            // Memory budget of the INSERT image cache, in MB.
+            if (!_PARSE_INTS(lex, command, 1) && command->args[0] >= 0)
+                command->op = OP_SET_CACHE;
             break;
 
         default:
-            return EXIT_FAILURE;
+            break;
     }
 
     return EXIT_SUCCESS;
 }
 
 /**
- * @brief Handles the "draw" command to draw shapes on the BMP image.
+ * @brief Parses the "draw" command to draw shapes on the BMP image.
  * 
- * @param bmp The BMP structure containing the image data.
- * @return EXIT_SUCCESS if the shapes are successfully drawn, EXIT_FAILURE otherwise.
+ * @param lex     The lexer reading the command arguments.
+ * @param program The program the command is appended to.
+ * @return EXIT_SUCCESS if a command (maybe invalid) was appended, EXIT_FAILURE if out of memory.
  */
-u_int8_t Handle_Draw(BMP *bmp) {
-    int y1 = 0, x1 = 0;
-    int y2 = 0, x2 = 0;
-    int y3 = 0, x3 = 0;
-    int width = 0, height = 0;
+u_int8_t Parse_Draw(LEXER *lex, PROGRAM *program) {
+    const char *word = NULL;
+    size_t length = 0;
+    u_int8_t op = OP_INVALID;
+    int count = 0;
 
-    if (fscanf(stdin, "%s", CMD) != 1)
+    COMMAND *command = PROGRAM_ADD(program, OP_INVALID, WORD_DRAW);
+    if (!command)
         return EXIT_FAILURE;
+    if (LEX_WORD(lex, &word, &length))
+        return EXIT_SUCCESS;
 
-    switch (CMD[0]) {
-        case 'l':
-            if (fscanf(stdin, "%d%d%d%d", &y1, &x1, &y2, &x2) != 4)
-                return EXIT_FAILURE;
-            if (LINE(bmp, y1, x1, y2, x2))
-                return EXIT_FAILURE;
+    switch (word[0]) {
+        case 'l': op = OP_LINE; count = 4; break;
+        case 'r': op = OP_RECTANGLE; count = 4; break;
+        case 't': op = OP_TRIANGLE; count = 6; break;
+        case 'f':
+            if (LEX_MATCH(word, length, "filled_rectangle"))
+                op = OP_FILLED_RECTANGLE, count = 4;
+            else if (LEX_MATCH(word, length, "filled_triangle"))
+                op = OP_FILLED_TRIANGLE, count = 6;
             break;
 
-        case 'r':
-            if (fscanf(stdin, "%d%d%d%d", &y1, &x1, &width, &height) != 4)
-                return EXIT_FAILURE;
-            if (RECTANGLE(bmp, y1, x1, width, height))
-                return EXIT_FAILURE;
-            break;
+        case 'p': {
+            int vertices = 0;
+            if (LEX_INT(lex, &vertices) || vertices < 3 || vertices > POLY_VERTS)
+                return EXIT_SUCCESS;
 
-        case 't':
-            if (fscanf(stdin, "%d%d%d%d%d%d", &y1, &x1, &y2, &x2, &y3, &x3) != 6)
-                return EXIT_FAILURE;
-            if (TRIANGLE(bmp, y1, x1, y2, x2, y3, x3))
+            size_t point_count = program->point_count;
+            int *points = PROGRAM_POINTS(program, (size_t)vertices, &command->args[1]);
+            if (!points)
                 return EXIT_FAILURE;
-            break;
+            for (int i = 0; i < 2 * vertices; i++) {
+                if (LEX_INT(lex, &points[i])) {
+                    program->point_count = point_count;
+                    return EXIT_SUCCESS;
+                }
+            }
+
+            command->args[0] = vertices;
+            command->op = OP_POLYGON;
+            return EXIT_SUCCESS;
+        }
 
         default:
-            return EXIT_FAILURE;
+            break;
     }
+
+    if (op != OP_INVALID && !_PARSE_INTS(lex, command, count))
+        command->op = op;
     return EXIT_SUCCESS;
 }
 
 /**
- * @brief Handles the "fill" command to fill an area of the BMP image with the current brush color.
+ * @brief Parses the "fill" command to fill an area of the BMP image with the current brush color.
  * 
- * @param bmp The BMP structure containing the image data.
- * @return EXIT_SUCCESS if the area is successfully filled, EXIT_FAILURE otherwise.
+ * @param lex     The lexer reading the command arguments.
+ * @param program The program the command is appended to.
+ * @return EXIT_SUCCESS if a command (maybe invalid) was appended, EXIT_FAILURE if out of memory.
  */
-u_int8_t Handle_Fill(BMP *bmp) {
-    int y = 0, x = 0;
-    if (fscanf(stdin, "%d%d", &y, &x) != 2)
+u_int8_t Parse_Fill(LEXER *lex, PROGRAM *program) {
+    COMMAND *command = PROGRAM_ADD(program, OP_FILL, WORD_FILL);
+    if (!command)
         return EXIT_FAILURE;
-    FILL(bmp, y, x);
+    if (_PARSE_INTS(lex, command, 2))
+        return _PARSE_INVALID(program);
     return EXIT_SUCCESS;
 }
 
 /**
- * @brief Handles the "insert" command to insert an image from a file into the BMP image.
+ * @brief Parses the "insert" command to insert an image from a file into the BMP image.
  * 
- * @param bmp The BMP structure containing the image data.
- * @return EXIT_SUCCESS if the image is successfully inserted, EXIT_FAILURE otherwise.
+ * @param lex     The lexer reading the command arguments.
+ * @param program The program the command is appended to.
+ * @return EXIT_SUCCESS if a command (maybe invalid) was appended, EXIT_FAILURE if out of memory.
  */
-u_int8_t Handle_Insert(BMP *bmp) {
-    int y = 0, x = 0;
-    if (fscanf(stdin, "%s", CMD) != 1)
-        return EXIT_FAILURE;
-    if (fscanf(stdin, "%d%d", &y, &x) != 2)
+u_int8_t Parse_Insert(LEXER *lex, PROGRAM *program) {
+    COMMAND *command = PROGRAM_ADD(program, OP_INSERT, WORD_INSERT);
+    if (!command)
         return EXIT_FAILURE;
-    if (INSERT(CMD, bmp, y, x))
+    if (_PARSE_PATH(lex, program, &command->args[0]) ||
+        LEX_INT(lex, &command->args[1]) || LEX_INT(lex, &command->args[2]))
+        return _PARSE_INVALID(program);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Parses the "canvas" command to open, switch, clone or close named canvases.
+ * Canvas names are read as paths: "canvas open <name> <file>", "canvas use <name>",
+ * "canvas clone <src> <dst>" and "canvas close <name>".
+ * 
+ * @param lex     The lexer reading the command arguments.
+ * @param program The program the command is appended to.
+ * @return EXIT_SUCCESS if a command (maybe invalid) was appended, EXIT_FAILURE if out of memory.
+ */
+u_int8_t Parse_Canvas(LEXER *lex, PROGRAM *program) {
+    const char *word = NULL;
+    size_t length = 0;
+    u_int8_t op = OP_INVALID;
+    int count = 0;
+
+    COMMAND *command = PROGRAM_ADD(program, OP_INVALID, WORD_CANVAS);
+    if (!command)
         return EXIT_FAILURE;
+    if (LEX_WORD(lex, &word, &length))
+        return EXIT_SUCCESS;
+
+    if (LEX_MATCH(word, length, "open"))
+        op = OP_CANVAS_OPEN, count = 2;
+    else if (LEX_MATCH(word, length, "use"))
+        op = OP_CANVAS_USE, count = 1;
+    else if (LEX_MATCH(word, length, "clone"))
+        op = OP_CANVAS_CLONE, count = 2;
+    else if (LEX_MATCH(word, length, "close"))
+        op = OP_CANVAS_CLOSE, count = 1;
+
+    for (int i = 0; i < count; i++)
+        if (_PARSE_PATH(lex, program, &command->args[i]))
+            return EXIT_SUCCESS;
+
+    command->op = op;
     return EXIT_SUCCESS;
 }
+
+/**
+ * @brief Runs a parsed command on the BMP image.
+ * 
+ * @param bmp     The BMP structure containing the image data.
+ * @param program The program holding the command.
+ * @param command The command.
+ * @return EXIT_SUCCESS if the command succeeded, EXIT_FAILURE otherwise.
+ */
+static u_int8_t _EXECUTE(BMP *bmp, PROGRAM *program, const COMMAND *command) {
+    const int *a = command->args;
+    char *path = program->text + a[0];
+    u_int8_t status = EXIT_SUCCESS;
+
+    switch (command->op) {
+        case OP_NONE:
+            break;
+        case OP_INVALID:
+            status = EXIT_FAILURE;
+            break;
+        case OP_SAVE:
+            status = SAVE(path, bmp);
+            break;
+        case OP_EDIT:
+            status = EDIT(path, bmp);
+            break;
+        case OP_SET_COLOR:
+            status = SET_COLOR(bmp, (u_int8_t)a[0], (u_int8_t)a[1], (u_int8_t)a[2]);
+            break;
+        case OP_SET_LINE:
+            status = SET_LINE(bmp, (u_int8_t)a[0]);
+            break;
+        case OP_SET_CACHE:
+            CACHE_SIZE((size_t)a[0] << 20);
+            break;
+        case OP_LINE:
+            status = LINE(bmp, a[0], a[1], a[2], a[3]);
+            break;
+        case OP_RECTANGLE:
+            status = RECTANGLE(bmp, a[0], a[1], a[2], a[3]);
+            break;
+        case OP_TRIANGLE:
+            status = TRIANGLE(bmp, a[0], a[1], a[2], a[3], a[4], a[5]);
+            break;
+        case OP_FILLED_RECTANGLE:
+            status = FILLED_RECTANGLE(bmp, a[0], a[1], a[2], a[3]);
+            break;
+        case OP_FILLED_TRIANGLE:
+            status = FILLED_TRIANGLE(bmp, a[0], a[1], a[2], a[3], a[4], a[5]);
+            break;
+        case OP_POLYGON: {
+            int y[POLY_VERTS], x[POLY_VERTS];
+            for (int i = 0; i < a[0]; i++) {
+                y[i] = program->points[a[1] + 2 * i];
+                x[i] = program->points[a[1] + 2 * i + 1];
+            }
+            status = POLYGON(bmp, y, x, a[0]);
+            break;
+        }
+        case OP_FILL:
+            FILL(bmp, a[0], a[1]);
+            break;
+        case OP_INSERT:
+            status = INSERT(path, bmp, a[1], a[2]);
+            break;
+        case OP_CANVAS_OPEN:
+            status = CANVAS_OPEN(bmp, path, program->text + a[1]);
+            break;
+        case OP_CANVAS_USE:
+            status = CANVAS_USE(bmp, path);
+            break;
+        case OP_CANVAS_CLONE:
+            status = CANVAS_CLONE(bmp, path, program->text + a[1]);
+            break;
+        case OP_CANVAS_CLOSE:
+            status = CANVAS_CLOSE(bmp, path);
+            break;
+        default:
+            status = EXIT_FAILURE;
+            break;
+    }
+
+    return status;
+}
+
+/**
+ * @brief Runs a parsed command on the BMP image, reporting its failure.
+ * 
+ * @param bmp     The BMP structure containing the image data.
+ * @param program The program holding the command.
+ * @param command The command.
+ * @return EXIT_SUCCESS if the command succeeded, EXIT_FAILURE otherwise.
+ */
+u_int8_t Handle_Command(BMP *bmp, PROGRAM *program, const COMMAND *command) {
+#ifdef BMP_TRACE
+    TRACE_MARK mark;
+    TRACE_BEGIN(bmp->trace, &mark);
+#endif
+    u_int8_t status = _EXECUTE(bmp, program, command);
+#ifdef BMP_TRACE
+    TRACE_END(bmp->trace, &mark, NAMES[command->op], 1);
+#endif
+    if (status) {
+        bmp->errors++;
+        fprintf(stderr, "ERROR: %s...\n", ERRORS[command->word]);
+    }
+    return status;
+}
+
+/**
+ * @brief Checks if a command can run in a batch of draws.
+ * Draws, brush settings and parse errors neither read the pixels nor change
+ * the image, the other commands end the batch.
+ * 
+ * @param command The command.
+ * @return true if the command can be batched, false otherwise.
+ */
+bool Is_Batched(const COMMAND *command) {
+    return (command->op >= OP_LINE && command->op <= OP_POLYGON) ||
+           command->op == OP_SET_COLOR || command->op == OP_SET_LINE ||
+           command->op == OP_INVALID || command->op == OP_NONE;
+}
+
+typedef struct DrawBand {
+    BMP                  view;        // The image, drawn only on the rows of the band.
+    u_int8_t             color[SIZE_BRUSH];
+    PROGRAM             *program;
+    size_t               first;       // Commands of the batch.
+    size_t               last;
+    u_int8_t             *failed;     // Draws of the batch that failed on any band, shared.
+} DRAW_BAND;
+
+/**
+ * @brief Replays a batch on the rows of one band (thread routine).
+ * The view has its own brush, so the sets of the batch replay in order too.
+ * A failed draw is flagged for all the bands, the sets report their own errors.
+ */
+static void *_BAND_DRAW(void *arg) {
+    DRAW_BAND *band = (DRAW_BAND*)arg;
+
+    for (size_t i = band->first; i < band->last; i++) {
+        const COMMAND *command = band->program->commands + i;
+        if (command->op != OP_INVALID && _EXECUTE(&band->view, band->program, command) &&
+            command->op != OP_SET_COLOR && command->op != OP_SET_LINE)
+            __atomic_store_n(band->failed + (i - band->first), 1, __ATOMIC_RELAXED);
+    }
+
+    TRACE_DONE(&band->view);
+    return NULL;
+}
+
+/**
+ * @brief Runs a batch of draws, band-parallel when the BMP has worker threads.
+ * The image is split into horizontal bands, one per thread, and every thread
+ * replays the whole batch in order on its own rows only: painter's order holds
+ * on every pixel and no pixel is written by two threads. The brush settings
+ * of the batch are then replayed on the BMP itself, and the errors of every
+ * command reported in the order of the script, as a serial run reports them.
+ * 
+ * @param bmp     The BMP structure containing the image data.
+ * @param program The program holding the batch.
+ * @param first   The first command of the batch.
+ * @param last    The command after the batch.
+ */
+static void _HANDLE_BATCH(BMP *bmp, PROGRAM *program, size_t first, size_t last) {
+    int count = bmp->img ? min(bmp->threads, bmp->info.height / FILL_ROWS) : 0;
+    size_t scratch_mark = SCRATCH_MARK(bmp);
+    u_int8_t *failed = count > 1 ? (u_int8_t*)SCRATCH_ALLOC(bmp, last - first) : NULL;
+
+    if (!failed) {
+        for (size_t i = first; i < last; i++)
+            Handle_Command(bmp, program, program->commands + i);
+        SCRATCH_RELEASE(bmp, scratch_mark);
+        return;
+    }
+    memset(failed, 0, last - first);
+
+    DRAW_BAND bands[FILL_THREADS];
+    pthread_t threads[FILL_THREADS];
+    bool started[FILL_THREADS];
+#ifdef BMP_TRACE
+    TRACE_MARK mark;
+    TRACE_BEGIN(bmp->trace, &mark);
+#endif
+
+    for (int i = 0; i < count; i++) {
+        DRAW_BAND *band = bands + i;
+        int top = (int)((long long)bmp->info.height * i / count);
+        int end = (int)((long long)bmp->info.height * (i + 1) / count);
+
+        band->view = *bmp;
+        memcpy(band->color, bmp->brush_color, SIZE_BRUSH);
+        band->view.brush_color = band->color;
+        band->view.scratch = NULL;
+        band->view.allocs = 0;
+        // Every view grows the stack kept from the batches before.
+        size_t bytes;
+        SCRATCH_TAKE(bmp, i, (void**)&band->view.stack, &bytes);
+        band->view.stack_size = bytes / sizeof(SPAN);
+        band->view.band_top = top;
+        band->view.band_rows = end - top;
+        band->program = program;
+        band->first = first;
+        band->last = last;
+        band->failed = failed;
+    }
+
+    for (int i = 1; i < count; i++) {
+        started[i] = !pthread_create(&threads[i], NULL, _BAND_DRAW, bands + i);
+        if (!started[i]) _BAND_DRAW(bands + i);
+    }
+    _BAND_DRAW(bands);
+
+    for (int i = 0; i < count; i++) {
+        if (i && started[i]) pthread_join(threads[i], NULL);
+        SCRATCH_KEEP(bmp, i, bands[i].view.stack, bands[i].view.stack_size * sizeof(SPAN));
+        bmp->allocs += bands[i].view.allocs;
+    }
+#ifdef BMP_TRACE
+    TRACE_END(bmp->trace, &mark, "draw batch", last - first);
+#endif
+
+    // Brush settings and errors, in order.
+    for (size_t i = first; i < last; i++) {
+        const COMMAND *command = program->commands + i;
+        if (command->op == OP_SET_COLOR || command->op == OP_SET_LINE || command->op == OP_INVALID) {
+            Handle_Command(bmp, program, command);
+        } else if (failed[i - first]) {
+            bmp->errors++;
+            fprintf(stderr, "ERROR: %s...\n", ERRORS[command->word]);
+        }
+    }
+
+    SCRATCH_RELEASE(bmp, scratch_mark);
+}
+
+/**
+ * @brief Runs the commands of a program, in order, on the BMP image.
+ * Consecutive batched commands run together, band-parallel with --threads.
+ * 
+ * @param bmp     The BMP structure containing the image data.
+ * @param program The program.
+ */
+void Handle_Program(BMP *bmp, PROGRAM *program) {
+    size_t i = 0;
+
+    while (i < program->count) {
+        size_t first = i;
+        while (i < program->count && Is_Batched(program->commands + i))
+            i++;
+
+        if (first < i)
+            _HANDLE_BATCH(bmp, program, first, i);
+        else
+            Handle_Command(bmp, program, program->commands + i++);
+    }
+}
@@ -10,23 +10,33 @@
 #include "../lib/cmd_draw.h"
 #include "../lib/cmd_fill.h"
 #include "../lib/cmd_insert.h"
+#include "../lib/cmd_canvas.h"
+#include "../lib/cmd_trace.h"
+#include "../lib/cmd_scratch.h"
+#include "./lexer.h"
+#include "./program.h"
 
 #define INSTR_LENGTH 101
 
-// Buffer to store command strings.
-static char CMD[INSTR_LENGTH];
-
-// Handles the "save" command to save the BMP image to a file.
-u_int8_t     Handle_Save     (BMP *bmp);
-// Handles the "edit" command to edit the BMP image from a file.
-u_int8_t     Handle_Edit     (BMP *bmp);
-// Handles the "set" command to set various properties of the BMP image.
-u_int8_t     Handle_Set      (BMP *bmp);
-// Handles the "draw" command to draw shapes on the BMP image.
-u_int8_t     Handle_Draw     (BMP *bmp);
-// Handles the "fill" command to fill an area of the BMP image with the current brush color.
-u_int8_t     Handle_Fill     (BMP *bmp);
-// Handles the "insert" command to insert an image from a file into the BMP image.
-u_int8_t     Handle_Insert   (BMP *bmp);
+// Parses the "save" command to save the BMP image to a file.
+u_int8_t     Parse_Save      (LEXER *lex, PROGRAM *program);
+// Parses the "edit" command to edit the BMP image from a file.
+u_int8_t     Parse_Edit      (LEXER *lex, PROGRAM *program);
+// Parses the "set" command to set various properties of the BMP image.
+u_int8_t     Parse_Set       (LEXER *lex, PROGRAM *program);
+// Parses the "draw" command to draw shapes on the BMP image.
+u_int8_t     Parse_Draw      (LEXER *lex, PROGRAM *program);
+// Parses the "fill" command to fill an area of the BMP image with the current brush color.
+u_int8_t     Parse_Fill      (LEXER *lex, PROGRAM *program);
+// Parses the "insert" command to insert an image from a file into the BMP image.
+u_int8_t     Parse_Insert    (LEXER *lex, PROGRAM *program);
+// Parses the "canvas" command to open, switch, clone or close named canvases.
+u_int8_t     Parse_Canvas    (LEXER *lex, PROGRAM *program);
+// Runs a parsed command on the BMP image, reporting its failure.
+u_int8_t     Handle_Command  (BMP *bmp, PROGRAM *program, const COMMAND *command);
+// Checks if a command can run in a batch of draws (no barrier).
+bool         Is_Batched      (const COMMAND *command);
+// Runs the commands of a program, batching the draws between barriers.
+void         Handle_Program  (BMP *bmp, PROGRAM *program);
 
 #endif /* INSTR_H_ */
@@ -0,0 +1,267 @@
+#include "./lexer.h"
+
+/**
+ * @brief Checks if a character is a separator (isspace in the C locale).
+ * 
+ * @param c The character.
+ * @return true if the character separates words, false otherwise.
+ */
+static inline bool _LEX_SPACE(int c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/**
+ * @brief Reads the next block of a streamed script.
+ * The bytes not read yet are moved to the front of the buffer, which doubles
+ * when a single word fills it. Only blocks while no byte is available, so an
+ * interactive session runs each command as soon as its line arrives.
+ * 
+ * @param lex The lexer.
+ * @return true if bytes were added, false at the end of the script.
+ */
+static bool _LEX_FILL(LEXER *lex) {
+    if (lex->map || lex->eof)
+        return false;
+
+    if (lex->pos) {
+        memmove(lex->data, lex->data + lex->pos, lex->size - lex->pos);
+        lex->size -= lex->pos;
+        lex->pos = 0;
+    }
+
+    if (lex->size == lex->capacity) {
+        char *data = (char*)realloc(lex->data, lex->capacity * 2);
+        if (!data) return false;
+        lex->data = data;
+        lex->capacity *= 2;
+    }
+
+    ssize_t bytes = 0;
+    do {
+        bytes = read(lex->fd, lex->data + lex->size, lex->capacity - lex->size);
+    } while (bytes < 0 && errno == EINTR);
+
+    if (bytes <= 0) {
+        lex->eof = true;
+        return false;
+    }
+
+    lex->size += (size_t)bytes;
+    return true;
+}
+
+/**
+ * @brief Gets a byte ahead of the read position, reading blocks as needed.
+ * 
+ * @param lex    The lexer.
+ * @param offset The distance from the read position.
+ * @return The byte, or -1 at the end of the script.
+ */
+static inline int _LEX_PEEK(LEXER *lex, size_t offset) {
+    while (lex->pos + offset >= lex->size)
+        if (!_LEX_FILL(lex)) return -1;
+    return (unsigned char)lex->data[lex->pos + offset];
+}
+
+/**
+ * @brief Skips the separators before the next word.
+ * 
+ * @param lex The lexer.
+ * @return true if a word follows, false at the end of the script.
+ */
+static bool _LEX_SKIP(LEXER *lex) {
+    int c = _LEX_PEEK(lex, 0);
+    for (; c >= 0 && _LEX_SPACE(c); c = _LEX_PEEK(lex, 0))
+        lex->pos++;
+    return c >= 0;
+}
+
+/**
+ * @brief Reads a signed decimal number the way strtol / strtoul do.
+ * The magnitude saturates at ULONG_MAX, a sign and digits are consumed, the
+ * byte after them is left for the next read.
+ * 
+ * @param lex      The lexer.
+ * @param negative Set if the number has a minus sign.
+ * @param overflow Set if the magnitude does not fit an unsigned long.
+ * @param value    The magnitude of the number.
+ * @return EXIT_SUCCESS if a number was read, EXIT_FAILURE otherwise.
+ */
+static u_int8_t _LEX_NUMBER(LEXER *lex, bool *negative, bool *overflow, unsigned long *value) {
+    if (!_LEX_SKIP(lex))
+        return EXIT_FAILURE;
+
+    int c = _LEX_PEEK(lex, 0);
+    *negative = c == '-';
+    if (c == '-' || c == '+') {
+        lex->pos++;
+        c = _LEX_PEEK(lex, 0);
+    }
+
+    if (c < '0' || c > '9')
+        return EXIT_FAILURE;
+
+    unsigned long number = 0;
+    *overflow = false;
+    for (; c >= '0' && c <= '9'; c = _LEX_PEEK(lex, 0)) {
+        unsigned long digit = (unsigned long)(c - '0');
+        if (number > (ULONG_MAX - digit) / 10)
+            *overflow = true;
+        else
+            number = number * 10 + digit;
+        lex->pos++;
+    }
+
+    *value = number;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Opens a lexer over a file descriptor.
+ * A regular file is mapped and read in place from the current offset, anything
+ * else (pipe, terminal) is read by blocks of LEX_BLOCK bytes.
+ * 
+ * @param lex The lexer.
+ * @param fd  The file descriptor of the script.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE if there is an error.
+ */
+u_int8_t LEX_OPEN(LEXER *lex, int fd) {
+    struct stat st;
+
+    lex->data = NULL;
+    lex->pos = lex->size = lex->capacity = 0;
+    lex->map = NULL;
+    lex->map_size = 0;
+    lex->fd = fd;
+    lex->eof = false;
+
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+
+        if (offset >= 0 && offset < st.st_size) {
+            void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                lex->map = map;
+                lex->map_size = (size_t)st.st_size;
+                lex->data = (char*)map;
+                lex->pos = (size_t)offset;
+                lex->size = lex->map_size;
+                lex->eof = true;
+                return EXIT_SUCCESS;
+            }
+        }
+    }
+
+    lex->data = (char*)malloc(LEX_BLOCK);
+    if (!lex->data)
+        return EXIT_FAILURE;
+    lex->capacity = LEX_BLOCK;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Closes a lexer, the file descriptor stays open.
+ * 
+ * @param lex The lexer.
+ */
+void LEX_CLOSE(LEXER *lex) {
+    if (lex->map)
+        munmap(lex->map, lex->map_size);
+    else
+        free(lex->data);
+
+    lex->data = NULL;
+    lex->map = NULL;
+    lex->pos = lex->size = lex->capacity = lex->map_size = 0;
+}
+
+/**
+ * @brief Reads the next word, without copying it.
+ * 
+ * @param lex    The lexer.
+ * @param word   The first byte of the word, valid until the next read.
+ * @param length The length of the word.
+ * @return EXIT_SUCCESS if a word was read, EXIT_FAILURE at the end of the script.
+ */
+u_int8_t LEX_WORD(LEXER *lex, const char **word, size_t *length) {
+    if (!_LEX_SKIP(lex))
+        return EXIT_FAILURE;
+
+    size_t n = 1;
+    for (int c = _LEX_PEEK(lex, n); c >= 0 && !_LEX_SPACE(c); c = _LEX_PEEK(lex, n))
+        n++;
+
+    *word = lex->data + lex->pos;
+    *length = n;
+    lex->pos += n;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Reads the next word into a buffer, as a NUL-terminated string.
+ * 
+ * @param lex  The lexer.
+ * @param dst  The buffer.
+ * @param size The size of the buffer.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE at the end of the script
+ *         or if the word does not fit the buffer.
+ */
+u_int8_t LEX_COPY(LEXER *lex, char *dst, size_t size) {
+    const char *word = NULL;
+    size_t length = 0;
+
+    if (LEX_WORD(lex, &word, &length) || length >= size)
+        return EXIT_FAILURE;
+
+    memcpy(dst, word, length);
+    dst[length] = '\0';
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Reads the next decimal integer, as scanf "%d" does.
+ * Out of range values saturate to a long and are then truncated to an int.
+ * 
+ * @param lex   The lexer.
+ * @param value The integer read.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE otherwise.
+ */
+u_int8_t LEX_INT(LEXER *lex, int *value) {
+    bool negative = false, overflow = false;
+    unsigned long number = 0;
+
+    if (_LEX_NUMBER(lex, &negative, &overflow, &number))
+        return EXIT_FAILURE;
+
+    long result = 0;
+    if (negative)
+        result = overflow || number > (unsigned long)LONG_MAX + 1 ? LONG_MIN : (long)(0UL - number);
+    else
+        result = overflow || number > (unsigned long)LONG_MAX ? LONG_MAX : (long)number;
+
+    *value = (int)result;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Reads the next decimal integer truncated to a byte, as scanf "%hhu" does.
+ * 
+ * @param lex   The lexer.
+ * @param value The byte read.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE otherwise.
+ */
+u_int8_t LEX_BYTE(LEXER *lex, u_int8_t *value) {
+    bool negative = false, overflow = false;
+    unsigned long number = 0;
+
+    if (_LEX_NUMBER(lex, &negative, &overflow, &number))
+        return EXIT_FAILURE;
+
+    if (overflow)
+        number = ULONG_MAX;
+    else if (negative)
+        number = 0UL - number;
+
+    *value = (u_int8_t)number;
+    return EXIT_SUCCESS;
+}
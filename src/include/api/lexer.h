@@ -0,0 +1,35 @@
+#ifndef LEXER_H_
+#define LEXER_H_
+
+#include "../bmp_image.h"
+
+// Command script reader: the mapped script file, or blocks read from a stream.
+typedef struct Lexer {
+    char                *data;        // Bytes of the script, from pos to size not read yet.
+    size_t               pos;
+    size_t               size;
+    size_t               capacity;    // Size of the block buffer, 0 if the script is mapped.
+    void                *map;         // Mapping of the script file, NULL if read by blocks.
+    size_t               map_size;
+    int                  fd;
+    bool                 eof;
+} LEXER;
+
+// Checks if a word read by LEX_WORD is the given literal.
+#define LEX_MATCH(word, length, literal) \
+    ((length) == sizeof(literal) - 1 && !memcmp((word), (literal), sizeof(literal) - 1))
+
+// Opens a lexer over a file descriptor, mapping it when it is a regular file.
+u_int8_t                 LEX_OPEN           (LEXER *lex, int fd);
+// Closes a lexer, the file descriptor stays open.
+void                     LEX_CLOSE          (LEXER *lex);
+// Reads the next word, valid until the next read (scanf "%s" without the copy).
+u_int8_t                 LEX_WORD           (LEXER *lex, const char **word, size_t *length);
+// Reads the next word into a NUL-terminated buffer of the given size.
+u_int8_t                 LEX_COPY           (LEXER *lex, char *dst, size_t size);
+// Reads the next decimal integer (scanf "%d").
+u_int8_t                 LEX_INT            (LEXER *lex, int *value);
+// Reads the next decimal integer truncated to a byte (scanf "%hhu").
+u_int8_t                 LEX_BYTE           (LEXER *lex, u_int8_t *value);
+
+#endif /* LEXER_H_ */
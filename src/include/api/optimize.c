@@ -0,0 +1,223 @@
+#include "./program.h"
+
+// Pixels a command can paint: rows top..bottom, columns left..right.
+typedef struct CommandBox {
+    long long            top;
+    long long            bottom;
+    long long            left;
+    long long            right;
+} BOX;
+
+/**
+ * @brief Checks if a command draws shapes with the brush.
+ */
+static bool _IS_DRAW(u_int8_t op) {
+    return op >= OP_LINE && op <= OP_POLYGON;
+}
+
+/**
+ * @brief Checks if a command reads the pixels or replaces the image,
+ * so no draw before it can be dropped because of a draw after it.
+ * Canvas commands switch or copy the image the draws run on.
+ */
+static bool _IS_BARRIER(u_int8_t op) {
+    return op == OP_SAVE || op == OP_EDIT || op == OP_FILL ||
+           (op >= OP_CANVAS_OPEN && op <= OP_CANVAS_CLOSE);
+}
+
+/**
+ * @brief Grows a box to hold a point.
+ */
+static void _BOX_ADD(BOX *box, long long y, long long x) {
+    box->left = min(box->left, y);
+    box->right = max(box->right, y);
+    box->top = min(box->top, x);
+    box->bottom = max(box->bottom, x);
+}
+
+/**
+ * @brief Computes the pixels a draw can paint, before clipping to the image.
+ * Every shape stays within the bounding box of its points (or corners) grown
+ * by half the brush size, and a filled rectangle paints all of that box.
+ * 
+ * @param program The program.
+ * @param command The draw command.
+ * @param half    Half the brush size when the command runs.
+ * @return The box of the command.
+ */
+static BOX _DRAW_BOX(const PROGRAM *program, const COMMAND *command, int half) {
+    const int *a = command->args;
+    BOX box = { LLONG_MAX, LLONG_MIN, LLONG_MAX, LLONG_MIN };
+
+    switch (command->op) {
+        case OP_RECTANGLE:
+        case OP_FILLED_RECTANGLE:
+            _BOX_ADD(&box, a[0], a[1]);
+            _BOX_ADD(&box, (long long)a[0] + a[2], (long long)a[1] + a[3]);
+            break;
+        case OP_POLYGON:
+            for (int i = 0; i < a[0]; i++)
+                _BOX_ADD(&box, program->points[a[1] + 2 * i], program->points[a[1] + 2 * i + 1]);
+            break;
+        case OP_TRIANGLE:
+        case OP_FILLED_TRIANGLE:
+            _BOX_ADD(&box, a[4], a[5]);
+            /* fall through */
+        default:
+            _BOX_ADD(&box, a[0], a[1]);
+            _BOX_ADD(&box, a[2], a[3]);
+            break;
+    }
+
+    box.top -= half, box.bottom += half;
+    box.left -= half, box.right += half;
+    return box;
+}
+
+/**
+ * @brief Drops the draws painted over by a later filled rectangle.
+ * Walks the program backwards, remembering the last OPT_COVERS filled
+ * rectangles met since the last barrier; a draw whose box lies inside one of
+ * them paints nothing that survives until the image is read again.
+ * 
+ * @param program The program.
+ * @param stats   The counters of the removed commands.
+ */
+static void _COVER_PASS(PROGRAM *program, STATS *stats) {
+    u_int8_t *halves = (u_int8_t*)malloc(program->count ? program->count : 1);
+    if (!halves)
+        return;
+
+    // Brush size of every command, SET_LINE keeps only odd sizes.
+    u_int8_t brush = 1;
+    for (size_t i = 0; i < program->count; i++) {
+        const COMMAND *command = program->commands + i;
+        if (command->op == OP_SET_LINE && ((u_int8_t)command->args[0] & 1))
+            brush = (u_int8_t)command->args[0];
+        halves[i] = brush / 2;
+    }
+
+    BOX covers[OPT_COVERS];
+    int count = 0, next = 0;
+
+    for (size_t i = program->count; i-- > 0;) {
+        COMMAND *command = program->commands + i;
+
+        if (_IS_BARRIER(command->op)) {
+            count = next = 0;
+            continue;
+        }
+        if (!_IS_DRAW(command->op))
+            continue;
+
+        BOX box = _DRAW_BOX(program, command, halves[i]);
+        bool covered = false;
+        for (int k = 0; k < count && !covered; k++)
+            covered = box.top >= covers[k].top && box.bottom <= covers[k].bottom &&
+                      box.left >= covers[k].left && box.right <= covers[k].right;
+
+        if (covered) {
+            command->op = OP_NONE;
+            stats->covered++;
+        } else if (command->op == OP_FILLED_RECTANGLE) {
+            covers[next] = box;
+            next = (next + 1) % OPT_COVERS;
+            count = min(count + 1, OPT_COVERS);
+        }
+    }
+
+    free(halves);
+}
+
+/**
+ * @brief Merges each line into the line before it when they continue each other.
+ * The end of the first line must be the start of the second, on the same ray,
+ * with every coordinate non-negative: LINE rounds its points from the end of the
+ * lowest row or column, so a lattice point on a ray splits it into two lines
+ * with the same pixels only where that rounding is a floor.
+ * 
+ * @param program The program.
+ * @param stats   The counters of the removed commands.
+ */
+static void _MERGE_PASS(PROGRAM *program, STATS *stats) {
+    COMMAND *last = NULL;
+
+    for (size_t i = 0; i < program->count; i++) {
+        COMMAND *command = program->commands + i;
+        if (command->op == OP_NONE)
+            continue;
+
+        if (command->op == OP_LINE && last && last->op == OP_LINE) {
+            const int *a = last->args, *b = command->args;
+            long long dy1 = (long long)a[2] - a[0], dx1 = (long long)a[3] - a[1];
+            long long dy2 = (long long)b[2] - b[0], dx2 = (long long)b[3] - b[1];
+
+            bool joined = a[2] == b[0] && a[3] == b[1];
+            bool positive = a[0] >= 0 && a[1] >= 0 && b[0] >= 0 && b[1] >= 0 &&
+                            b[2] >= 0 && b[3] >= 0;
+            bool ray = dy1 * dx2 == dx1 * dy2 && dy1 * dy2 + dx1 * dx2 > 0;
+
+            if (joined && positive && ray) {
+                last->args[2] = b[2];
+                last->args[3] = b[3];
+                command->op = OP_NONE;
+                stats->merged++;
+                continue;
+            }
+        }
+
+        last = command;
+    }
+}
+
+/**
+ * @brief Drops the "set" commands overridden before any draw or fill uses them.
+ * Walks the program backwards, tracking whether the brush color and size are
+ * read before they are set again. Sets that fail (even sizes) change nothing
+ * and are kept for their error.
+ * 
+ * @param program The program.
+ * @param stats   The counters of the removed commands.
+ */
+static void _SET_PASS(PROGRAM *program, STATS *stats) {
+    bool color_used = false, line_used = false;
+
+    for (size_t i = program->count; i-- > 0;) {
+        COMMAND *command = program->commands + i;
+
+        if (_IS_DRAW(command->op)) {
+            color_used = line_used = true;
+        } else if (command->op == OP_FILL) {
+            color_used = true;
+        } else if (command->op == OP_SET_COLOR) {
+            if (!color_used)
+                command->op = OP_NONE, stats->sets++;
+            color_used = false;
+        } else if (command->op == OP_SET_LINE && ((u_int8_t)command->args[0] & 1)) {
+            if (!line_used)
+                command->op = OP_NONE, stats->sets++;
+            line_used = false;
+        }
+    }
+}
+
+/**
+ * @brief Removes the commands that do not change the saved images.
+ * Runs the cover, merge and set passes, then packs the remaining commands.
+ * 
+ * @param program The program.
+ * @param stats   The counters of the removed commands.
+ */
+void OPTIMIZE(PROGRAM *program, STATS *stats) {
+    stats->commands = program->count;
+
+    _COVER_PASS(program, stats);
+    _MERGE_PASS(program, stats);
+    _SET_PASS(program, stats);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < program->count; i++)
+        if (program->commands[i].op != OP_NONE)
+            program->commands[kept++] = program->commands[i];
+    program->count = kept;
+}
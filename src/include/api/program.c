@@ -0,0 +1,125 @@
+#include "./program.h"
+
+/**
+ * @brief Grows a pool so that it holds at least the needed number of items.
+ * 
+ * @param pool     The pool, reallocated in place.
+ * @param capacity The capacity of the pool, in items.
+ * @param needed   The number of items needed.
+ * @param item     The size of an item.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE if out of memory.
+ */
+static u_int8_t _PROGRAM_GROW(void **pool, size_t *capacity, size_t needed, size_t item) {
+    if (needed <= *capacity)
+        return EXIT_SUCCESS;
+
+    size_t size = *capacity ? *capacity : 64;
+    while (size < needed) size *= 2;
+
+    void *grown = realloc(*pool, size * item);
+    if (!grown)
+        return EXIT_FAILURE;
+
+    *pool = grown;
+    *capacity = size;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Initializes an empty program.
+ * 
+ * @param program The program.
+ */
+void PROGRAM_INIT(PROGRAM *program) {
+    program->commands = NULL;
+    program->count = program->capacity = 0;
+    program->points = NULL;
+    program->point_count = program->point_capacity = 0;
+    program->text = NULL;
+    program->text_size = program->text_capacity = 0;
+}
+
+/**
+ * @brief Frees the commands and pools of a program.
+ * 
+ * @param program The program.
+ */
+void PROGRAM_FREE(PROGRAM *program) {
+    FREE_MEMORY((void**)&program->commands);
+    FREE_MEMORY((void**)&program->points);
+    FREE_MEMORY((void**)&program->text);
+    PROGRAM_INIT(program);
+}
+
+/**
+ * @brief Empties a program, keeping its memory for the next commands.
+ * 
+ * @param program The program.
+ */
+void PROGRAM_RESET(PROGRAM *program) {
+    program->count = 0;
+    program->point_count = 0;
+    program->text_size = 0;
+}
+
+/**
+ * @brief Appends a command to a program.
+ * 
+ * @param program The program.
+ * @param op      The operation of the command.
+ * @param word    The command word it was parsed from.
+ * @return The command, with its operands to fill, or NULL if out of memory.
+ */
+COMMAND* PROGRAM_ADD(PROGRAM *program, u_int8_t op, u_int8_t word) {
+    if (_PROGRAM_GROW((void**)&program->commands, &program->capacity,
+                      program->count + 1, sizeof(COMMAND)))
+        return NULL;
+
+    COMMAND *command = program->commands + program->count++;
+    memset(command, 0, sizeof(COMMAND));
+    command->op = op;
+    command->word = word;
+    return command;
+}
+
+/**
+ * @brief Copies a path into the text pool of a program.
+ * 
+ * @param program The program.
+ * @param text    The path, not NUL-terminated.
+ * @param length  The length of the path.
+ * @param offset  The offset of the copy in the text pool.
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE if out of memory.
+ */
+u_int8_t PROGRAM_TEXT(PROGRAM *program, const char *text, size_t length, int *offset) {
+    size_t needed = program->text_size + length + 1;
+    if (needed > INT_MAX ||
+        _PROGRAM_GROW((void**)&program->text, &program->text_capacity, needed, 1))
+        return EXIT_FAILURE;
+
+    memcpy(program->text + program->text_size, text, length);
+    program->text[program->text_size + length] = '\0';
+    *offset = (int)program->text_size;
+    program->text_size = needed;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Reserves vertices in the point pool of a program.
+ * 
+ * @param program The program.
+ * @param count   The number of vertices.
+ * @param offset  The offset of the first vertex in the point pool.
+ * @return The y and x of each vertex, to fill, or NULL if out of memory.
+ */
+int* PROGRAM_POINTS(PROGRAM *program, size_t count, int *offset) {
+    size_t needed = program->point_count + 2 * count;
+    if (needed > INT_MAX ||
+        _PROGRAM_GROW((void**)&program->points, &program->point_capacity, needed, sizeof(int)))
+        return NULL;
+
+    int *points = program->points + program->point_count;
+    *offset = (int)program->point_count;
+    program->point_count = needed;
+    return points;
+}
@@ -0,0 +1,79 @@
+#ifndef PROGRAM_H_
+#define PROGRAM_H_
+
+#include "../bmp_image.h"
+
+// Operations of the commands.
+#define OP_NONE              0     // Removed by an optimization pass.
+#define OP_INVALID           1     // Command that failed to parse, only reports its error.
+#define OP_SAVE              2
+#define OP_EDIT              3
+#define OP_SET_COLOR         4
+#define OP_SET_LINE          5
+#define OP_SET_CACHE         6
+#define OP_LINE              7
+#define OP_RECTANGLE         8
+#define OP_TRIANGLE          9
+#define OP_FILLED_RECTANGLE  10
+#define OP_FILLED_TRIANGLE   11
+#define OP_POLYGON           12
+#define OP_FILL              13
+#define OP_INSERT            14
+#define OP_CANVAS_OPEN       15
+#define OP_CANVAS_USE        16
+#define OP_CANVAS_CLONE      17
+#define OP_CANVAS_CLOSE      18
+
+// Command words, reporting the errors of their commands.
+#define WORD_SAVE            0
+#define WORD_EDIT            1
+#define WORD_SET             2
+#define WORD_DRAW            3
+#define WORD_FILL            4
+#define WORD_INSERT          5
+#define WORD_CANVAS          6
+
+// One parsed command: paths and polygon vertices live in the pools of the program.
+typedef struct Command {
+    u_int8_t             op;
+    u_int8_t             word;
+    int                  args[6];     // Operands in script order, offsets in the pools for paths and vertices.
+} COMMAND;
+
+// Commands removed by the optimization passes.
+typedef struct ProgramStats {
+    size_t               commands;    // Commands parsed.
+    size_t               sets;        // "set" overridden before any use.
+    size_t               covered;     // Draws painted over by a later filled rectangle.
+    size_t               merged;      // Lines merged into the collinear line before them.
+} STATS;
+
+// A parsed script.
+typedef struct Program {
+    COMMAND             *commands;
+    size_t               count;
+    size_t               capacity;
+    int                 *points;      // Polygon vertices, y and x of each.
+    size_t               point_count;
+    size_t               point_capacity;
+    char                *text;        // Paths and canvas names, NUL-terminated one after the other.
+    size_t               text_size;
+    size_t               text_capacity;
+} PROGRAM;
+
+// Initializes an empty program.
+void                     PROGRAM_INIT       (PROGRAM *program);
+// Frees the commands and pools of a program.
+void                     PROGRAM_FREE       (PROGRAM *program);
+// Empties a program, keeping its memory.
+void                     PROGRAM_RESET      (PROGRAM *program);
+// Appends a command to a program, NULL if out of memory.
+COMMAND*                 PROGRAM_ADD        (PROGRAM *program, u_int8_t op, u_int8_t word);
+// Copies a path into the text pool and stores its offset.
+u_int8_t                 PROGRAM_TEXT       (PROGRAM *program, const char *text, size_t length, int *offset);
+// Reserves count vertices in the point pool and stores their offset.
+int*                     PROGRAM_POINTS     (PROGRAM *program, size_t count, int *offset);
+// Removes the commands that do not change the saved images.
+void                     OPTIMIZE           (PROGRAM *program, STATS *stats);
+
+#endif /* PROGRAM_H_ */
@@ -5,6 +5,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "./bmp_header.h"
 
@@ -16,16 +25,42 @@
 #define SIZE_COLOR    3     // SIZE BYTES RGB PIXEL
 #define SIZE_RGB      3 * 8 // SIZE BITS RGB PIXEL
 
+#define SAVE_IOV      1024  // BUFFERS PER SAVE WRITE (ROWS + PADDING)
+#define SAVE_STAGE    64    // ROWS COPIED BACK PER SAVE WRITE (TILED LAYOUT)
+#define CACHE_BUDGET  (256 << 20) // DEFAULT INSERT CACHE BUDGET (BYTES)
+#define SPAN_PERIOD   48    // BYTES OF A SPAN PATTERN (16 PIXELS)
+#define SPAN_SMALL    16    // SPANS SHORTER THAN THIS ARE WRITTEN PIXEL BY PIXEL
+#define FILL_STACK    1024  // INITIAL FILL WORK STACK (SPANS)
+#define POLY_VERTS    256   // MAX VERTICES OF A POLYGON
+#define FILL_THREADS  64    // MAX THREADS OF A BAND FILL
+#define FILL_ROWS     64    // MIN ROWS OF A FILL OR DRAW BAND
+#define FILL_SERIAL   8     // SHARE (1/N) OF THE IMAGE A FILL PAINTS SERIALLY BEFORE ITS BANDS
+#define BATCH_WORKERS 64    // MAX WORKERS RUNNING THE SCRIPTS OF A BATCH
+#define SERVE_QUEUE   64    // CONNECTIONS WAITING FOR A SERVER WORKER
+#define SERVE_SESSIONS 64   // SESSIONS KEPT BY THE SERVER
+#define SERVE_LINE    128   // MAX BYTES OF A REQUEST LINE
+#define SERVE_TIMEOUT 30    // SECONDS A CLIENT MAY STALL A REQUEST
+#define LEX_BLOCK     (1 << 16) // BYTES READ PER SCRIPT BLOCK
+#define OPT_COVERS    64    // FILLED RECTANGLES TRACKED BY THE COVER PASS
+#define SIZE_FILE_MAX UINT32_MAX // LARGEST BF_SIZE, BIGGER FILES ARE CLAMPED
+#define SNAP_PAGE     4096  // BYTES COPIED AT ONCE BEFORE A SAVE IN FLIGHT READS THEM
+#define POOL_BUDGET   (256 << 20) // PIXEL BYTES KEPT BY THE POOL FOR REUSE
+#define CANVAS_MAIN   "main" // NAME OF THE CANVAS OPEN AT START
+#define TRACE_EVENTS  (1 << 20) // MOST COMMANDS KEPT IN THE TIMELINE OF A TRACE
+#define TRACE_NAMES   32    // MOST COMMAND NAMES IN THE SUMMARY OF A TRACE
+#define SCRATCH_ALIGN 64    // BYTES ALIGNING THE SCRATCH MEMORY OF A COMMAND
+#define BRUSH_KERNELS 11    // LARGEST BRUSH WITH A KERNEL OF ITS OWN
+
 #define max(a, b) ((a) > (b) ? (a) : (b))
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
 #define swap(a, b, size) do { \
-    char *temp = (char*)malloc(size); \
-    if (!temp) exit(EXIT_FAILURE); \
-    memcpy(temp, a, size); \
-    memcpy(a, b, size); \
-    memcpy(b, temp, size); \
-    free(temp); \
+    u_int8_t *swap_a = (u_int8_t*)(a), *swap_b = (u_int8_t*)(b); \
+    for (size_t swap_i = 0; swap_i < (size_t)(size); swap_i++) { \
+        u_int8_t swap_byte = swap_a[swap_i]; \
+        swap_a[swap_i] = swap_b[swap_i]; \
+        swap_b[swap_i] = swap_byte; \
+    } \
 } while (0)
 
 #define FREE_MEMORY(ptr) do { \
@@ -35,17 +70,155 @@
     } \
 } while (0)
 
-#define FREE_BMP(bmp)   FREE_MEMORY((void**)&(bmp)->img)
+// Pixels mapped from the input file are unmapped, the others are freed.
+#define FREE_BMP(bmp) do { \
+    if ((bmp)->map) { \
+        munmap((bmp)->map, (bmp)->map_size); \
+        (bmp)->map = NULL; \
+        (bmp)->img = NULL; \
+    } \
+    FREE_MEMORY((void**)&(bmp)->img); \
+} while (0)
 #define FREE_BRUSH(bmp) FREE_MEMORY((void**)&(bmp)->brush_color)
+#define FREE_STACK(bmp) FREE_MEMORY((void**)&(bmp)->stack)
 
-#define WIDTH(width) (width * SIZE_COLOR)
+#define WIDTH(width) ((width) * SIZE_COLOR)
 #define CALCULATE_PADDING(width) (((4 - ((3 * (width)) % 4)) % 4))
 
+// Rows the draws of a BMP may write: band_top to BAND_END excluded, or the whole image.
+#define BAND_TOP(bmp) ((bmp)->band_rows ? (bmp)->band_top : 0)
+#define BAND_END(bmp) ((bmp)->band_rows ? (bmp)->band_top + (bmp)->band_rows : (bmp)->info.height)
+
+#ifdef BMP_BGRX
+// Pixels are held as 4 bytes, B G R and a zero byte (build with FORMAT=bgrx).
+#define IMG_BGRX      1
+#define PIXEL_BYTES   4     // SIZE BYTES PIXEL IN MEMORY
+#else
+#define IMG_BGRX      0
+#define PIXEL_BYTES   SIZE_COLOR
+#endif
+
+// Set when the pixels in memory differ from the rows of the file.
+#define IMG_CONVERT   (IMG_TILED || IMG_BGRX)
+
+#ifdef BMP_TILED
+// Pixels are stored in TILE_SIZE x TILE_SIZE tiles, each one contiguous and
+// row-major, the tiles themselves row-major (build with LAYOUT=tiled).
+#define IMG_TILED     1
+#define TILE_SHIFT    6
+#define TILE_SIZE     (1 << TILE_SHIFT) // PIXELS PER TILE SIDE
+#define TILES(n) (((size_t)(n) + TILE_SIZE - 1) >> TILE_SHIFT)
+
+// Pixels held along a side of n pixels, up to a whole tile.
+#define IMG_SIDE(n) (TILES(n) * TILE_SIZE)
+
+// Size in bytes of the BMP vector of pixels, tiles on the borders are complete.
+#define IMG_BYTES(width, height) \
+    (TILES(width) * TILES(height) * TILE_SIZE * TILE_SIZE * PIXEL_BYTES)
+
+// Address of the pixel at (row, col) in the BMP vector of pixels.
+#define PIXEL(bmp, row, col) \
+    ((bmp)->img + ((((size_t)(row) >> TILE_SHIFT) * TILES((bmp)->info.width) + \
+                    ((size_t)(col) >> TILE_SHIFT)) * TILE_SIZE * TILE_SIZE + \
+                   ((size_t)(row) & (TILE_SIZE - 1)) * TILE_SIZE + \
+                   ((size_t)(col) & (TILE_SIZE - 1))) * PIXEL_BYTES)
+
+// Number of pixels contiguous in memory from (row, col) to the right.
+#define ROW_RUN(bmp, row, col) ((size_t)TILE_SIZE - ((size_t)(col) & (TILE_SIZE - 1)))
+#else
+#define IMG_TILED     0
+
+// Pixels held along a side of n pixels.
+#define IMG_SIDE(n) ((size_t)(n))
+
+// Size in bytes of the BMP vector of pixels.
+#define IMG_BYTES(width, height) ((size_t)(width) * (size_t)(height) * PIXEL_BYTES)
+
+// Address of the pixel at (row, col) in the BMP vector of pixels.
+#define PIXEL(bmp, row, col) \
+    ((bmp)->img + ((size_t)(row) * (size_t)(bmp)->info.width + (size_t)(col)) * PIXEL_BYTES)
+
+// Number of pixels contiguous in memory from (row, col) to the right.
+#define ROW_RUN(bmp, row, col) ((size_t)(bmp)->info.width - (size_t)(col))
+#endif
+
+typedef struct FillSpan {
+    int              left;            // First column of the span.
+    int              right;           // Last column of the span.
+    int              row;             // Row of the already filled span.
+    int              dir;             // Next row to scan (+1 up, -1 down).
+} SPAN;
+
+// Copy-on-write snapshot of the pixels, read by a save in flight (cmd_snap.c).
+typedef struct Snapshot SNAP;
+// Save written in the background (cmd_insert.c).
+typedef struct SaveJob SAVE_JOB;
+// Named canvases of a session, all but the active one parked (cmd_canvas.c).
+typedef struct CanvasSet CANVASES;
+// Timeline and summary of the commands run on a BMP (cmd_trace.c).
+typedef struct Trace TRACE;
+// Scratch memory of the commands of a BMP, reused from one command to the next (cmd_scratch.c).
+typedef struct Scratch SCRATCH;
+struct BitMapPicture;
+// Brush kernel: writes rows of brush_size pixels of the brush line, from (row, col) down (cmd_span.c).
+typedef void (*STAMP_FN)(struct BitMapPicture *bmp, int row, int col, int rows);
+
+// Work counted by the trace of a command.
+typedef struct TraceCount {
+    size_t           written;         // Pixels written.
+    size_t           visited;         // Pixels compared by the fills.
+    size_t           read;            // Bytes read from images.
+    size_t           wrote;           // Bytes written to images.
+    size_t           allocs;          // Allocations.
+    size_t           alloc_bytes;     // Bytes allocated.
+} TRACE_COUNT;
+
+#ifdef BMP_TRACE
+// Counts of the calling thread, flushed into the trace by TRACE_FLUSH (build with TRACE=on).
+extern _Thread_local TRACE_COUNT TRACE_THREAD;
+void TRACE_FLUSH(TRACE *trace);
+
+#define TRACE_ADD(bmp, field, n) do { \
+    if ((bmp)->trace) TRACE_THREAD.field += (size_t)(n); \
+} while (0)
+#define TRACE_DONE(bmp) TRACE_FLUSH((bmp)->trace)
+#else
+#define TRACE_ADD(bmp, field, n) do { } while (0)
+#define TRACE_DONE(bmp) do { } while (0)
+#endif
+
+// Counts a heap allocation of a command, on the BMP and in its trace.
+#define COUNT_ALLOC(bmp, bytes) do { \
+    __atomic_fetch_add(&(bmp)->allocs, 1, __ATOMIC_RELAXED); \
+    TRACE_ADD(bmp, allocs, 1); \
+    TRACE_ADD(bmp, alloc_bytes, bytes); \
+} while (0)
+
 typedef struct BitMapPicture {
     bmp_infoheader   info;            // BMP information header.
     u_int8_t         *img;            // BMP vector of pixels.
+    u_int8_t         *map;            // BMP input file mapping holding img, if any.
+    size_t           map_size;        // BMP input file mapping size.
+    dev_t            map_dev;         // BMP device of the input file mapped by EDIT.
+    ino_t            map_ino;         // BMP inode of the input file mapped by EDIT, 0 if none.
     u_int8_t         brush_size;      // BMP brush size.
+    STAMP_FN         stamp;           // BMP kernel of the brush size, NULL if it has none.
+    int              threads;         // BMP worker threads (1 = serial).
     u_int8_t         *brush_color;    // BMP brush color.
+    u_int8_t         brush_line[BRUSH_KERNELS * PIXEL_BYTES]; // BMP brush color in pixels, written by the kernels.
+    SPAN             *stack;          // BMP fill work stack, reused between fills.
+    size_t           stack_size;      // BMP fill work stack capacity (spans).
+    int              band_top;        // BMP first row drawn on, when band_rows is set.
+    int              band_rows;       // BMP rows drawn on (0 = whole image).
+    const char       *canvas_dir;     // BMP directory of file-backed pixels (NULL = memory).
+    SNAP             *snap;           // BMP snapshot read by the save in flight, if any.
+    SAVE_JOB         *save;           // BMP save in flight, if any.
+    size_t           save_failed;     // BMP saves that failed in the background.
+    size_t           errors;          // BMP commands that failed.
+    CANVASES         *canvases;       // BMP named canvases, NULL until one is opened.
+    TRACE            *trace;          // BMP command trace, NULL unless tracing.
+    SCRATCH          *scratch;        // BMP scratch memory of the commands, NULL until used.
+    size_t           allocs;          // BMP heap allocations made by the commands.
 } BMP;
 
 #endif /* BMP_H_ */
@@ -0,0 +1,27 @@
+#ifndef CANVAS_H_
+#define CANVAS_H_
+
+#include "../bmp_image.h"
+
+// Allocates the pixels of the BMP image for its width and height.
+u_int8_t                 CANVAS_ALLOC       (BMP *bmp);
+// Hands the pixels of the BMP image back, allocated ones to the pool.
+void                     CANVAS_RELEASE     (BMP *bmp);
+// Loads an image file into a named canvas, created if needed, and makes it active.
+u_int8_t                 CANVAS_OPEN        (BMP *bmp, const char *name, char *file);
+// Makes a named canvas the active one.
+u_int8_t                 CANVAS_USE         (BMP *bmp, const char *name);
+// Copies the pixels of a canvas into another one, created if needed.
+u_int8_t                 CANVAS_CLONE       (BMP *bmp, const char *src, const char *dst);
+// Frees the pixels of a named canvas and forgets its name.
+u_int8_t                 CANVAS_CLOSE       (BMP *bmp, const char *name);
+// Copies the pixels of every canvas mapped from a file out of it.
+u_int8_t                 CANVAS_DETACH      (BMP *bmp, const struct stat *st);
+// Reports the memory held by every canvas and the pool.
+void                     CANVAS_REPORT      (const BMP *bmp, FILE *fout);
+// Frees the parked canvases of the BMP image.
+void                     CANVAS_FREE        (BMP *bmp);
+// Frees every block held by the pool.
+void                     POOL_CLEAR         (void);
+
+#endif /* CANVAS_H_ */
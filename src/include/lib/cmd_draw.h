@@ -11,5 +11,11 @@ u_int8_t                 LINE               (BMP *bmp, int y1, int x1, int y2, i
 u_int8_t                 RECTANGLE          (BMP *bmp, int y1, int x1, int width, int height);
 // Draws a filled triangle on the BMP image.
 u_int8_t                 TRIANGLE           (BMP *bmp, int y1, int x1, int y2, int x2, int y3, int x3);
+// Draws a filled rectangle on the BMP image, border and interior.
+u_int8_t                 FILLED_RECTANGLE   (BMP *bmp, int y1, int x1, int width, int height);
+// Draws a filled triangle on the BMP image, border and interior.
+u_int8_t                 FILLED_TRIANGLE    (BMP *bmp, int y1, int x1, int y2, int x2, int y3, int x3);
+// Draws a filled polygon on the BMP image, border and interior.
+u_int8_t                 POLYGON            (BMP *bmp, const int *y, const int *x, int count);
 
 #endif /* DRAW_H_ */
\ No newline at end of file
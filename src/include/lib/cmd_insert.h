@@ -5,9 +5,25 @@
 
 // Saves the BMP image to a file.
 u_int8_t              SAVE               (char *file, BMP *bmp);
+// Waits for the save in flight of the BMP image, if any.
+u_int8_t              SAVE_WAIT          (BMP *bmp);
+// Writes the BMP image to an open file descriptor, right away.
+u_int8_t              SAVE_FD            (int fd, BMP *bmp);
+// Encodes the BMP image into a new buffer, as a BMP file.
+u_int8_t              SAVE_MEMORY        (BMP *bmp, u_int8_t **data, size_t *size);
 // Edits a BMP image by reading and updating its content from an input file.
 u_int8_t              EDIT               (char *file, BMP *bmp);
+// Edits a BMP image by reading it from an open file descriptor.
+u_int8_t              EDIT_FD            (int fd, BMP *bmp);
+// Edits a BMP image by copying it from a BMP file held in memory.
+u_int8_t              EDIT_MEMORY        (const u_int8_t *data, size_t size, BMP *bmp);
 // Inserts an image into a BMP structure at a specified position.
 u_int8_t              INSERT             (char *file, BMP *bmp, int y, int x);
+// Sets the memory budget of the decoded image cache used by INSERT.
+void                  CACHE_SIZE         (size_t bytes);
+// Reports the decoded image cache counters.
+void                  CACHE_REPORT       (FILE *fout);
+// Frees every image held by the decoded image cache.
+void                  CACHE_CLEAR        (void);
 
 #endif /* INSERT_H_ */
\ No newline at end of file
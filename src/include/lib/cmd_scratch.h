@@ -0,0 +1,19 @@
+#ifndef SCRATCH_H_
+#define SCRATCH_H_
+
+#include "../bmp_image.h"
+
+// Takes scratch memory of the BMP, held until it is released below its mark.
+void*                    SCRATCH_ALLOC      (BMP *bmp, size_t bytes);
+// Marks the scratch memory in use, to release what is taken after it.
+size_t                   SCRATCH_MARK       (const BMP *bmp);
+// Releases the scratch memory taken since a mark.
+void                     SCRATCH_RELEASE    (BMP *bmp, size_t mark);
+// Takes the buffer kept for a band, grown with realloc while the band runs.
+void                     SCRATCH_TAKE       (BMP *bmp, int band, void **buffer, size_t *bytes);
+// Keeps the buffer of a band for the next commands.
+void                     SCRATCH_KEEP       (BMP *bmp, int band, void *buffer, size_t bytes);
+// Frees the scratch memory of the BMP.
+void                     SCRATCH_FREE       (BMP *bmp);
+
+#endif /* SCRATCH_H_ */
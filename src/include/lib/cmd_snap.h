@@ -0,0 +1,17 @@
+#ifndef SNAP_H_
+#define SNAP_H_
+
+#include "../bmp_image.h"
+
+// Takes a copy-on-write snapshot of the pixels of the BMP image.
+SNAP*                    SNAP_TAKE          (const BMP *bmp);
+// Copies the pages about to be written while the snapshot is read.
+void                     SNAP_TOUCH         (SNAP *snap, const u_int8_t *dst, size_t bytes);
+// Copies bytes of the BMP image as they were when the snapshot was taken.
+void                     SNAP_READ          (SNAP *snap, const u_int8_t *src, u_int8_t *dst, size_t bytes);
+// Marks the snapshot as read: the pages written from now on are not copied.
+void                     SNAP_DONE          (SNAP *snap);
+// Frees a snapshot and its page copies.
+void                     SNAP_FREE          (SNAP *snap);
+
+#endif /* SNAP_H_ */
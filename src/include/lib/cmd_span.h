@@ -0,0 +1,31 @@
+#ifndef SPAN_H_
+#define SPAN_H_
+
+#include "../bmp_image.h"
+
+// Span kernel: writes count pixels of a BGR color, one after the other.
+typedef void (*SPAN_FN)(u_int8_t *dst, const u_int8_t *color, size_t count);
+
+// Picks the fastest span kernel and pixel conversions of the CPU, once.
+void                     SPAN_INIT          (void);
+// Writes count pixels of the color with the kernel picked by SPAN_INIT.
+void                     SPAN_FILL          (u_int8_t *dst, const u_int8_t *color, size_t count);
+// Gets a span kernel by name ("scalar", "sse2", "avx2"), NULL if the CPU lacks it.
+SPAN_FN                  SPAN_KERNEL        (const char *name);
+
+// Packs count pixels of the BMP vector of pixels to the BGR pixels of a file.
+void                     PIXEL_PACK         (u_int8_t *dst, const u_int8_t *src, size_t count);
+// Unpacks count BGR pixels of a file to the BMP vector of pixels.
+void                     PIXEL_UNPACK       (u_int8_t *dst, const u_int8_t *src, size_t count);
+
+// Gets the brush kernel of a brush size, NULL if it has none.
+STAMP_FN                 STAMP_KERNEL       (u_int8_t size);
+
+// Writes count pixels of a color on a row of the BMP image, from (row, col).
+void                     ROW_FILL           (BMP *bmp, int row, int col, const u_int8_t *color, size_t count);
+// Copies count packed pixels on a row of the BMP image, from (row, col).
+void                     ROW_WRITE          (BMP *bmp, int row, int col, const u_int8_t *src, size_t count);
+// Copies count pixels of a row of the BMP image, from (row, col), packed.
+void                     ROW_READ           (const BMP *bmp, int row, int col, u_int8_t *dst, size_t count);
+
+#endif /* SPAN_H_ */
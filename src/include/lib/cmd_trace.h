@@ -0,0 +1,23 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "../bmp_image.h"
+
+// Clock and counts taken when a traced command starts.
+typedef struct TraceMark {
+    u_int64_t            start;       // Clock ticks.
+    TRACE_COUNT          count;
+} TRACE_MARK;
+
+// Starts tracing the commands run on the BMP, the timeline going to a file.
+u_int8_t                 TRACE_OPEN         (BMP *bmp, const char *file);
+// Marks the start of a command.
+void                     TRACE_BEGIN        (TRACE *trace, TRACE_MARK *mark);
+// Records a command started at a mark.
+void                     TRACE_END          (TRACE *trace, const TRACE_MARK *mark, const char *name, size_t commands);
+// Prints the summary table and writes the Chrome trace of the commands.
+u_int8_t                 TRACE_REPORT       (TRACE *trace, FILE *fout);
+// Stops tracing the BMP.
+void                     TRACE_FREE         (BMP *bmp);
+
+#endif /* TRACE_H_ */
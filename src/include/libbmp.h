@@ -0,0 +1,91 @@
+#ifndef LIBBMP_H_
+#define LIBBMP_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * libbmp: the BMP image commands behind a context object.
+ * Every context holds its own image, canvases, brush and save in flight, so
+ * contexts may be used from different threads at once; one context must not
+ * be used by two threads at a time. The insert cache and the pixel pool are
+ * shared by the whole process and locked.
+ */
+
+// Marks the functions exported by libbmp.so, the only symbols it exports.
+#define BMP_API __attribute__((visibility("default")))
+
+// An image being edited, with its brush and named canvases.
+typedef struct BitMapPicture BMP_CONTEXT;
+
+// Counters of a script run by Bmp_Run.
+typedef struct BmpRun {
+    size_t               commands;    // Commands parsed.
+    size_t               sets;        // "set" removed by --optimize.
+    size_t               covered;     // Draws removed by --optimize.
+    size_t               merged;      // Lines merged by --optimize.
+    size_t               errors;      // Commands that failed.
+    size_t               save_failed; // Saves that failed in the background.
+    size_t               allocs;      // Heap allocations of the commands (images, scratch, stacks).
+    const char           *error;      // Why the script stopped before "quit", NULL if it did not.
+} BMP_RUN;
+
+// Creates a context without image, brush black and 1 pixel wide.
+BMP_API BMP_CONTEXT*     Bmp_Create         (void);
+// Waits for the save in flight of a context, then frees it.
+BMP_API void             Bmp_Destroy        (BMP_CONTEXT *ctx);
+// Sets the worker threads of the fills and batched draws of a context.
+BMP_API u_int8_t         Bmp_Set_Threads    (BMP_CONTEXT *ctx, int threads);
+// Keeps the pixels of the next images in files of a directory (NULL = memory).
+BMP_API void             Bmp_Set_Canvas_Dir (BMP_CONTEXT *ctx, const char *dir);
+// Traces the commands of the next runs into a Chrome trace file (build with TRACE=on).
+BMP_API u_int8_t         Bmp_Set_Trace      (BMP_CONTEXT *ctx, const char *file);
+// Gets the size of the image of a context.
+BMP_API u_int8_t         Bmp_Size           (const BMP_CONTEXT *ctx, int *width, int *height);
+
+// Loads the image from a BMP file.
+BMP_API u_int8_t         Bmp_Load_File      (BMP_CONTEXT *ctx, const char *file);
+// Loads the image from an open file descriptor, left open.
+BMP_API u_int8_t         Bmp_Load_Fd        (BMP_CONTEXT *ctx, int fd);
+// Loads the image from a BMP file held in memory.
+BMP_API u_int8_t         Bmp_Load_Memory    (BMP_CONTEXT *ctx, const void *data, size_t size);
+// Saves the image to a BMP file, written in the background.
+BMP_API u_int8_t         Bmp_Save_File      (BMP_CONTEXT *ctx, const char *file);
+// Writes the image to an open file descriptor, left open.
+BMP_API u_int8_t         Bmp_Save_Fd        (BMP_CONTEXT *ctx, int fd);
+// Encodes the image into a new buffer, freed by the caller.
+BMP_API u_int8_t         Bmp_Save_Memory    (BMP_CONTEXT *ctx, void **data, size_t *size);
+// Waits for the save in flight of a context.
+BMP_API u_int8_t         Bmp_Wait           (BMP_CONTEXT *ctx);
+
+// Sets the brush color.
+BMP_API u_int8_t         Bmp_Set_Color      (BMP_CONTEXT *ctx, u_int8_t R, u_int8_t G, u_int8_t B);
+// Sets the brush size, an odd number of pixels.
+BMP_API u_int8_t         Bmp_Set_Line       (BMP_CONTEXT *ctx, u_int8_t size);
+// Draws a line with the brush.
+BMP_API u_int8_t         Bmp_Line           (BMP_CONTEXT *ctx, int y1, int x1, int y2, int x2);
+// Draws the border of a rectangle.
+BMP_API u_int8_t         Bmp_Rectangle      (BMP_CONTEXT *ctx, int y1, int x1, int width, int height);
+// Draws the border of a triangle.
+BMP_API u_int8_t         Bmp_Triangle       (BMP_CONTEXT *ctx, int y1, int x1, int y2, int x2, int y3, int x3);
+// Draws a rectangle with its interior.
+BMP_API u_int8_t         Bmp_Filled_Rectangle(BMP_CONTEXT *ctx, int y1, int x1, int width, int height);
+// Draws a triangle with its interior.
+BMP_API u_int8_t         Bmp_Filled_Triangle(BMP_CONTEXT *ctx, int y1, int x1, int y2, int x2, int y3, int x3);
+// Draws a polygon with its interior.
+BMP_API u_int8_t         Bmp_Polygon        (BMP_CONTEXT *ctx, const int *y, const int *x, int count);
+// Fills the area around a pixel with the brush color.
+BMP_API u_int8_t         Bmp_Fill           (BMP_CONTEXT *ctx, int y, int x);
+// Inserts a BMP file into the image.
+BMP_API u_int8_t         Bmp_Insert         (BMP_CONTEXT *ctx, const char *file, int y, int x);
+
+// Runs a command script read from a file descriptor on a context.
+BMP_API u_int8_t         Bmp_Run            (BMP_CONTEXT *ctx, int fd, bool optimize, BMP_RUN *run);
+// Reports the insert cache and the canvases of a context (NULL: the cache only).
+BMP_API void             Bmp_Report         (const BMP_CONTEXT *ctx, FILE *fout);
+// Frees the insert cache and the pixel pool of the process.
+BMP_API void             Bmp_Shutdown       (void);
+
+#endif /* LIBBMP_H_ */
@@ -0,0 +1,363 @@
+#include "./include/bmp_image.h"
+#include "./include/api/instr.h"
+#include "./include/lib/cmd_span.h"
+#include "./include/libbmp.h"
+
+/**
+ * @brief Initialize a BMP object.
+ * 
+ * @return A pointer to the newly created BMP object, or NULL on failure.
+ */
+BMP_CONTEXT* Bmp_Create(void) {
+    SPAN_INIT();
+    BMP *bmp = (BMP*)malloc(sizeof(BMP));
+
+    // Initialize other BMP object members as needed.
+    if (bmp) {
+        bmp->brush_color = (u_int8_t*)calloc(SIZE_BRUSH, 1);
+
+        if (!bmp->brush_color) {
+            free(bmp);
+            bmp = NULL;
+        } else {
+            bmp->img = NULL;
+            bmp->map = NULL;
+            bmp->map_size = 0;
+            bmp->map_dev = 0;
+            bmp->map_ino = 0;
+            bmp->brush_size = 1;
+            bmp->stamp = STAMP_KERNEL(1);
+            SPAN_FILL(bmp->brush_line, bmp->brush_color, BRUSH_KERNELS);
+            bmp->threads = 1;
+            bmp->stack = NULL;
+            bmp->stack_size = 0;
+            bmp->band_top = 0;
+            bmp->band_rows = 0;
+            bmp->canvas_dir = NULL;
+            bmp->snap = NULL;
+            bmp->save = NULL;
+            bmp->save_failed = 0;
+            bmp->errors = 0;
+            bmp->canvases = NULL;
+            bmp->trace = NULL;
+            bmp->scratch = NULL;
+            bmp->allocs = 0;
+        }
+    }
+
+    return bmp;
+}
+
+/**
+ * @brief Cleanup a BMP object.
+ * Waits for its save in flight, the pixels go back to the pool.
+ * 
+ * @param bmp A pointer to the BMP object to be cleaned up.
+ */
+void Bmp_Destroy(BMP_CONTEXT *bmp) {
+    if (bmp) {
+        SAVE_WAIT(bmp);
+        CANVAS_FREE(bmp);
+        CANVAS_RELEASE(bmp);
+        TRACE_FREE(bmp);
+        FREE_BRUSH(bmp);
+        FREE_STACK(bmp);
+        SCRATCH_FREE(bmp);
+        free(bmp);
+    }
+}
+
+/**
+ * @brief Sets the worker threads of the fills and batched draws of a context.
+ * 
+ * @param bmp     The context.
+ * @param threads The number of threads, 1 to FILL_THREADS.
+ * @return EXIT_SUCCESS if the number is valid, EXIT_FAILURE otherwise.
+ */
+u_int8_t Bmp_Set_Threads(BMP_CONTEXT *bmp, int threads) {
+    if (!bmp || threads < 1 || threads > FILL_THREADS)
+        return EXIT_FAILURE;
+    bmp->threads = threads;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Keeps the pixels of the next images of a context in files of a directory.
+ * The path is not copied, it must outlive the context.
+ * 
+ * @param bmp The context.
+ * @param dir The directory, NULL to keep the pixels in memory.
+ */
+void Bmp_Set_Canvas_Dir(BMP_CONTEXT *bmp, const char *dir) {
+    if (bmp) bmp->canvas_dir = dir;
+}
+
+/**
+ * @brief Traces the commands run on a context by Bmp_Run.
+ * Every run ends with a summary table on stderr and the Chrome trace of all
+ * the commands so far written to the file.
+ * 
+ * @param bmp  The context.
+ * @param file The file receiving the Chrome trace (JSON).
+ * @return EXIT_SUCCESS if tracing started, EXIT_FAILURE if out of memory or
+ *         built without tracing (TRACE=on).
+ */
+u_int8_t Bmp_Set_Trace(BMP_CONTEXT *bmp, const char *file) {
+    return TRACE_OPEN(bmp, file);
+}
+
+/**
+ * @brief Gets the size of the image of a context.
+ * 
+ * @param bmp    The context.
+ * @param width  Set to the width of the image, in pixels.
+ * @param height Set to the height of the image, in pixels.
+ * @return EXIT_SUCCESS if the context has an image, EXIT_FAILURE otherwise.
+ */
+u_int8_t Bmp_Size(const BMP_CONTEXT *bmp, int *width, int *height) {
+    if (!bmp || !bmp->img)
+        return EXIT_FAILURE;
+    *width = bmp->info.width;
+    *height = bmp->info.height;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Loads the image of a context from a BMP file (EDIT).
+ */
+u_int8_t Bmp_Load_File(BMP_CONTEXT *bmp, const char *file) {
+    return EDIT((char*)file, bmp);
+}
+
+/**
+ * @brief Loads the image of a context from an open file descriptor, left open (EDIT_FD).
+ */
+u_int8_t Bmp_Load_Fd(BMP_CONTEXT *bmp, int fd) {
+    return EDIT_FD(fd, bmp);
+}
+
+/**
+ * @brief Loads the image of a context from a BMP file held in memory (EDIT_MEMORY).
+ */
+u_int8_t Bmp_Load_Memory(BMP_CONTEXT *bmp, const void *data, size_t size) {
+    return EDIT_MEMORY((const u_int8_t*)data, size, bmp);
+}
+
+/**
+ * @brief Saves the image of a context to a BMP file, written in the background (SAVE).
+ */
+u_int8_t Bmp_Save_File(BMP_CONTEXT *bmp, const char *file) {
+    return SAVE((char*)file, bmp);
+}
+
+/**
+ * @brief Writes the image of a context to an open file descriptor, left open (SAVE_FD).
+ */
+u_int8_t Bmp_Save_Fd(BMP_CONTEXT *bmp, int fd) {
+    return SAVE_FD(fd, bmp);
+}
+
+/**
+ * @brief Encodes the image of a context into a new buffer (SAVE_MEMORY).
+ */
+u_int8_t Bmp_Save_Memory(BMP_CONTEXT *bmp, void **data, size_t *size) {
+    return SAVE_MEMORY(bmp, (u_int8_t**)data, size);
+}
+
+/**
+ * @brief Waits for the save in flight of a context (SAVE_WAIT).
+ */
+u_int8_t Bmp_Wait(BMP_CONTEXT *bmp) {
+    return bmp ? SAVE_WAIT(bmp) : EXIT_FAILURE;
+}
+
+// The commands of the scripts, run on the image of a context.
+
+u_int8_t Bmp_Set_Color(BMP_CONTEXT *bmp, u_int8_t R, u_int8_t G, u_int8_t B) {
+    return SET_COLOR(bmp, R, G, B);
+}
+
+u_int8_t Bmp_Set_Line(BMP_CONTEXT *bmp, u_int8_t size) {
+    return SET_LINE(bmp, size);
+}
+
+u_int8_t Bmp_Line(BMP_CONTEXT *bmp, int y1, int x1, int y2, int x2) {
+    return LINE(bmp, y1, x1, y2, x2);
+}
+
+u_int8_t Bmp_Rectangle(BMP_CONTEXT *bmp, int y1, int x1, int width, int height) {
+    return RECTANGLE(bmp, y1, x1, width, height);
+}
+
+u_int8_t Bmp_Triangle(BMP_CONTEXT *bmp, int y1, int x1, int y2, int x2, int y3, int x3) {
+    return TRIANGLE(bmp, y1, x1, y2, x2, y3, x3);
+}
+
+u_int8_t Bmp_Filled_Rectangle(BMP_CONTEXT *bmp, int y1, int x1, int width, int height) {
+    return FILLED_RECTANGLE(bmp, y1, x1, width, height);
+}
+
+u_int8_t Bmp_Filled_Triangle(BMP_CONTEXT *bmp, int y1, int x1, int y2, int x2, int y3, int x3) {
+    return FILLED_TRIANGLE(bmp, y1, x1, y2, x2, y3, x3);
+}
+
+u_int8_t Bmp_Polygon(BMP_CONTEXT *bmp, const int *y, const int *x, int count) {
+    return POLYGON(bmp, y, x, count);
+}
+
+u_int8_t Bmp_Fill(BMP_CONTEXT *bmp, int y, int x) {
+    return FILL(bmp, y, x);
+}
+
+u_int8_t Bmp_Insert(BMP_CONTEXT *bmp, const char *file, int y, int x) {
+    return INSERT((char*)file, bmp, y, x);
+}
+
+/**
+ * @brief Runs a command script on a BMP object, then waits for its last save.
+ * Commands run as soon as they are parsed, unless the script is optimized first.
+ * 
+ * @param bmp      The BMP object.
+ * @param lex      The lexer reading the script.
+ * @param optimize Whether the whole script is parsed and optimized first.
+ * @param removed  The counters of the commands parsed and removed.
+ * @param memory   Set if the script stopped out of memory.
+ * @return EXIT_SUCCESS if the script ended with "quit", EXIT_FAILURE otherwise.
+ */
+static u_int8_t Run_Script(BMP *bmp, LEXER *lex, bool optimize, STATS *removed, bool *memory) {
+    PROGRAM program;
+    PROGRAM_INIT(&program);
+
+    const char *word = NULL;
+    size_t length = 0;
+    bool quit = false, invalid = false;
+    u_int8_t status = EXIT_SUCCESS;
+
+    while (!quit && !invalid && !status) {
+        if (LEX_WORD(lex, &word, &length)) {
+            invalid = true;
+            break;
+        }
+
+        // Check commands by their full name, unknown words are skipped.
+        switch (word[0]) {
+            case 's':
+                if (LEX_MATCH(word, length, "save"))
+                    status = Parse_Save(lex, &program);
+                else if (LEX_MATCH(word, length, "set"))
+                    status = Parse_Set(lex, &program);
+                break;
+            case 'e':
+                if (LEX_MATCH(word, length, "edit"))
+                    status = Parse_Edit(lex, &program);
+                break;
+            case 'd':
+                if (LEX_MATCH(word, length, "draw"))
+                    status = Parse_Draw(lex, &program);
+                break;
+            case 'f':
+                if (LEX_MATCH(word, length, "fill"))
+                    status = Parse_Fill(lex, &program);
+                break;
+            case 'c':
+                if (LEX_MATCH(word, length, "canvas"))
+                    status = Parse_Canvas(lex, &program);
+                break;
+            case 'i':
+                if (LEX_MATCH(word, length, "insert"))
+                    status = Parse_Insert(lex, &program);
+                break;
+            case 'q':
+                quit = LEX_MATCH(word, length, "quit");
+                break;
+            default:
+                break;
+        }
+
+        // With worker threads, draws wait for the next barrier to run as one batch.
+        bool batched = bmp->threads > 1 && program.count &&
+                       Is_Batched(program.commands + program.count - 1);
+        if (!optimize && !batched) {
+            removed->commands += program.count;
+            Handle_Program(bmp, &program);
+            PROGRAM_RESET(&program);
+        }
+    }
+
+    if (!status) {
+        if (optimize)
+            OPTIMIZE(&program, removed);
+        else
+            removed->commands += program.count;
+        Handle_Program(bmp, &program);
+    }
+
+    // Saves run in the background, the script is done once they are written.
+    SAVE_WAIT(bmp);
+    PROGRAM_FREE(&program);
+
+    *memory = status;
+    return invalid || status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * @brief Runs a command script read from a file descriptor on a context.
+ * The script runs as the stdin interpreter does (see Run_Script), the counters
+ * of the run only cover its own commands.
+ * 
+ * @param bmp      The context.
+ * @param fd       The file descriptor of the script, left open.
+ * @param optimize Whether the whole script is parsed and optimized first.
+ * @param run      The counters of the run.
+ * @return EXIT_SUCCESS if the script ended with "quit", EXIT_FAILURE otherwise.
+ */
+u_int8_t Bmp_Run(BMP_CONTEXT *bmp, int fd, bool optimize, BMP_RUN *run) {
+    STATS removed = { 0, 0, 0, 0 };
+    bool memory = false;
+    LEXER lex;
+
+    memset(run, 0, sizeof(*run));
+    if (!bmp || LEX_OPEN(&lex, fd)) {
+        run->error = "reading instructions";
+        return EXIT_FAILURE;
+    }
+
+    size_t errors = bmp->errors, save_failed = bmp->save_failed, allocs = bmp->allocs;
+    u_int8_t status = Run_Script(bmp, &lex, optimize, &removed, &memory);
+    LEX_CLOSE(&lex);
+
+    if (TRACE_REPORT(bmp->trace, stderr))
+        fprintf(stderr, "ERROR: writing the trace...\n");
+
+    run->commands = removed.commands;
+    run->sets = removed.sets;
+    run->covered = removed.covered;
+    run->merged = removed.merged;
+    run->errors = bmp->errors - errors;
+    run->save_failed = bmp->save_failed - save_failed;
+    run->allocs = bmp->allocs - allocs;
+    if (status)
+        run->error = memory ? "out of memory" : "invalid instruction";
+    return status;
+}
+
+/**
+ * @brief Reports the insert cache counters and the canvases of a context.
+ * 
+ * @param bmp  The context, NULL to report the cache only.
+ * @param fout The output file stream of the report.
+ */
+void Bmp_Report(const BMP_CONTEXT *bmp, FILE *fout) {
+    CACHE_REPORT(fout);
+    if (bmp)
+        CANVAS_REPORT(bmp, fout);
+}
+
+/**
+ * @brief Frees the insert cache and the pixel pool of the process.
+ * No context may run anymore.
+ */
+void Bmp_Shutdown(void) {
+    CACHE_CLEAR();
+    POOL_CLEAR();
+}